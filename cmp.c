@@ -1,28 +1,128 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define BLOCKSIZE 4096
 
 typedef struct merkel_tree{
-    struct merkel_tree* l;
-    struct merkel_tree* r;
+    struct merkel_tree** children;
+    int nbChildren;
     int block;
-    int hash;
+    unsigned char* hash;
     int depth;
 }merkel_tree;
-#define EXT4_IOC_GETTREE _IOWR('f',22, struct merkel_tree)
 
-typedef struct byteDiffLinked{
-    int pos;
-    char a;
-    char b;
-    struct byteDiffLinked* next;
-    struct byteDiffLinked* last;
-}byteDiffLinked;
+typedef struct ext42_merkel_export{
+    unsigned int mode;
+    unsigned int level;
+    unsigned int index;
+    unsigned int count;
+    unsigned int total;
+    unsigned int nbLeaves;
+    unsigned int depth;
+    unsigned short hashAlg;
+    unsigned short hashSize;
+    unsigned int fanout;
+    unsigned int reserved;
+    unsigned long long version;
+    unsigned long long buf;
+}ext42_merkel_export;
+#define EXT4_IOC_GETTREE_BULK _IOWR('f',23, struct ext42_merkel_export)
+#define EXPORT_LEVEL 0
+#define EXPORT_MAX (1 << 20)
+
+typedef struct ext42_merkel_range{
+    unsigned int start;
+    unsigned int len;
+}ext42_merkel_range;
+
+typedef struct ext42_merkel_diff{
+    int fd;
+    unsigned int start;
+    unsigned int count;
+    unsigned int next;
+    unsigned long long version;
+    unsigned long long otherVersion;
+    unsigned long long ranges;
+}ext42_merkel_diff;
+#define EXT4_IOC_DIFFTREE _IOWR('f',24, struct ext42_merkel_diff)
+#define DIFF_MAX (1 << 16)
+
+typedef struct ext42_merkel_root{
+    unsigned char root[32];
+    unsigned long long generation;
+    unsigned long long iVersion;
+    unsigned long long size;
+    unsigned int nbLeaves;
+    unsigned short hashAlg;
+    unsigned short hashSize;
+    unsigned int fanout;
+    unsigned int reserved;
+}ext42_merkel_root;
+#define EXT4_IOC_GETROOT _IOR('f',27, struct ext42_merkel_root)
+#define HASH_SHA256 2
+#define STRONG_HASH_SIZE 16
+
+//bytes per hash and children per node, the same for every file of a filesystem
+unsigned int hashSize = 0;
+unsigned int fanout = 0;
+
+//whole file mapped read only, data is NULL for an empty file
+typedef struct mappedFile{
+    const unsigned char* data;
+    size_t size;
+}mappedFile;
+
+typedef struct byteDiff{
+    long long pos;
+    unsigned char a;
+    unsigned char b;
+}byteDiff;
+
+//growable array, appends are amortized O(1)
+typedef struct byteDiffs{
+    byteDiff* items;
+    size_t count;
+    size_t capacity;
+}byteDiffs;
+
+//content defined chunks : boundaries depend on the bytes around them, not on
+//their offset, so an insertion only changes the chunks it touches.  This is
+//a userspace mode over the whole of both files, the kernel trees keep fixed
+//BLOCKSIZE leaves and are not used by it
+#define CHUNK_MIN 2048
+#define CHUNK_AVG 8192
+#define CHUNK_MAX 65536
+#define CHUNK_MASK_SMALL 0x0000d9f003530000ULL
+#define CHUNK_MASK_LARGE 0x0000d90003530000ULL
+
+typedef struct chunk{
+    size_t off;
+    size_t len;
+    uint64_t hash;
+    long long next;
+}chunk;
+
+typedef struct chunkList{
+    chunk* items;
+    size_t count;
+    size_t capacity;
+    long long* slots;
+    long long* heads;       //per slot, first chunk not yet passed by findChunk
+    size_t nbSlots;
+}chunkList;
+
+uint64_t gear[256];
 
 //------------------------------------
 //------------------------------------
@@ -34,7 +134,7 @@ int max(int a, int b)
     return (a>b)?a:b;
 }
 
-int getPadding(int maxVal)
+int getPadding(long long maxVal)
 {
     int pad = 0;
     for(;maxVal != 0;maxVal/=10)    
@@ -42,28 +142,23 @@ int getPadding(int maxVal)
     return pad;
 }
 
-int getShortestFile(FILE* fdA, FILE* fdB)
-{    
-    fseek(fdA, 0, SEEK_END);
-    fseek(fdB, 0, SEEK_END);
-    int posA = ftell(fdA);
-    int posB = ftell(fdB);
-    
+int getShortestFile(mappedFile* fA, mappedFile* fB)
+{
     //return shortest
-    if(posA>posB)
+    if(fA->size>fB->size)
         return 3;
-    else if(posB>posA)
+    else if(fB->size>fA->size)
         return 2;
     else 
-        return NULL;
+        return 0;
 }
 
 void freeMerkelTree(merkel_tree* tree)
 {
-    if(tree->block < 0)
-        freeMerkelTree(tree->l);
-    if(tree->block == -2)
-        freeMerkelTree(tree->r);
+    for(int i = 0;i < tree->nbChildren;i++)
+        freeMerkelTree(tree->children[i]);
+    free(tree->children);
+    free(tree->hash);
     free(tree);
 }
 
@@ -73,43 +168,97 @@ void freeMerkelTree(merkel_tree* tree)
 //------------------------------------
 //------------------------------------
 
-merkel_tree* getNode(int fd,int path,int depth)
+void exportLevel(int fd, ext42_merkel_export* exp, unsigned int level, unsigned int index, unsigned char* buf, unsigned int count)
 {
-    //init
-    merkel_tree* tmp = malloc(sizeof(merkel_tree));
-    tmp->depth = depth;
-    tmp->block = path;        
+    exp->mode  = EXPORT_LEVEL;
+    exp->level = level;
+    exp->index = index;
+    exp->count = count;
+    exp->buf   = (unsigned long long)(unsigned long)buf;
 
-    //get node
     int err;
-    if ((err = ioctl(fd, EXT4_IOC_GETTREE, tmp)))
+    if ((err = ioctl(fd, EXT4_IOC_GETTREE_BULK, exp)))
     {
         close(fd);
         fprintf(stderr,"error ioctl : %d\n",err);
         exit(EXIT_FAILURE);
-    }   
+    }
+}
+
+unsigned char** getLevels(int fd, ext42_merkel_export* exp, unsigned int* counts)
+{
+    //get tree size
+    exportLevel(fd, exp, 0, 0, NULL, 0);
+    unsigned long long version = exp->version;
+    unsigned int depth = exp->depth;
+    unsigned int nbLeaves = exp->nbLeaves;
+    unsigned int size = exp->hashSize;
+
+    //hashes are only comparable between trees of the same width
+    if(hashSize && size != hashSize)
+    {
+        fprintf(stderr,"error : trees use %u and %u byte hashes\n",hashSize,size);
+        exit(EXIT_FAILURE);
+    }
+    hashSize = size;
+    if(fanout && exp->fanout != fanout)
+    {
+        fprintf(stderr,"error : trees use %u and %u children per node\n",fanout,exp->fanout);
+        exit(EXIT_FAILURE);
+    }
+    fanout = exp->fanout;
+
+    //get each level, up to EXPORT_MAX hashes per call
+    unsigned char** levels = malloc(sizeof(unsigned char*)*(depth+1));
+    for(unsigned int l = 0;l <= depth;l++)
+    {
+        counts[l] = nbLeaves;
+        for(unsigned int k = 0;k < l;k++)
+            counts[l] = (counts[l]+fanout-1)/fanout;
+        levels[l] = malloc((size_t)size*counts[l]);
+        for(unsigned int i = 0;i < counts[l];i += exp->count)
+        {
+            exportLevel(fd, exp, l, i, levels[l]+(size_t)i*size, counts[l]-i < EXPORT_MAX ? counts[l]-i : EXPORT_MAX);
+            if(exp->version != version || exp->count == 0)
+                break;
+        }
 
-    return tmp;
+        //tree modified between two calls : start over
+        if(exp->version != version || exp->count == 0)
+        {
+            for(unsigned int k = 0;k <= l;k++)
+                free(levels[k]);
+            free(levels);
+            return NULL;
+        }
+    }
+    return levels;
 }
 
-void getFileTreeBis(int fd, merkel_tree* tree, int path, int mult, int depth)
+merkel_tree* buildNode(unsigned char** levels, unsigned int* counts, int level, unsigned int pos)
 {
-    //check if leaf
-    if(tree->block >= 0)
-        return;
-    
-    //get left child
-    tree->l = getNode(fd,path, depth);
-    getFileTreeBis(fd, tree->l, path, mult*2, depth-1);
+    merkel_tree* node = malloc(sizeof(merkel_tree));
+    node->hash  = malloc(hashSize);
+    memcpy(node->hash, levels[level]+(size_t)pos*hashSize, hashSize);
+    node->depth      = level;
+    node->children   = NULL;
+    node->nbChildren = 0;
 
-    //get right child if exist
-    if(tree->block != -2)
+    //leaf
+    if(level == 0)
     {
-        tree->r = NULL;
-        return;
+        node->block = pos;
+        return node;
     }
-    tree->r = getNode(fd,path+mult, depth);
-    getFileTreeBis(fd, tree->r, path+mult, mult*2, depth-1);
+
+    //children, the last node of a level may have fewer
+    unsigned int first = pos*fanout;
+    node->nbChildren = counts[level-1]-first < fanout ? counts[level-1]-first : fanout;
+    node->children   = malloc(sizeof(merkel_tree*)*node->nbChildren);
+    for(int i = 0;i < node->nbChildren;i++)
+        node->children[i] = buildNode(levels, counts, level-1, first+i);
+    node->block = -node->nbChildren;
+    return node;
 }
 
 merkel_tree* getFileTree(char* filename)
@@ -122,60 +271,78 @@ merkel_tree* getFileTree(char* filename)
         exit(EXIT_FAILURE);
     }
 
-    //get tree
-    merkel_tree* root = getNode(fd,0,-1);
-    getFileTreeBis(fd, root, 0, 1, root->depth-1);
+    //get all levels in a few calls, retrying if the file changes meanwhile
+    ext42_merkel_export exp;
+    unsigned int counts[33];
+    unsigned char** levels;
+    while(!(levels = getLevels(fd, &exp, counts)));
     close(fd);
+
+    //link nodes
+    merkel_tree* root = buildNode(levels, counts, exp.depth, 0);
+    for(unsigned int l = 0;l <= exp.depth;l++)
+        free(levels[l]);
+    free(levels);
     return root;
 }
 
 
-char* getBlock(FILE* fd,int blknb)
+void mapFile(char* filename, mappedFile* file)
+{
+    //open file
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    //map it whole, blocks are then compared in place
+    file->size = st.st_size;
+    file->data = NULL;
+    if(file->size)
+    {
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        file->data = data;
+    }
+    close(fd);
+}
+
+void unmapFile(mappedFile* file)
 {
-    //get block
-    char ch;
-    char* str = malloc(sizeof(char)*(BLOCKSIZE+1));
-    int i;
-    fseek(fd, blknb*BLOCKSIZE, SEEK_SET);
-    for(i=0;(ch = fgetc(fd)) != EOF && i<BLOCKSIZE;i++)
-        str[i] = ch;
-    str[i] = '\0';
-    return str;
+    if(file->data)
+        munmap((void*)file->data, file->size);
 }
 
 //----------------------------------------------------
 //----------------------------------------------------
-//          byteDiffLinked operations
+//          byteDiffs operations
 //----------------------------------------------------
 //----------------------------------------------------
 
-byteDiffLinked* byteDiffLinked_create(int pos,char a,char b)
-{
-    byteDiffLinked* ret = malloc(sizeof(byteDiffLinked));
-    ret->pos  = pos;
-    ret->a    = a;
-    ret->b    = b;
-    ret->next = NULL;
-    ret->last = NULL;
-    
-    return ret;
-}
-
-byteDiffLinked* byteDiffLinked_append(byteDiffLinked* root, byteDiffLinked* node)
+void byteDiffs_append(byteDiffs* diffs, long long pos, unsigned char a, unsigned char b)
 {
-    if(!root)
+    if(diffs->count == diffs->capacity)
     {
-        node->last = node;
-        return node;
+        diffs->capacity = diffs->capacity ? 2*diffs->capacity : 1024;
+        diffs->items = realloc(diffs->items, sizeof(byteDiff)*diffs->capacity);
+        if(!diffs->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
     }
-    
-    root->last->next = node;
-    
-    if(!node->last)
-        root->last = node;    
-    else
-        root->last = node->last;
-    return root;
+
+    byteDiff* d = &diffs->items[diffs->count++];
+    d->pos = pos;
+    d->a   = a;
+    d->b   = b;
 }
 
 
@@ -186,56 +353,345 @@ byteDiffLinked* byteDiffLinked_append(byteDiffLinked* root, byteDiffLinked* node
 //----------------------------------------
 //----------------------------------------
 
-byteDiffLinked* compareStrings(char* str1,char* str2,int blknb)
+size_t mismatch(const unsigned char* a, const unsigned char* b, size_t len)
 {
-    byteDiffLinked* ret = NULL;
-    for(int i=0;i<BLOCKSIZE;i++)
+    //index of the first differing byte, len if there is none
+    size_t i = 0;
+#ifdef __SSE2__
+    for(;i+16 <= len;i += 16)
     {
-        //be waware that file may not be the same size
-        if((str1[i] == '\0') || (str2[i] == '\0'))
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if(eq != 0xffff)
+            return i + __builtin_ctz(~eq);
+    }
+#endif
+    for(;i+8 <= len;i += 8)
+    {
+        uint64_t wa, wb;
+        memcpy(&wa, a+i, 8);
+        memcpy(&wb, b+i, 8);
+        if(wa != wb)
             break;
-        
-        //if differ => add a ByteDiffLinkedNode
-        if(str1[i] != str2[i])
-        {
-            byteDiffLinked* bdln = byteDiffLinked_create(1+i+(blknb*BLOCKSIZE),str1[i],str2[i]);
-            ret = byteDiffLinked_append(ret,bdln);
-        }        
     }
-    
-    return ret;
+    for(;i < len && a[i] == b[i];i++);
+    return i;
 }
 
-byteDiffLinked* getByteDiff(FILE* file1,FILE* file2,merkel_tree* t1,merkel_tree* t2)
+void compareBlocks(mappedFile* file1, mappedFile* file2, int blknb, byteDiffs* diffs)
+{
+    //be aware that files may not be the same size, only the common part is compared
+    size_t off    = (size_t)blknb*BLOCKSIZE;
+    size_t common = file1->size < file2->size ? file1->size : file2->size;
+    if(off >= common)
+        return;
+    size_t len = common-off < BLOCKSIZE ? common-off : BLOCKSIZE;
+
+    const unsigned char* a = file1->data+off;
+    const unsigned char* b = file2->data+off;
+    for(size_t i = mismatch(a, b, len);i < len;i += 1+mismatch(a+i+1, b+i+1, len-i-1))
+        byteDiffs_append(diffs, 1+off+i, a[i], b[i]);
+}
+
+void getByteDiff(mappedFile* file1, mappedFile* file2, merkel_tree* t1, merkel_tree* t2, byteDiffs* diffs)
 {   
     //check same root hash
-    if(t1->hash == t2->hash)
-        return NULL;   
+    if(!memcmp(t1->hash, t2->hash, hashSize))
+        return;
         
     //if leaves, get difference and return
     if(t1->block == t2->block && t2->block >= 0)
     {
-       
-        char* str1 = getBlock(file1, t2->block);
-        char* str2 = getBlock(file2, t2->block);
-        byteDiffLinked* res = compareStrings(str1, str2, t2->block);
-        
-        free(str1);
-        free(str2);
-
-        return res;        
+        compareBlocks(file1, file2, t2->block, diffs);
+        return;
     }    
    
     //else go deeper
-    byteDiffLinked* ret = NULL;
-    if(t1->l && t2->l)
-        ret = byteDiffLinked_append(ret,getByteDiff(file1, file2, t1->l, t2->l));
-    if(t1->r && t2->r)
-        ret = byteDiffLinked_append(ret,getByteDiff(file1, file2, t1->r, t2->r));
-    
+    for(int i = 0;i < t1->nbChildren && i < t2->nbChildren;i++)
+        getByteDiff(file1, file2, t1->children[i], t2->children[i], diffs);
+}
+
+int strongRoot(ext42_merkel_root* r)
+{
+    //only hashes too long to collide by chance tell blocks apart : a 32-bit
+    //crc32c matches for 1 in 4 billion differing blocks
+    return r->hashAlg == HASH_SHA256 || r->hashSize >= STRONG_HASH_SIZE;
+}
+
+int strongHashes(char* filename)
+{
+    ext42_merkel_root r;
+    int fd = open(filename, O_RDONLY);
+    int strong = fd >= 0 && !ioctl(fd, EXT4_IOC_GETROOT, &r) && strongRoot(&r);
+    if(fd >= 0)
+        close(fd);
+    return strong;
+}
+
+void compareAll(mappedFile* file1, mappedFile* file2, byteDiffs* diffs)
+{
+    //every block of the common part, for trees whose matching hashes prove nothing
+    size_t common = file1->size < file2->size ? file1->size : file2->size;
+    for(size_t b = 0;b < (common+BLOCKSIZE-1)/BLOCKSIZE;b++)
+        compareBlocks(file1, file2, b, diffs);
+}
+
+int sameRoots(char* filename1, char* filename2)
+{
+    //one call per file tells identical files apart without reading them,
+    //only trusted with strong hashes, other files are compared
+    ext42_merkel_root r1, r2;
+    int fd1 = open(filename1, O_RDONLY);
+    int fd2 = open(filename2, O_RDONLY);
+    int same = fd1 >= 0 && fd2 >= 0 &&
+               !ioctl(fd1, EXT4_IOC_GETROOT, &r1) && !ioctl(fd2, EXT4_IOC_GETROOT, &r2) &&
+               r1.hashAlg == r2.hashAlg && r1.hashSize == r2.hashSize && r1.size == r2.size &&
+               strongRoot(&r1) &&
+               !memcmp(r1.root, r2.root, r1.hashSize);
+    if(fd1 >= 0)
+        close(fd1);
+    if(fd2 >= 0)
+        close(fd2);
+    return same;
+}
+
+int getKernelDiff(char* filename1, char* filename2, mappedFile* file1, mappedFile* file2, byteDiffs* diffs)
+{
+    //open files
+    int fd1 = open(filename1, O_RDONLY);
+    int fd2 = open(filename2, O_RDONLY);
+    if (fd1 < 0 || fd2 < 0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    //get the differing blocks, starting over if a file changes meanwhile
+    ext42_merkel_range* ranges = malloc(sizeof(ext42_merkel_range)*DIFF_MAX);
+    ext42_merkel_diff diff;
+    unsigned long long version = 0, otherVersion = 0;
+    int ret = 0;
+    diff.next = 0;
+    do
+    {
+        diff.fd     = fd2;
+        diff.start  = diff.next;
+        diff.count  = DIFF_MAX;
+        diff.ranges = (unsigned long long)(unsigned long)ranges;
+        if (ioctl(fd1, EXT4_IOC_DIFFTREE, &diff))
+        {
+            //files on different filesystems or older kernel : compare trees here
+            if(errno != EXDEV && errno != ENOTTY)
+            {
+                perror("ioctl");
+                exit(EXIT_FAILURE);
+            }
+            ret = -1;
+            break;
+        }
+        if(diff.start && (diff.version != version || diff.otherVersion != otherVersion))
+        {
+            diffs->count = 0;
+            diff.next    = 0;
+            diff.count   = DIFF_MAX;
+            continue;
+        }
+        version      = diff.version;
+        otherVersion = diff.otherVersion;
+
+        for(unsigned int i = 0;i < diff.count;i++)
+            for(unsigned int b = 0;b < ranges[i].len;b++)
+                compareBlocks(file1, file2, ranges[i].start+b, diffs);
+    } while(diff.count == DIFF_MAX);
+
+    free(ranges);
+    close(fd1);
+    close(fd2);
     return ret;
 }
 
+//----------------------------------------
+//----------------------------------------
+//          content defined chunking
+//----------------------------------------
+//----------------------------------------
+
+void initGear(void)
+{
+    //fixed seed, both files must be cut with the same table
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for(int i = 0;i < 256;i++)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cutPoint(const unsigned char* data, size_t len)
+{
+    //gear rolling hash, a stricter mask before CHUNK_AVG and a looser one
+    //after keeps chunk sizes close to the average
+    if(len <= CHUNK_MIN)
+        return len;
+    if(len > CHUNK_MAX)
+        len = CHUNK_MAX;
+    size_t avg = len < CHUNK_AVG ? len : CHUNK_AVG;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+    for(;i < avg;i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if(!(h & CHUNK_MASK_SMALL))
+            return i+1;
+    }
+    for(;i < len;i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if(!(h & CHUNK_MASK_LARGE))
+            return i+1;
+    }
+    return len;
+}
+
+uint64_t chunkHash(const unsigned char* data, size_t len)
+{
+    //FNV-1a, only used to find candidates, matches are checked with memcmp
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0;i < len;i++)
+        h = (h ^ data[i])*0x100000001b3ULL;
+    return h;
+}
+
+void chunkList_append(chunkList* list, size_t off, size_t len, uint64_t hash)
+{
+    if(list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? 2*list->capacity : 1024;
+        list->items = realloc(list->items, sizeof(chunk)*list->capacity);
+        if(!list->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    chunk* c = &list->items[list->count++];
+    c->off  = off;
+    c->len  = len;
+    c->hash = hash;
+    c->next = -1;
+}
+
+int sameChunk(mappedFile* fA, chunk* a, mappedFile* fB, chunk* b)
+{
+    return a->hash == b->hash && a->len == b->len && !memcmp(fA->data+a->off, fB->data+b->off, a->len);
+}
+
+void getChunks(mappedFile* file, chunkList* list)
+{
+    for(size_t off = 0;off < file->size;)
+    {
+        size_t len = cutPoint(file->data+off, file->size-off);
+        chunkList_append(list, off, len, chunkHash(file->data+off, len));
+        off += len;
+    }
+}
+
+void indexChunks(mappedFile* file, chunkList* list)
+{
+    //open addressing on the hash, one slot per distinct chunk content,
+    //identical chunks are chained in file order through next
+    list->nbSlots = 1;
+    while(list->nbSlots < 2*list->count)
+        list->nbSlots <<= 1;
+    list->slots = malloc(sizeof(long long)*list->nbSlots);
+    list->heads = malloc(sizeof(long long)*list->nbSlots);
+    for(size_t s = 0;s < list->nbSlots;s++)
+        list->slots[s] = -1;
+
+    for(long long i = (long long)list->count-1;i >= 0;i--)
+    {
+        chunk* c = &list->items[i];
+        size_t s = c->hash & (list->nbSlots-1);
+        for(;list->slots[s] >= 0;s = (s+1) & (list->nbSlots-1))
+            if(sameChunk(file, c, file, &list->items[list->slots[s]]))
+            {
+                c->next = list->slots[s];
+                break;
+            }
+        list->slots[s] = i;
+    }
+    memcpy(list->heads, list->slots, sizeof(long long)*list->nbSlots);
+}
+
+long long findChunk(mappedFile* fA, chunk* a, mappedFile* fB, chunkList* list, size_t from)
+{
+    //first chunk of list at or after from holding the same bytes as a.
+    //from never decreases, so chunks passed once are dropped from the head
+    //of their chain and runs of identical chunks cost O(n) overall
+    if(!list->nbSlots)
+        return -1;
+    size_t s = a->hash & (list->nbSlots-1);
+    for(;list->slots[s] >= 0;s = (s+1) & (list->nbSlots-1))
+    {
+        if(!sameChunk(fA, a, fB, &list->items[list->slots[s]]))
+            continue;
+        long long i = list->heads[s];
+        for(;i >= 0 && (size_t)i < from;i = list->items[i].next);
+        list->heads[s] = i;
+        return i;
+    }
+    return -1;
+}
+
+size_t chunkEnd(chunkList* list, size_t i, mappedFile* file)
+{
+    return i < list->count ? list->items[i].off : file->size;
+}
+
+void getChunkDiff(mappedFile* file1, mappedFile* file2)
+{
+    chunkList c1 = { NULL, 0, 0, NULL, NULL, 0 };
+    chunkList c2 = { NULL, 0, 0, NULL, NULL, 0 };
+    initGear();
+    getChunks(file1, &c1);
+    getChunks(file2, &c2);
+    indexChunks(file2, &c2);
+
+    //walk both lists, on a mismatch resynchronize on the next chunk of
+    //file1 found further in file2, what was skipped on both sides differs
+    size_t i = 0, j = 0;
+    while(i < c1.count || j < c2.count)
+    {
+        if(i < c1.count && j < c2.count && sameChunk(file1, &c1.items[i], file2, &c2.items[j]))
+        {
+            i++;
+            j++;
+            continue;
+        }
+
+        size_t k = i;
+        long long m = -1;
+        for(;k < c1.count && (m = findChunk(file1, &c1.items[k], file2, &c2, j)) < 0;k++);
+        if(m < 0)
+            m = c2.count;
+
+        size_t off1 = chunkEnd(&c1, i, file1);
+        size_t off2 = chunkEnd(&c2, j, file2);
+        printf("%zu,%zu %zu,%zu\n", off1+1, chunkEnd(&c1, k, file1)-off1, off2+1, chunkEnd(&c2, m, file2)-off2);
+        i = k;
+        j = m;
+    }
+
+    free(c1.items);
+    free(c2.items);
+    free(c2.slots);
+    free(c2.heads);
+}
+
 //--------------------
 //--------------------
 //        main
@@ -245,79 +701,77 @@ byteDiffLinked* getByteDiff(FILE* file1,FILE* file2,merkel_tree* t1,merkel_tree*
 int main (int argc, char *argv[])
 {
     //check arguments
-    if(argc != 4 || strcmp(argv[1],"-l"))
+    if(argc != 4 || (strcmp(argv[1],"-l") && strcmp(argv[1],"-c")))
     {
-        printf("Missing arguments expected custom_cmp -l <file1> <file2>\n");
+        printf("Missing arguments expected custom_cmp -l|-c <file1> <file2>\n");
         return -1;
     }
    
-    //get trees
-    merkel_tree* t1 = getFileTree(argv[2]);
-    merkel_tree* t2 = getFileTree(argv[3]);
-    while(t2->depth > t1->depth)
-        t2 = t2->l;
-    while(t1->depth > t2->depth)
-        t1 = t1->l;
-    
-    //open files
-    FILE* f1 = fopen(argv[2], "r");
-    if (!f1) 
+    //nothing to print for identical files
+    if(sameRoots(argv[2], argv[3]))
+        return 0;
+
+    //map files
+    mappedFile f1, f2;
+    mapFile(argv[2], &f1);
+    mapFile(argv[3], &f2);
+
+    //print the differing regions of both files, unaffected by shifts
+    if(!strcmp(argv[1],"-c"))
     {
-        perror("open");
-        return NULL;
+        getChunkDiff(&f1, &f2);
+        unmapFile(&f1);
+        unmapFile(&f2);
+        return 0;
     }
-    FILE* f2 = fopen(argv[3], "r");
-    if (!f2) 
+    
+    //compare in one call, or fetch and walk both trees.  Both skip blocks
+    //whose leaves match, so weak hashes mean reading everything
+    byteDiffs res = { NULL, 0, 0 };
+    if(!strongHashes(argv[2]) || !strongHashes(argv[3]))
+        compareAll(&f1, &f2, &res);
+    else if(getKernelDiff(argv[2], argv[3], &f1, &f2, &res))
     {
-        perror("open");
-        return NULL;
+        merkel_tree* t1 = getFileTree(argv[2]);
+        merkel_tree* t2 = getFileTree(argv[3]);
+        merkel_tree* r1 = t1;
+        merkel_tree* r2 = t2;
+        while(t2->depth > t1->depth)
+            t2 = t2->children[0];
+        while(t1->depth > t2->depth)
+            t1 = t1->children[0];
+        getByteDiff(&f1, &f2, t1, t2, &res);
+        freeMerkelTree(r1);
+        freeMerkelTree(r2);
     }
     
-    //compare tree
-    byteDiffLinked* res = getByteDiff(f1, f2, t1, t2);
-    
     //get padding
-    int maxPos = 0, maxA = 0, maxB = 0;
-    if(res)
+    long long maxPos = 0;
+    int maxA = 0, maxB = 0;
+    for(size_t i = 0;i < res.count;i++)
     {
-        byteDiffLinked* it = res;
-        while(it)
-        {            
-            maxPos = max(maxPos, it->pos);
-            maxA   = max(maxA, it->a);
-            maxB   = max(maxB, it->b);
-            it     = it->next;           
-        }
+        if(res.items[i].pos > maxPos)
+            maxPos = res.items[i].pos;
+        maxA = max(maxA, res.items[i].a);
+        maxB = max(maxB, res.items[i].b);
     }
     int padPos = getPadding(maxPos);
     int padA   = getPadding(maxA);
     int padB   = getPadding(maxB);
     
 
-    //if diff exist, print out and free linked list    
-    if(res)  
-    {        
-        byteDiffLinked* it = res;
-        while(it)     
-        {               
-            printf("%*d %*o %*o\n", padPos, it->pos, padA, it->a, padB, it->b);
-            
-            byteDiffLinked* toFree = it;
-            it = it->next;
-            free(toFree);
-        }
-    }
+    //if diff exist, print out
+    for(size_t i = 0;i < res.count;i++)
+        printf("%*lld %*o %*o\n", padPos, res.items[i].pos, padA, res.items[i].a, padB, res.items[i].b);
+    free(res.items);
     
     //display EOF message if needed
-    char* shortest = argv[getShortestFile(f1, f2)];
+    int shortest = getShortestFile(&f1, &f2);
     if(shortest)
-        printf("cmp: EOF on %s\n", shortest);
+        printf("cmp: EOF on %s\n", argv[shortest]);
     
     //free and quit    
-    fclose(f1);
-    fclose(f2);
-    freeMerkelTree(t1);
-    freeMerkelTree(t2);
+    unmapFile(&f1);
+    unmapFile(&f2);
     return 0;
 }
-
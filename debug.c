@@ -0,0 +1,153 @@
+/*
+ *  linux/fs/ext42/debug.c
+ *
+ *  Debug messages of ext42, see D() in ext4.h.
+ *
+ *  Each subsystem has a static key, flipped from /sys/fs/ext42/debug/: a
+ *  disabled D() is a nop in the instruction stream and its arguments are
+ *  never evaluated.  Enabled messages are formatted into a ring of the
+ *  current CPU instead of going through printk, so writers never share a
+ *  lock or a cache line; the oldest entries are overwritten.
+ *
+ *  A writer claims its slot with a local increment of the ring head, which
+ *  an interrupt on the same CPU cannot tear, and publishes the entry by
+ *  setting its sequence number last.  /proc/fs/ext42/debug_log copies the
+ *  entries of every CPU without locking and skips those whose sequence
+ *  number changed while they were copied.
+ */
+
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <asm/local.h>
+#include "ext4.h"
+
+/* entries per CPU, a power of 2 */
+#define DBG_RING_SHIFT  7
+#define DBG_RING_SIZE   (1U << DBG_RING_SHIFT)
+#define DBG_MSG_LEN     104
+
+struct dbgEntry {
+    unsigned long seq;      /* position + 1 once written, 0 while writing */
+    u64           time;     /* local_clock() */
+    const char*   func;
+    unsigned int  line;
+    unsigned int  subsys;
+    char          msg[DBG_MSG_LEN];
+};
+
+struct dbgRing {
+    local_t         head;   /* positions handed out so far */
+    struct dbgEntry entries[DBG_RING_SIZE];
+};
+
+struct static_key_false ext42_dbg_keys[EXT42_DBG_NR] = {
+    [0 ... EXT42_DBG_NR-1] = STATIC_KEY_FALSE_INIT,
+};
+
+static const char* const subsysNames[EXT42_DBG_NR] = {
+    [EXT42_DBG_FILE]   = "file",
+    [EXT42_DBG_NAMEI]  = "namei",
+    [EXT42_DBG_MERKEL] = "merkel",
+};
+
+static struct dbgRing __percpu* rings;
+
+void __ext42_dbg(unsigned int subsys, const char* func, unsigned int line,
+         const char* fmt, ...)
+{
+    struct dbgRing* ring = get_cpu_ptr(rings);
+    struct dbgEntry* e;
+    unsigned long pos;
+    va_list args;
+
+    pos = local_inc_return(&ring->head) - 1;
+    e   = &ring->entries[pos & (DBG_RING_SIZE-1)];
+    WRITE_ONCE(e->seq, 0);
+    smp_wmb();
+
+    e->time   = local_clock();
+    e->func   = func;
+    e->line   = line;
+    e->subsys = subsys;
+    va_start(args, fmt);
+    vsnprintf(e->msg, sizeof(e->msg), fmt, args);
+    va_end(args);
+
+    smp_wmb();
+    WRITE_ONCE(e->seq, pos+1);
+    put_cpu_ptr(rings);
+}
+
+/* Copy the entry at @pos, return 0 if it is being or was rewritten */
+static int copyEntry(struct dbgRing* ring, unsigned long pos, struct dbgEntry* copy)
+{
+    struct dbgEntry* e = &ring->entries[pos & (DBG_RING_SIZE-1)];
+
+    if(READ_ONCE(e->seq) != pos+1)
+        return 0;
+    smp_rmb();
+    memcpy(copy, e, sizeof(*copy));
+    smp_rmb();
+    if(READ_ONCE(e->seq) != pos+1)
+        return 0;
+    copy->msg[DBG_MSG_LEN-1] = '\0';
+    return 1;
+}
+
+/* Entries are in order within a CPU, sort on the time to merge them */
+static int ext42_seq_debug_log_show(struct seq_file* seq, void* v)
+{
+    struct dbgEntry copy;
+    struct dbgRing* ring;
+    unsigned long head, pos;
+    u32 usec;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        ring = per_cpu_ptr(rings, cpu);
+        head = local_read(&ring->head);
+        for(pos = head > DBG_RING_SIZE ? head-DBG_RING_SIZE : 0;pos < head;pos++)
+        {
+            if(!copyEntry(ring, pos, &copy))
+                continue;
+            usec = do_div(copy.time, NSEC_PER_SEC) / NSEC_PER_USEC;
+            seq_printf(seq, "%llu.%06u %d %s %s:%u: %s\n", copy.time, usec, cpu,
+                       subsysNames[copy.subsys], copy.func, copy.line, copy.msg);
+        }
+    }
+    return 0;
+}
+
+static int ext42_seq_debug_log_open(struct inode* inode, struct file* file)
+{
+    return single_open(file, ext42_seq_debug_log_show, NULL);
+}
+
+const struct file_operations ext42_seq_debug_log_fops = {
+    .owner   = THIS_MODULE,
+    .open    = ext42_seq_debug_log_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+int __init ext42_init_debug(void)
+{
+    //zeroed, every ring starts empty
+    rings = alloc_percpu(struct dbgRing);
+    return rings ? 0 : -ENOMEM;
+}
+
+void ext42_exit_debug(void)
+{
+    int i;
+
+    //no message may be started once the rings are gone
+    for(i = 0;i < EXT42_DBG_NR;i++)
+        static_branch_disable(&ext42_dbg_keys[i]);
+    free_percpu(rings);
+    rings = NULL;
+}
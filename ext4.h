@@ -33,13 +33,34 @@
 #include <linux/ratelimit.h>
 #include <crypto/hash.h>
 #include <linux/falloc.h>
+#include <linux/jump_label.h>
 #ifdef __KERNEL__
 #include <linux/compat.h>
 #endif
 
-#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define D(fmt, ...) \
-    printk(KERN_ERR "[%s:%d:%s]: " fmt "\n", __FILENAME__, __LINE__, __func__, ##__VA_ARGS__)
+/*
+ * Debug messages, off by default: D(MERKEL, ...) costs a patched-out jump
+ * until /sys/fs/ext42/debug/merkel is set, and then goes to a per-CPU ring
+ * read from /proc/fs/ext42/debug_log, not to the console.  See debug.c.
+ */
+enum {
+    EXT42_DBG_FILE,
+    EXT42_DBG_NAMEI,
+    EXT42_DBG_MERKEL,
+    EXT42_DBG_NR
+};
+
+extern struct static_key_false ext42_dbg_keys[EXT42_DBG_NR];
+extern __printf(4, 5)
+void __ext42_dbg(unsigned int subsys, const char *func, unsigned int line,
+         const char *fmt, ...);
+
+#define D(subsys, fmt, ...)                                                 \
+    do {                                                                    \
+        if (static_branch_unlikely(&ext42_dbg_keys[EXT42_DBG_##subsys]))   \
+            __ext42_dbg(EXT42_DBG_##subsys, __func__, __LINE__,             \
+                    fmt, ##__VA_ARGS__);                                    \
+    } while (0)
 
 /*
  * The fourth extended filesystem constants/structures
@@ -640,6 +661,13 @@ enum {
 /* Max physical block we can address w/o extents */
 #define EXT4_MAX_BLOCK_FILE_PHYS    0xFFFFFFFF
 
+/*
+ * Merkle tree node as exchanged with EXT4_IOC_GETTREE.  l and r are not
+ * filled by the kernel, they are left for userspace to link its copy.
+ * The path in block picks one child per level, log2(fanout) bits each.
+ * hash only holds the first 4 bytes of the node hash, use
+ * EXT4_IOC_GETTREE_BULK to get the full width.
+ */
 typedef struct merkel_tree{
     struct merkel_tree* l;
     struct merkel_tree* r;
@@ -649,6 +677,256 @@ typedef struct merkel_tree{
 }merkel_tree;
 #define EXT4_IOC_GETTREE                _IOWR('f',22, struct merkel_tree)
 
+/*
+ * EXT4_IOC_GETTREE_BULK copies many node hashes per call.  In LEVEL mode it
+ * copies the nodes of level me_level starting at me_index, level 0 being
+ * the leaves.  In SUBTREE mode it copies the subtree rooted at node
+ * me_index of level me_level, level by level from its leaves up.  On return
+ * me_count holds the number of hashes copied to me_buf (at most the
+ * me_count given), me_total the number the request covers, and me_version
+ * changes whenever the tree is modified.  Hashes are me_hash_size bytes
+ * each, packed back to back in me_buf.
+ *
+ * Writes not yet rehashed are hashed before the copy, unless
+ * EXT42_MERKEL_EXPORT_NOFLUSH is or'ed into me_mode; the hashes are then
+ * copied as they are and EXT42_MERKEL_EXPORT_STALE is set in me_mode if
+ * some of them are out of date.
+ */
+#define EXT42_MERKEL_EXPORT_LEVEL    0
+#define EXT42_MERKEL_EXPORT_SUBTREE    1
+#define EXT42_MERKEL_EXPORT_MODE    0xff
+#define EXT42_MERKEL_EXPORT_NOFLUSH    0x100    /* in */
+#define EXT42_MERKEL_EXPORT_STALE    0x200    /* out */
+#define EXT42_MERKEL_EXPORT_MAX        (1 << 20)    /* hashes per call */
+
+struct ext42_merkel_export {
+    __u32    me_mode;
+    __u32    me_level;
+    __u32    me_index;
+    __u32    me_count;
+    __u32    me_total;
+    __u32    me_nr_leaves;
+    __u32    me_depth;
+    __u16    me_hash_alg;    /* EXT42_MERKEL_HASH_* */
+    __u16    me_hash_size;    /* bytes per hash */
+    __u32    me_fanout;    /* children per interior node */
+    __u32    me_reserved;
+    __u64    me_version;
+    __u64    me_buf;        /* user pointer to me_count hashes */
+};
+#define EXT4_IOC_GETTREE_BULK        _IOWR('f', 23, struct ext42_merkel_export)
+
+/*
+ * EXT4_IOC_DIFFTREE compares the tree of the file the ioctl is issued on
+ * with the tree of mdf_fd, which must be on the same filesystem, and
+ * copies to mdf_ranges the runs of 4 KiB blocks whose hashes differ,
+ * starting from block mdf_start.  Blocks only one of the files has count
+ * as different.  On return mdf_count holds the number of ranges copied (at
+ * most the mdf_count given, and EXT42_MERKEL_DIFF_MAX) and mdf_next the
+ * block to pass as mdf_start to get the following ranges, or the larger
+ * leaf count once the comparison is over.  The versions are those of
+ * me_version, so callers can tell if a file changed between two calls.
+ */
+#define EXT42_MERKEL_DIFF_MAX        (1 << 16)    /* ranges per call */
+
+struct ext42_merkel_range {
+    __u32    mr_start;    /* first differing block */
+    __u32    mr_len;        /* number of blocks */
+};
+
+struct ext42_merkel_diff {
+    __s32    mdf_fd;        /* file to compare with */
+    __u32    mdf_start;
+    __u32    mdf_count;
+    __u32    mdf_next;
+    __u64    mdf_version;    /* of this file's tree */
+    __u64    mdf_other_version;    /* of mdf_fd's tree */
+    __u64    mdf_ranges;    /* user pointer to mdf_count ranges */
+};
+#define EXT4_IOC_DIFFTREE        _IOWR('f', 24, struct ext42_merkel_diff)
+
+/*
+ * EXT4_IOC_GETDIRROOT returns the aggregated root of a directory: the sum,
+ * as four little endian 64-bit lanes, of the hash of every entry's name
+ * followed by its root (the tree root of a file, the aggregated root of a
+ * directory, nothing for other types).  Roots are computed on first use
+ * and maintained while the directory stays in memory; file changes are
+ * reflected once their tree is rehashed.  Fails with -EACCES unless the
+ * caller may read every file and list every directory it has to descend
+ * into; a directory it may list whose root is known is not descended.
+ */
+struct ext42_merkel_dirroot {
+    __u8    mdr_root[32];    /* EXT42_MERKEL_HASH_MAX_SIZE */
+    __u16    mdr_hash_alg;    /* EXT42_MERKEL_HASH_* */
+    __u16    mdr_hash_size;    /* bytes of the entry hashes */
+    __u32    mdr_reserved;
+};
+#define EXT4_IOC_GETDIRROOT        _IOR('f', 25, struct ext42_merkel_dirroot)
+
+/*
+ * EXT4_IOC_SETVERIFY turns verified reads of a regular file on (non zero)
+ * or off: pages read from disk are then checked against the leaves of its
+ * tree and fail with -EIO when they do not match.  The setting is kept as
+ * the hidden "verify" xattr and read back by EXT4_IOC_GETVERIFY.  Files
+ * whose leaves do not fit in the xattr holding the tree are refused with
+ * -EFBIG.
+ */
+#define EXT4_IOC_GETVERIFY        _IOR('f', 26, __u32)
+#define EXT4_IOC_SETVERIFY        _IOW('f', 26, __u32)
+
+/*
+ * EXT4_IOC_GETROOT returns only the root of a regular file's tree, in
+ * constant time once the tree is in memory and flushed.  mr_generation is
+ * the me_version the root was taken from: it changes with every change to
+ * the tree, never repeats across mounts, and keys whatever was exported
+ * with EXT4_IOC_GETTREE_BULK.  mr_i_version is the inode's i_version read
+ * with it, for callers that already track that.
+ */
+struct ext42_merkel_root {
+    __u8    mr_root[32];    /* EXT42_MERKEL_HASH_MAX_SIZE, mr_hash_size used */
+    __u64    mr_generation;
+    __u64    mr_i_version;
+    __u64    mr_size;    /* i_size the root covers */
+    __u32    mr_nr_leaves;
+    __u16    mr_hash_alg;    /* EXT42_MERKEL_HASH_* */
+    __u16    mr_hash_size;    /* bytes per hash */
+    __u32    mr_fanout;    /* children per interior node */
+    __u32    mr_reserved;
+};
+#define EXT4_IOC_GETROOT        _IOR('f', 27, struct ext42_merkel_root)
+
+/*
+ * EXT4_IOC_FINDDUPS reports the full, non-zero blocks of regular files
+ * that hold the same bytes, as mds_count entries sorted by group.  The
+ * first call indexes the leaves of every file and the index is then kept
+ * up to date from the writes, later calls only index the files changed
+ * since.  Blocks sharing a hash are read and compared before being
+ * grouped; with EXT42_MERKEL_DUPS_NOREAD they are not, and their groups
+ * are flagged EXT42_MERKEL_DUP_UNVERIFIED: equal hashes only make dedup
+ * candidates then.  Only groups whose hash modulo mds_parts is mds_part
+ * are reported.  A filesystem with more than EXT42_MERKEL_DUPS_MAX_LEAVES
+ * such blocks fails with -E2BIG.
+ */
+#define EXT42_MERKEL_DUPS_NOBUILD    0x1    /* in: skip files without a tree */
+#define EXT42_MERKEL_DUPS_NOREAD    0x2    /* in: group on hashes alone */
+#define EXT42_MERKEL_DUPS_FORGET    0x4    /* in: free the index, report nothing */
+#define EXT42_MERKEL_DUPS_TRUNCATED    0x100    /* out: more entries than room */
+#define EXT42_MERKEL_DUPS_MAX_LEAVES    (1 << 24)
+
+#define EXT42_MERKEL_DUP_UNVERIFIED    0x1    /* bytes of the group not compared */
+
+struct ext42_merkel_dup {
+    __u64    mdp_ino;
+    __u32    mdp_lblk;    /* 4 KiB block of the file */
+    __u32    mdp_group;    /* same for every block of a group */
+    __u32    mdp_flags;    /* EXT42_MERKEL_DUP_* */
+    __u32    mdp_reserved;
+};
+
+struct ext42_merkel_dups {
+    __u32    mds_flags;
+    __u32    mds_part;
+    __u32    mds_parts;    /* 0 or 1 to index every leaf at once */
+    __u32    mds_count;    /* in: room in mds_dups, out: entries copied */
+    __u32    mds_groups;    /* out: groups found */
+    __u32    mds_reserved;
+    __u64    mds_leaves;    /* out: leaves indexed */
+    __u64    mds_dups;    /* user pointer to mds_count ext42_merkel_dup */
+};
+#define EXT4_IOC_FINDDUPS        _IOWR('f', 28, struct ext42_merkel_dups)
+
+/* Block hash engines, selected with the merkel_hash mount option */
+#define EXT42_MERKEL_HASH_CRC32C    0
+#define EXT42_MERKEL_HASH_XXH64        1
+#define EXT42_MERKEL_HASH_SHA256    2
+#define EXT42_MERKEL_HASH_MAX_SIZE    32    /* bytes, SHA-256 */
+
+/*
+ * In-memory Merkle tree.  All nodes live in mt_nodes, level by level: the
+ * mt_nr_leaves leaf hashes first, then each level of parents up to the
+ * root at level mt_depth.  Node j of level l has children kj to kj+k-1 on
+ * level l-1, k being the fanout 1 << mt_fanout_bits.  Leaves hash the whole
+ * block, interior nodes hash the concatenation of their children (those
+ * that exist, the last node of a level may have fewer).  Every hash is
+ * mt_hash_size bytes, the digest of mt_hash_alg possibly truncated.
+ * Levels are laid out for mt_capacity leaves so the tree can grow in place.
+ * Writes only set the bits of their leaves in mt_pending; the leaves and
+ * their ancestors are rehashed later by ext42_merkel_work() or when the
+ * tree is read or saved.  With merkel_writeback the leaves are hashed as
+ * their page is written back and only moved to mt_parents.  Trees are
+ * reallocated into a new struct, never in place, so that readers holding
+ * only rcu_read_lock() always see arrays matching mt_capacity.
+ */
+#define EXT42_MERKEL_MAX_LEVELS        33
+#define EXT42_MERKEL_MAX_FANOUT        64
+#define EXT42_MERKEL_MMAP_SPANS        4
+#define EXT42_MERKEL_DIR_LOCK_BITS    6    /* directory root locks per sb */
+
+struct ext42_merkel {
+    u8        *mt_nodes;
+    unsigned int    mt_hash_alg;    /* EXT42_MERKEL_HASH_* */
+    unsigned int    mt_hash_size;    /* bytes per node */
+    unsigned int    mt_nr_leaves;
+    unsigned int    mt_depth;    /* level of the root */
+    unsigned int    mt_fanout_bits;    /* log2 of the children per node */
+    unsigned int    mt_capacity;    /* leaves mt_nodes has room for */
+    unsigned long    *mt_pending;    /* leaves written but not rehashed yet */
+    unsigned long    *mt_parents;    /* rehashed leaves whose ancestors are not */
+    unsigned int    mt_stale;    /* either bitmap has bits set */
+    unsigned int    mt_level[EXT42_MERKEL_MAX_LEVELS];    /* offset of each level */
+    size_t        mt_bytes;    /* memory held, for the shrinker */
+    struct rcu_head    mt_rcu;    /* freed once lockless readers are done */
+};
+
+/* i_merkel_verify, EXT4_IOC_SETVERIFY */
+#define EXT42_MERKEL_VERIFY_UNKNOWN    0    /* xattr not looked up yet */
+#define EXT42_MERKEL_VERIFY_OFF        1
+#define EXT42_MERKEL_VERIFY_ON        2
+
+/* i_merkel_saved, what the hidden xattr holds for the file as it is */
+#define EXT42_MERKEL_SAVED_UNKNOWN    0    /* not looked at yet */
+#define EXT42_MERKEL_SAVED_NONE        1    /* no copy, or a stale one */
+#define EXT42_MERKEL_SAVED_VALID    2    /* a copy matching the file */
+
+/* kind of tree update, for the ext42_merkel_update_* tracepoints */
+#define EXT42_MERKEL_UPDATE_FLUSH    0    /* pending leaves after writes */
+#define EXT42_MERKEL_UPDATE_BUILD    1    /* whole file hashed */
+#define EXT42_MERKEL_UPDATE_LOAD    2    /* leaves read from the saved copy */
+
+/* Leaves [ms_first, ms_last] made writable by a fault, see ext42_merkel_mkwrite() */
+struct ext42_merkel_span {
+    unsigned int    ms_first;
+    unsigned int    ms_last;
+};
+
+/*
+ * On-disk copy of a Merkle tree, stored in the hidden EXT4_XATTR_INDEX_MERKEL
+ * xattr.  Only the leaf hashes are kept, interior nodes are recomputed when
+ * the tree is loaded and the root they lead to is checked against md_root.
+ * The copy is removed before the file first changes after it was saved or
+ * loaded, and is only trusted for the size and mtime it was saved with.
+ *
+ * The leaves follow the header in md_hashes, so the copy lives wherever
+ * e2fsck sees the xattr.  Files with more leaves than fit in an xattr
+ * block are not saved.
+ */
+#define EXT42_MERKEL_MAGIC        0x4d4b4c34    /* "MKL4" */
+#define EXT42_MERKEL_XATTR_NAME        "tree"
+#define EXT42_MERKEL_VERIFY_XATTR_NAME    "verify"
+
+struct ext42_merkel_disk {
+    __le32    md_magic;
+    __le32    md_nr_leaves;    /* Number of leaf hashes */
+    __le64    md_size;    /* i_size the leaves were computed for */
+    __le64    md_mtime;    /* i_mtime the leaves were computed for */
+    __le32    md_mtime_nsec;
+    __u8    md_hash_alg;    /* EXT42_MERKEL_HASH_* */
+    __u8    md_hash_size;    /* bytes per leaf hash */
+    __le16    md_reserved;
+    __u8    md_root[EXT42_MERKEL_HASH_MAX_SIZE];    /* zero padded */
+    __u8    md_hashes[0];
+};
+
 /*
  * Structure of an inode on the disk
  */
@@ -711,7 +989,6 @@ struct ext42_inode {
     __le32  i_crtime_extra; /* extra FileCreationtime (nsec << 2 | epoch) */
     __le32  i_version_hi;    /* high 32 bits for 64-bit version */
     __le32    i_projid;    /* Project ID */
-    merkel_tree* tree;
 };
 
 struct move_extent {
@@ -1040,6 +1317,37 @@ struct ext42_inode_info {
     /* Encryption params */
     struct ext42_crypt_info *i_crypt_info;
 #endif
+
+    /* Merkle tree of the file contents, loaded lazily (see merkel.c) */
+    struct mutex i_merkel_mutex;
+    struct ext42_merkel *i_merkel_tree;    /* set under i_merkel_mutex, read under RCU */
+    seqcount_t i_merkel_seq;    /* odd while the tree is being changed */
+    unsigned int i_merkel_dirty;    /* tree differs from the saved copy */
+    u64 i_merkel_version;        /* changes with every tree update */
+    struct delayed_work i_merkel_work;    /* rehashes the pending leaves */
+    struct delayed_work i_merkel_save_work;    /* saves the tree once writes settle */
+    struct list_head i_merkel_list;    /* on s_merkel_list while it has a tree */
+    size_t i_merkel_bytes;        /* accounted in s_merkel_bytes */
+    unsigned int i_merkel_touched;    /* used since the shrinker last looked */
+    spinlock_t i_merkel_mmap_lock;    /* protects the three below */
+    unsigned int i_merkel_mmap_nr;
+    struct ext42_merkel_span i_merkel_mmap[EXT42_MERKEL_MMAP_SPANS];
+    struct list_head i_merkel_wb;    /* hashed by writeback while the mutex was busy */
+    atomic_t i_merkel_marks;    /* bumped whenever leaves are marked as changed */
+    unsigned int i_merkel_verify;    /* EXT42_MERKEL_VERIFY_* */
+    unsigned int i_merkel_saved;    /* EXT42_MERKEL_SAVED_*, under i_merkel_mutex */
+    /*
+     * Root this inode contributes to the directories linking it: the tree
+     * root of a file, the aggregated root of a directory.  Protected by
+     * the slot of the inode in s_merkel_dir_locks.
+     */
+    u8 i_merkel_root[EXT42_MERKEL_HASH_MAX_SIZE];
+    unsigned int i_merkel_root_valid;
+    unsigned int i_merkel_gen;    /* bumped by every change to a directory */
+    unsigned int i_merkel_busy;    /* changes on their way up through it */
+    unsigned int i_merkel_root_dirty;    /* flushed, not yet carried up */
+    unsigned int i_merkel_root_folded;    /* a known directory may hold it */
+    unsigned int i_merkel_epoch;    /* s_merkel_dir_epoch the root is from */
 };
 
 /*
@@ -1082,6 +1390,7 @@ struct ext42_inode_info {
 #define EXT4_MOUNT_POSIX_ACL        0x08000    /* POSIX Access Control Lists */
 #define EXT4_MOUNT_NO_AUTO_DA_ALLOC    0x10000    /* No auto delalloc mapping */
 #define EXT4_MOUNT_BARRIER        0x20000 /* Use block barriers */
+#define EXT4_MOUNT_MERKEL_WRITEBACK    0x40000 /* Hash Merkle leaves at writeback */
 #define EXT4_MOUNT_QUOTA        0x80000 /* Some quota option set */
 #define EXT4_MOUNT_USRQUOTA        0x100000 /* "old" user quota */
 #define EXT4_MOUNT_GRPQUOTA        0x200000 /* "old" group quota */
@@ -1462,6 +1771,46 @@ struct ext42_sb_info {
     struct ratelimit_state s_err_ratelimit_state;
     struct ratelimit_state s_warning_ratelimit_state;
     struct ratelimit_state s_msg_ratelimit_state;
+
+    /* Source of Merkle tree versions, unique across inodes */
+    atomic64_t s_merkel_version;
+    /* Merkle block hash, see merkel_hash= and merkel_hash_size= */
+    unsigned int s_merkel_alg;
+    unsigned int s_merkel_hash_size;
+    unsigned int s_merkel_fanout;    /* children per node, 0 for 2 */
+    /* hash of an all zero block and of full subtrees of those, by level */
+    u8 s_merkel_zero[EXT42_MERKEL_MAX_LEVELS][EXT42_MERKEL_HASH_MAX_SIZE];
+    struct crypto_shash *s_merkel_tfm;    /* NULL for xxh64 or shared crc32c */
+    struct workqueue_struct *s_merkel_wq;    /* deferred rehashing */
+    struct workqueue_struct *s_merkel_verify_wq;    /* checks verified reads */
+    /* Directory roots, see merkel.c */
+    spinlock_t s_merkel_dir_locks[1 << EXT42_MERKEL_DIR_LOCK_BITS];
+    atomic_t s_merkel_dirs;    /* directories with a known root or being scanned */
+    atomic_t s_merkel_dir_epoch;    /* bumped to forget every directory root */
+    /* Duplicate block index, see EXT4_IOC_FINDDUPS */
+    struct mutex s_merkel_dups_mutex;    /* held by every call */
+    struct ext42_merkel_dup_index __rcu *s_merkel_dups;
+    /* Reclaim cold Merkle trees */
+    struct shrinker s_merkel_shrinker;
+    struct list_head s_merkel_list;    /* inodes with a tree, coldest first */
+    unsigned int s_merkel_nr_trees;
+    unsigned int s_merkel_shrunk;    /* trees discarded so far */
+    unsigned int s_merkel_max_kb;    /* 0 for no limit */
+    struct percpu_counter s_merkel_bytes;
+    struct work_struct s_merkel_reclaim_work;
+    spinlock_t s_merkel_lock;
+    /* Merkle tree maintenance, see the ext42_merkel_* tracepoints */
+    atomic64_t s_merkel_flushes;    /* incremental updates after writes */
+    atomic64_t s_merkel_flush_ns;
+    atomic64_t s_merkel_builds;    /* trees built or loaded from disk */
+    atomic64_t s_merkel_build_ns;
+    atomic64_t s_merkel_hashed_blocks;    /* leaves hashed from file data */
+    atomic64_t s_merkel_hashed_bytes;
+    atomic64_t s_merkel_hashed_nodes;    /* inner nodes hashed */
+    atomic64_t s_merkel_alloc_bytes;
+    atomic64_t s_merkel_freed_bytes;
+    atomic64_t s_merkel_verify_refused;    /* verified files without a saved tree */
+    atomic64_t s_merkel_verify_skipped;    /* blocks read without a leaf to check */
 };
 
 static inline struct ext42_sb_info *EXT4_SB(struct super_block *sb)
@@ -2433,6 +2782,9 @@ extern struct inode *__ext42_new_inode(handle_t *, struct inode *, umode_t,
     __ext42_new_inode(NULL, (dir), (mode), (qstr), (goal), (owner), \
              (type), __LINE__, (nblocks))
 
+extern struct buffer_head *ext42_read_inode_bitmap(struct super_block *sb,
+                          ext42_group_t block_group);
+
 
 extern void ext42_free_inode(handle_t *, struct inode *);
 extern struct inode * ext42_orphan_get(struct super_block *, unsigned long);
@@ -2540,6 +2892,56 @@ extern int ext42_ind_remove_space(handle_t *handle, struct inode *inode,
 extern long ext42_ioctl(struct file *, unsigned int, unsigned long);
 extern long ext42_compat_ioctl(struct file *, unsigned int, unsigned long);
 
+/* merkel.c */
+extern int ext42_merkel_parse_hash(const char *name);
+extern const char *ext42_merkel_hash_name(unsigned int alg);
+extern int ext42_merkel_init_sb(struct super_block *sb);
+extern void ext42_merkel_release_sb(struct super_block *sb);
+extern int ext42_merkel_register_shrinker(struct ext42_sb_info *sbi);
+extern void ext42_merkel_unregister_shrinker(struct ext42_sb_info *sbi);
+extern struct ext42_merkel *ext42_merkel_get(struct inode *inode, int rebuild);
+extern void ext42_merkel_load(struct inode *inode);
+extern void ext42_merkel_fault(struct inode *inode);
+extern int ext42_merkel_save(struct inode *inode);
+extern void ext42_merkel_evict(struct inode *inode);
+extern void ext42_merkel_sync_fs(struct super_block *sb, int wait);
+extern void ext42_merkel_drop(struct inode *inode);
+extern void ext42_merkel_delete_inode(struct inode *inode);
+extern int ext42_merkel_get_node(struct inode *inode, merkel_tree *path);
+extern int ext42_merkel_export(struct inode *inode,
+                   struct ext42_merkel_export *exp);
+extern int ext42_merkel_file_root(struct inode *inode,
+                  struct ext42_merkel_root *mr);
+extern int ext42_merkel_find_dups(struct super_block *sb,
+                  struct ext42_merkel_dups *dups);
+extern int ext42_merkel_diff(struct inode *inode, struct inode *other,
+                 struct ext42_merkel_diff *diff);
+extern int ext42_merkel_dir_root(struct file *filp,
+                 struct ext42_merkel_dirroot *dr);
+extern void ext42_merkel_dir_link(struct inode *dir, const struct qstr *name,
+                  struct inode *inode, int created);
+extern void ext42_merkel_dir_unlink(struct inode *dir, const struct qstr *name,
+                    struct inode *inode);
+extern void ext42_merkel_dir_rename(struct inode *old_dir,
+                    const struct qstr *old_name,
+                    struct inode *new_dir,
+                    const struct qstr *new_name,
+                    struct inode *inode);
+extern void ext42_merkel_work(struct work_struct *work);
+extern void ext42_merkel_save_work(struct work_struct *work);
+extern void ext42_merkel_writeback(struct page *page, unsigned int len);
+extern void ext42_merkel_mkwrite(struct inode *inode, loff_t pos, loff_t len);
+extern int ext42_merkel_open(struct inode *inode);
+extern int ext42_merkel_get_verify(struct inode *inode);
+extern int ext42_merkel_set_verify(struct inode *inode, int on);
+extern int ext42_merkel_verify_page(struct page *page);
+extern void updateTree(struct inode *inode, loff_t pos, size_t count);
+extern void ext42_merkel_zero(struct inode *inode, loff_t old_size,
+                  loff_t offset, loff_t len);
+extern void ext42_merkel_truncate(struct inode *inode, loff_t old_size);
+extern void ext42_merkel_shift(struct inode *inode, loff_t offset, loff_t len,
+                   int insert);
+
 /* migrate.c */
 extern int ext42_ext_migrate(struct inode *);
 extern int ext42_ind_migrate(struct inode *inode);
@@ -3110,6 +3512,11 @@ extern const struct inode_operations ext42_encrypted_symlink_inode_operations;
 extern const struct inode_operations ext42_symlink_inode_operations;
 extern const struct inode_operations ext42_fast_symlink_inode_operations;
 
+/* debug.c */
+extern const struct file_operations ext42_seq_debug_log_fops;
+extern int __init ext42_init_debug(void);
+extern void ext42_exit_debug(void);
+
 /* sysfs.c */
 extern int ext42_register_sysfs(struct super_block *sb);
 extern void ext42_unregister_sysfs(struct super_block *sb);
@@ -4793,7 +4793,7 @@ static long ext42_zero_range(struct file *file, loff_t offset,
 	struct inode *inode = file_inode(file);
 	handle_t *handle = NULL;
 	unsigned int max_blocks;
-	loff_t new_size = 0;
+	loff_t new_size = 0, old_size;
 	int ret = 0;
 	int flags;
 	int credits;
@@ -4858,6 +4858,10 @@ static long ext42_zero_range(struct file *file, loff_t offset,
 	if (mode & FALLOC_FL_KEEP_SIZE)
 		flags |= EXT4_GET_BLOCKS_KEEP_SIZE;
 
+	/* The saved Merkle tree is only usable before size and mtime change */
+	ext42_merkel_load(inode);
+	old_size = i_size_read(inode);
+
 	/* Wait all existing dio workers, newcomers will block on i_mutex */
 	ext42_inode_block_unlocked_dio(inode);
 	inode_dio_wait(inode);
@@ -4939,6 +4943,11 @@ static long ext42_zero_range(struct file *file, loff_t offset,
 
 	ext42_journal_stop(handle);
 out_dio:
+	/* Only a complete zeroing is known to read back as zeroes */
+	if (ret >= 0)
+		ext42_merkel_zero(inode, old_size, offset, len);
+	else
+		updateTree(inode, offset, len);
 	ext42_inode_resume_unlocked_dio(inode);
 out_mutex:
 	mutex_unlock(&inode->i_mutex);
@@ -4955,7 +4964,7 @@ out_mutex:
 long ext42_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 {
 	struct inode *inode = file_inode(file);
-	loff_t new_size = 0;
+	loff_t new_size = 0, old_size;
 	unsigned int max_blocks;
 	int ret = 0;
 	int flags;
@@ -5031,6 +5040,9 @@ long ext42_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 			goto out;
 	}
 
+	ext42_merkel_load(inode);
+	old_size = i_size_read(inode);
+
 	/* Wait all existing dio workers, newcomers will block on i_mutex */
 	ext42_inode_block_unlocked_dio(inode);
 	inode_dio_wait(inode);
@@ -5038,6 +5050,8 @@ long ext42_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 	ret = ext42_alloc_file_blocks(file, lblk, max_blocks, new_size,
 				     flags, mode);
 	ext42_inode_resume_unlocked_dio(inode);
+	/* Whatever was allocated past the old size reads as zeroes */
+	ext42_merkel_truncate(inode, old_size);
 	if (ret)
 		goto out;
 
@@ -5563,6 +5577,8 @@ int ext42_collapse_range(struct inode *inode, loff_t offset, loff_t len)
 		goto out_mutex;
 	}
 
+	ext42_merkel_load(inode);
+
 	/* Wait for existing dio to complete */
 	ext42_inode_block_unlocked_dio(inode);
 	inode_dio_wait(inode);
@@ -5639,6 +5655,11 @@ int ext42_collapse_range(struct inode *inode, loff_t offset, loff_t len)
 
 out_stop:
 	ext42_journal_stop(handle);
+	/* Blocks only moved as a whole if the collapse went through */
+	if (!ret)
+		ext42_merkel_shift(inode, offset, len, 0);
+	else
+		updateTree(inode, offset, i_size_read(inode) - offset);
 out_mmap:
 	up_write(&EXT4_I(inode)->i_mmap_sem);
 	ext42_inode_resume_unlocked_dio(inode);
@@ -5713,6 +5734,8 @@ int ext42_insert_range(struct inode *inode, loff_t offset, loff_t len)
 		goto out_mutex;
 	}
 
+	ext42_merkel_load(inode);
+
 	/* Wait for existing dio to complete */
 	ext42_inode_block_unlocked_dio(inode);
 	inode_dio_wait(inode);
@@ -5814,6 +5837,10 @@ int ext42_insert_range(struct inode *inode, loff_t offset, loff_t len)
 
 out_stop:
 	ext42_journal_stop(handle);
+	if (ret >= 0)
+		ext42_merkel_shift(inode, offset, len, 1);
+	else
+		updateTree(inode, offset, i_size_read(inode) - offset);
 out_mmap:
 	up_write(&EXT4_I(inode)->i_mmap_sem);
 	ext42_inode_resume_unlocked_dio(inode);
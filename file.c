@@ -32,8 +32,6 @@
 #include "xattr.h"
 #include "acl.h"
 
-#define BLOCKSIZE 4096
-
 /*
  * Called when an inode is released. Note that this is different
  * from ext42_file_open: open gets called at every open, but release
@@ -41,7 +39,7 @@
  */
 static int ext42_release_file(struct inode *inode, struct file *filp)
 {
-    D("release a file %s (inode num %ld)", filp->f_path.dentry->d_name.name, inode->i_ino);
+    D(FILE, "release a file %s (inode num %ld)", filp->f_path.dentry->d_name.name, inode->i_ino);
 
     if (ext42_test_inode_state(inode, EXT4_STATE_DA_ALLOC_CLOSE)) {
         ext42_alloc_da_blocks(inode);
@@ -59,6 +57,14 @@ static int ext42_release_file(struct inode *inode, struct file *filp)
     if (is_dx(inode) && filp->private_data)
         ext42_htree_free_dir_info(filp->private_data);
 
+    /* persist the Merkle tree when the last writer goes away */
+    if ((filp->f_mode & FMODE_WRITE) &&
+            (atomic_read(&inode->i_writecount) == 1)) {
+        int err = ext42_merkel_save(inode);
+        if (err && err != -EBUSY)
+            ext42_warning_inode(inode, "couldn't save Merkle tree (err %d)", err);
+    }
+
     return 0;
 }
 
@@ -93,311 +99,6 @@ ext42_unaligned_aio(struct inode *inode, struct iov_iter *from, loff_t pos)
     return 0;
 }
 
-int hash_char(unsigned char *s)
-{
-    unsigned hashval;
-    for (hashval = 0; *s != '\0'; s++)
-        hashval = *s + 31*hashval;
-    return hashval % 2147483647;
-}
-
-struct file* fileOpen(struct file* file)
-{
-    //get path
-    char* path = vmalloc(sizeof(char)*4097);
-    char* tmp = dentry_path_raw(file->f_path.dentry, path, 4096);
-    strcpy(path,"/mnt");//Not appropriate but I could not find a way to retrieve the path proprely
-    strcat(path,tmp);
-
-    //open
-    struct file* filp = filp_open(path,O_RDONLY,0);
-    if(filp <= 0)
-        D("Opening %s failed %d", path, filp);
-
-    //return
-    vfree(path);
-    return filp;
-}
-
-void fileRead(struct file *file, unsigned long long offset, unsigned char *buf, unsigned int size) 
-{
-    //test
-    if(size == 0)
-    {
-        buf[0] = '\0';
-        return;    
-    }    
-        
-    //read
-    int retVal = kernel_read(file, offset,buf, size);
-    if(retVal <= 0) 
-        D("Reading failed %d", retVal);       
-} 
-
-void freeMerkelTree(merkel_tree* tree)
-{
-    if(tree->block < 0)
-        freeMerkelTree(tree->l);        
-    if(tree->block == -2)
-        freeMerkelTree(tree->r);
-    kfree(tree);
-}
-
-int computeDepth(int nbLeaves)
-{    
-    int nbParent = -1, depth = 1; 
-    while(1)
-    {        
-        if(nbLeaves%2 == 0 || nbLeaves == 1)
-            nbParent = nbLeaves/2;
-        else 
-            nbParent = (nbLeaves+1)/2;
-        
-        if(nbParent == 0)
-            return depth-1;
-        
-        depth++;
-        nbLeaves = nbParent;
-    }   
-}
-
-int countLeaves(merkel_tree* tree)
-{
-    int a = 0,b = 0;
-    if(tree->block >= 0)
-        return 1;
-    if(tree->block < 0)
-        a = countLeaves(tree->l);        
-    if(tree->block == -2)
-        b = countLeaves(tree->r);
-    return a + b;
-}
-
-merkel_tree* freeRight(merkel_tree* tree)
-{
-    merkel_tree* subLeftTree = tree->l;
-    freeMerkelTree(tree->r);
-    kfree(tree);
-    
-    return subLeftTree;
-}
-
-void updateDepthField(merkel_tree* tree, int depth)
-{
-    tree->depth = depth;
-    if(tree->block >= 0)
-        return;
-    if(tree->block < 0)
-        updateDepthField(tree->l, depth-1);        
-    if(tree->block == -2)
-        updateDepthField(tree->r, depth-1);
-}
-
-void freeRightMostLeaf(merkel_tree* tree)
-{
-    merkel_tree* it = tree;
-    while(1)
-    {
-        if(it->block == -2)
-        {
-            if(it->r->block < 0)
-            {
-                it = it->r;
-            }
-            else
-            {
-                it->block = -1;  
-                kfree(it->r);
-                it->r = NULL;
-                return;
-            }
-        }
-        if(it->block == -1) 
-        {
-            if(it->l->block < 0)
-            {
-                it = it->l;
-            }
-            else
-            {
-                it->block = 0;                
-                kfree(it->l);
-                it->l = NULL;
-                freeRightMostLeaf(tree);
-                return;
-            }
-        }
-    }
-}
-
-void freeLeaves(merkel_tree* tree, int nbToFree)
-{
-    int i;
-    for(i = 0;i < nbToFree;i++)
-        freeRightMostLeaf(tree);
-}
-
-int getNextPath(int path, int depth)
-{
-    if(depth == 0)       
-        return -1;           
-    if(path == -1)
-    return 0;
-
-    int i,mult = 1;
-    for(i = 0,mult = 1;i < depth-1;i++)
-        mult *= 2;
-    while(1)
-    {        
-        if((path/mult)%2)
-            path -= mult;
-        else
-    {
-            path+= mult;
-        return path;
-    }
-        mult/=2;    
-    }  
-    return path;
-}
-
-void setNewHasheLeaf(merkel_tree* tree, int path, int hash, int blknb)
-{
-    //extract node from path + update + alloc if needed
-    if(path >= 0)
-    {
-        while(tree->depth != 0)
-        {    
-            int dir = path%2;
-            path /= 2;
-            if(dir == 0)
-            {
-                if(!tree->l)
-                {        
-                    tree->l = kmalloc(sizeof(merkel_tree),GFP_KERNEL | __GFP_HIGH | __GFP_NOFAIL);
-                    tree->l->l = NULL;
-                    tree->l->r = NULL;
-                    tree->l->depth = tree->depth-1;
-                    tree->block = -1;
-                }
-                tree = tree->l;
-            }
-            else if(dir == 1)
-            {
-                if(!tree->r)
-                {
-                    tree->r = kmalloc(sizeof(merkel_tree),GFP_KERNEL | __GFP_HIGH | __GFP_NOFAIL );  
-                    tree->r->l = NULL;
-                    tree->r->r = NULL;
-                    tree->r->depth = tree->depth-1;              
-                    tree->block = -2;
-                }
-                tree = tree->r;
-            }
-            else
-                break;            
-        }
-    }
-
-    //set leaf
-    tree->r = NULL;
-    tree->l = NULL;
-    tree->depth = 0;
-    tree->block = blknb;
-    tree->hash  = hash;
-}
-
-void setNewHasheParents(merkel_tree* tree)
-{
-    if(tree->block >= 0)
-        return;
-    if(tree->block == -1)        
-    {
-        setNewHasheParents(tree->l);                
-        tree->hash = tree->l->hash/2;
-    }
-    else if(tree->block == -2)
-    {        
-        setNewHasheParents(tree->l);
-        setNewHasheParents(tree->r);        
-        tree->hash = tree->l->hash/2 + tree->r->hash/2;
-    }
-}
-
-void setNewHashes(merkel_tree* tree, int* hashes, int size, int depth)
-{
-    int i, path = -1;
-    for(i = 0;i< size;i++)
-    {
-        path = getNextPath(path, depth);
-        setNewHasheLeaf(tree, path, hashes[i], i);
-    }
-    
-    setNewHasheParents(tree);
-}
-
-int* getHashes(struct file* filp, int nbblk, int size)
-{
-    //init
-    char* buf = vmalloc(sizeof(char)*(BLOCKSIZE+1));
-    int* hashes = vmalloc(sizeof(int)*(nbblk));
-    int i = 0;
-    
-    //create hashes
-    for(i = 0;i< nbblk-1;i++)
-    {    
-        fileRead(filp, i*BLOCKSIZE,buf, BLOCKSIZE);
-        hashes[i] = hash_char(buf);    
-    }
-    int rest = size%BLOCKSIZE;
-    fileRead(filp,i*BLOCKSIZE ,buf, rest);    
-    hashes[i] = hash_char(buf);  
-    
-    //return
-    vfree(buf);    
-    return hashes;
-}
-
-void updateTree(struct file* file, struct ext42_inode* inode)
-{
-    D("Updating tree of %s", file->f_path.dentry->d_name.name);
-
-    //get hashes
-    struct file* filp   = fileOpen(file);
-    int size            = vfs_llseek(filp,0,SEEK_END);
-    int nbblk           = (size/BLOCKSIZE)+1;   
-    int* hashes         = getHashes(filp, nbblk, size);  
-    filp_close(filp, NULL);
-       
-    //recycle old tree : get old/new tree info
-    merkel_tree* oldTree = inode->tree;
-    int oldDepth    = oldTree->depth;
-    int oldNbLeaves = countLeaves(oldTree);
-    int newNbLeaves = nbblk;
-    int newDepth    = computeDepth(newNbLeaves);
-    
-    //recycle old tree : grow or reduce size
-    if(oldDepth > newDepth)
-    {
-        while(oldTree->depth > newDepth)
-            oldTree = freeRight(oldTree);
-        oldNbLeaves = countLeaves(oldTree);
-        inode->tree = oldTree;
-    }
-    else if(oldDepth < newDepth)
-    {
-        updateDepthField(oldTree, newDepth);
-    }
-        
-    //recycle old tree : remove unescecary leaves
-    if(oldNbLeaves > newNbLeaves)
-        freeLeaves(oldTree, oldNbLeaves-newNbLeaves);
-    
-    //set hashes
-    setNewHashes(oldTree, hashes, newNbLeaves, newDepth);
-    vfree(hashes);
-}
-
 static ssize_t
 ext42_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
@@ -408,15 +109,8 @@ ext42_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
     int o_direct = iocb->ki_flags & IOCB_DIRECT;
     int overwrite = 0;
     ssize_t ret;
-    
-    //get ext42 inode
-    struct ext42_iloc iloc;
-    struct ext42_inode *raw_inode;
-    iloc.bh = NULL;
-    ret = ext42_get_inode_loc(inode, &iloc);
-    raw_inode = ext42_raw_inode(&iloc);
 
-    D("write to %s", file->f_path.dentry->d_name.name);
+    D(FILE, "write to %s", file->f_path.dentry->d_name.name);
 
     /*
      * Unaligned direct AIO must be serialized; see comment above
@@ -451,6 +145,9 @@ ext42_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
         iov_iter_truncate(from, sbi->s_bitmap_maxbytes - iocb->ki_pos);
     }
 
+    //the saved tree is only usable before the write changes size and mtime
+    ext42_merkel_load(inode);
+
     iocb->private = &overwrite;
     if (o_direct) {
         size_t length = iov_iter_count(from);
@@ -502,7 +199,8 @@ ext42_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
 
     if (aio_mutex)
         mutex_unlock(aio_mutex);
-    updateTree(file,raw_inode);
+    if (ret > 0)
+        updateTree(inode, iocb->ki_pos - ret, ret);
     return ret;
 
 out:
@@ -536,6 +234,7 @@ static int ext42_dax_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
     if (write) {
         sb_start_pagefault(sb);
         file_update_time(vma->vm_file);
+        ext42_merkel_fault(inode);
         down_read(&EXT4_I(inode)->i_mmap_sem);
         handle = ext42_journal_start_sb(sb, EXT4_HT_WRITE_PAGE,
                         EXT4_DATA_TRANS_BLOCKS(sb));
@@ -549,6 +248,9 @@ static int ext42_dax_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
                         ext42_end_io_unwritten);
 
     if (write) {
+        if (!(result & VM_FAULT_ERROR))
+            ext42_merkel_mkwrite(inode, (loff_t)vmf->pgoff << PAGE_SHIFT,
+                         PAGE_SIZE);
         if (!IS_ERR(handle))
             ext42_journal_stop(handle);
         up_read(&EXT4_I(inode)->i_mmap_sem);
@@ -571,6 +273,7 @@ static int ext42_dax_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
     if (write) {
         sb_start_pagefault(sb);
         file_update_time(vma->vm_file);
+        ext42_merkel_fault(inode);
         down_read(&EXT4_I(inode)->i_mmap_sem);
         handle = ext42_journal_start_sb(sb, EXT4_HT_WRITE_PAGE,
                 ext42_chunk_trans_blocks(inode,
@@ -585,6 +288,11 @@ static int ext42_dax_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
                 ext42_get_block_dax, ext42_end_io_unwritten);
 
     if (write) {
+        if (!(result & (VM_FAULT_ERROR | VM_FAULT_FALLBACK)))
+            ext42_merkel_mkwrite(inode,
+                         ((loff_t)((addr & PMD_MASK) - vma->vm_start) +
+                          ((loff_t)vma->vm_pgoff << PAGE_SHIFT)),
+                         PMD_SIZE);
         if (!IS_ERR(handle))
             ext42_journal_stop(handle);
         up_read(&EXT4_I(inode)->i_mmap_sem);
@@ -602,9 +310,12 @@ static int ext42_dax_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 
     sb_start_pagefault(inode->i_sb);
     file_update_time(vma->vm_file);
+    ext42_merkel_fault(inode);
     down_read(&EXT4_I(inode)->i_mmap_sem);
     err = __dax_mkwrite(vma, vmf, ext42_get_block_dax,
                 ext42_end_io_unwritten);
+    if (!(err & VM_FAULT_ERROR))
+        ext42_merkel_mkwrite(inode, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
     up_read(&EXT4_I(inode)->i_mmap_sem);
     sb_end_pagefault(inode->i_sb);
 
@@ -630,10 +341,13 @@ static int ext42_dax_pfn_mkwrite(struct vm_area_struct *vma,
 
     sb_start_pagefault(sb);
     file_update_time(vma->vm_file);
+    ext42_merkel_fault(inode);
     down_read(&EXT4_I(inode)->i_mmap_sem);
     size = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
     if (vmf->pgoff >= size)
         ret = VM_FAULT_SIGBUS;
+    else
+        ext42_merkel_mkwrite(inode, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
     up_read(&EXT4_I(inode)->i_mmap_sem);
     sb_end_pagefault(sb);
 
@@ -686,7 +400,7 @@ static int ext42_file_open(struct inode * inode, struct file * filp)
     char buf[64], *cp;
     int ret;
 
-    D("open a file %s (inode num %ld)", filp->f_path.dentry->d_name.name, inode->i_ino);
+    D(FILE, "open a file %s (inode num %ld)", filp->f_path.dentry->d_name.name, inode->i_ino);
 
     if (unlikely(!(sbi->s_mount_flags & EXT4_MF_MNTDIR_SAMPLED) &&
              !(sb->s_flags & MS_RDONLY))) {
@@ -736,6 +450,10 @@ static int ext42_file_open(struct inode * inode, struct file * filp)
         if (ret < 0)
             return ret;
     }
+    /* verified reads need the tree before the first page is read */
+    ret = ext42_merkel_open(inode);
+    if (ret)
+        return ret;
     return dquot_file_open(inode, filp);
 }
 
@@ -118,7 +118,7 @@ verified:
  *
  * Return buffer_head of bitmap on success or NULL.
  */
-static struct buffer_head *
+struct buffer_head *
 ext42_read_inode_bitmap(struct super_block *sb, ext42_group_t block_group)
 {
 	struct ext42_group_desc *desc;
@@ -72,6 +72,11 @@ struct extent_status;
 	{ FALLOC_FL_COLLAPSE_RANGE,	"COLLAPSE_RANGE"},	\
 	{ FALLOC_FL_ZERO_RANGE,		"ZERO_RANGE"})
 
+#define show_merkel_update(kind) __print_symbolic(kind,		\
+	{ EXT42_MERKEL_UPDATE_FLUSH,	"flush" },			\
+	{ EXT42_MERKEL_UPDATE_BUILD,	"build" },			\
+	{ EXT42_MERKEL_UPDATE_LOAD,	"load" })
+
 
 TRACE_EVENT(ext42_other_inode_update_time,
 	TP_PROTO(struct inode *inode, ino_t orig_ino),
@@ -2529,6 +2534,112 @@ TRACE_EVENT(ext42_es_shrink,
 		  __entry->scan_time, __entry->nr_skipped, __entry->retried)
 );
 
+TRACE_EVENT(ext42_merkel_update_enter,
+	TP_PROTO(struct inode *inode, int kind, unsigned int nr_leaves),
+
+	TP_ARGS(inode, kind, nr_leaves),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	int,		kind		)
+		__field(	unsigned int,	nr_leaves	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->kind		= kind;
+		__entry->nr_leaves	= nr_leaves;
+	),
+
+	TP_printk("dev %d,%d ino %lu %s nr_leaves %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino,
+		  show_merkel_update(__entry->kind), __entry->nr_leaves)
+);
+
+TRACE_EVENT(ext42_merkel_update_exit,
+	TP_PROTO(struct inode *inode, int kind, unsigned int blocks,
+		 u64 bytes, unsigned int nodes, u64 latency),
+
+	TP_ARGS(inode, kind, blocks, bytes, nodes, latency),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	int,		kind		)
+		__field(	unsigned int,	blocks		)
+		__field(	u64,		bytes		)
+		__field(	unsigned int,	nodes		)
+		__field(	u64,		latency		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->kind		= kind;
+		__entry->blocks		= blocks;
+		__entry->bytes		= bytes;
+		__entry->nodes		= nodes;
+		__entry->latency	= latency;
+	),
+
+	TP_printk("dev %d,%d ino %lu %s blocks %u bytes %llu nodes %u "
+		  "latency %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino,
+		  show_merkel_update(__entry->kind), __entry->blocks,
+		  __entry->bytes, __entry->nodes, __entry->latency)
+);
+
+TRACE_EVENT(ext42_merkel_alloc,
+	TP_PROTO(struct inode *inode, size_t allocated, size_t freed),
+
+	TP_ARGS(inode, allocated, freed),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	size_t,		allocated	)
+		__field(	size_t,		freed		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->allocated	= allocated;
+		__entry->freed		= freed;
+	),
+
+	TP_printk("dev %d,%d ino %lu allocated %zu freed %zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino,
+		  __entry->allocated, __entry->freed)
+);
+
+TRACE_EVENT(ext42_merkel_verify_refused,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	loff_t,		size		)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->size	= i_size_read(inode);
+	),
+
+	TP_printk("dev %d,%d ino %lu size %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->size)
+);
+
 #endif /* _TRACE_EXT4_H */
 
 /* This part must be outside protection */
@@ -219,6 +219,8 @@ void ext42_evict_inode(struct inode *inode)
 			jbd2_complete_transaction(journal, commit_tid);
 			filemap_write_and_wait(&inode->i_data);
 		}
+		/* The tree is hashed from the pages about to go */
+		ext42_merkel_evict(inode);
 		truncate_inode_pages_final(&inode->i_data);
 
 		WARN_ON(atomic_read(&EXT4_I(inode)->i_ioend_count));
@@ -263,6 +265,7 @@ void ext42_evict_inode(struct inode *inode)
 			     "couldn't mark inode dirty (err %d)", err);
 		goto stop_handle;
 	}
+	ext42_merkel_delete_inode(inode);
 	if (inode->i_blocks)
 		ext42_truncate(inode);
 
@@ -3727,6 +3730,9 @@ int ext42_punch_hole(struct inode *inode, loff_t offset, loff_t length)
 	if (offset >= inode->i_size)
 		goto out_mutex;
 
+	/* The saved Merkle tree is only usable before size and mtime change */
+	ext42_merkel_load(inode);
+
 	/*
 	 * If the hole extends beyond i_size, set the hole
 	 * to end after the page that contains i_size
@@ -3821,6 +3827,11 @@ int ext42_punch_hole(struct inode *inode, loff_t offset, loff_t length)
 		ext42_update_inode_fsync_trans(handle, inode, 1);
 out_stop:
 	ext42_journal_stop(handle);
+	/* Only a complete punch is known to read back as zeroes */
+	if (ret >= 0)
+		ext42_merkel_zero(inode, inode->i_size, offset, length);
+	else
+		updateTree(inode, offset, length);
 out_dio:
 	up_write(&EXT4_I(inode)->i_mmap_sem);
 	ext42_inode_resume_unlocked_dio(inode);
@@ -4909,6 +4920,8 @@ int ext42_setattr(struct dentry *dentry, struct iattr *attr)
 		if (IS_I_VERSION(inode) && attr->ia_size != inode->i_size)
 			inode_inc_iversion(inode);
 
+		ext42_merkel_load(inode);
+
 		if (ext42_should_order_data(inode) &&
 		    (attr->ia_size < inode->i_size)) {
 			error = ext42_begin_ordered_truncate(inode,
@@ -4979,6 +4992,7 @@ int ext42_setattr(struct dentry *dentry, struct iattr *attr)
 		if (shrink)
 			ext42_truncate(inode);
 		up_write(&EXT4_I(inode)->i_mmap_sem);
+		ext42_merkel_truncate(inode, oldsize);
 	}
 
 	if (!rc) {
@@ -5426,6 +5440,7 @@ int ext42_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 
 	sb_start_pagefault(inode->i_sb);
 	file_update_time(vma->vm_file);
+	ext42_merkel_fault(inode);
 
 	down_read(&EXT4_I(inode)->i_mmap_sem);
 
@@ -5502,6 +5517,9 @@ retry_alloc:
 out_ret:
 	ret = block_page_mkwrite_return(ret);
 out:
+	/* Stores through the mapping never reach updateTree() */
+	if (ret & VM_FAULT_LOCKED)
+		ext42_merkel_mkwrite(inode, page_offset(page), PAGE_CACHE_SIZE);
 	up_read(&EXT4_I(inode)->i_mmap_sem);
 	sb_end_pagefault(inode->i_sb);
 	return ret;
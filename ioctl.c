@@ -212,60 +212,138 @@ long ext42_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     ext42_debug("cmd = %u, arg = %lu\n", cmd, arg);
 
     switch (cmd) {
-    case EXT4_IOC_GETTREE:    
-        ;//this is a mandatory empty non-declarative statement because label cannot directly precede a declaration
-        
-        //get raw inode
-        struct ext42_iloc iloc;
-        struct ext42_inode *raw_inode;
-        iloc.bh = NULL;
-        ext42_get_inode_loc(inode, &iloc);
-        raw_inode = ext42_raw_inode(&iloc);
-        merkel_tree node = *(raw_inode->tree);
-        
+    case EXT4_IOC_GETTREE: {
+        merkel_tree node;
+        int err;
+
+        //leaf hashes tell about the contents, and a build reads them all
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+
         //get path from user
-        merkel_tree path;
-        int err = copy_from_user(&path, (void *)arg, sizeof(path));               
-        if (err) {
-            printk(KERN_INFO "copy_from_user failed\n");
+        if (copy_from_user(&node, (void __user *)arg, sizeof(node)))
+            return -EFAULT;
+
+        //extract node from path, loading the tree if needed
+        err = ext42_merkel_get_node(inode, &node);
+        if (err)
             return err;
-        }    
-    
-        //extract node from path
-        while(node.depth != path.depth && path.depth != -1)
-        {            
-            int dir = path.block%2;
-            path.block /= 2;
-            if(dir == 0)
-            {
-                if(!node.l)
-                {
-                        D("Error : trying to retrieve NULL node");
-                        return -1000;
-                }
-
-                node = *(node.l);
-            }
-            else if(dir == 1)
-            {
-                if(!node.r)
-                {
-                    D("Error : trying to retrieve NULL node");
-                    return -1000;
-                }
-
-                node = *(node.r);
-            }
-            else
-                break;            
-        }
-                    
+
         //send node to user
-        err = copy_to_user((void *) arg, &node, sizeof(node));                    
-        if (err) {
-            printk(KERN_INFO "copy_from_user failed\n");
+        if (copy_to_user((void __user *)arg, &node, sizeof(node)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_GETTREE_BULK: {
+        struct ext42_merkel_export exp;
+        int err;
+
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+        if (copy_from_user(&exp, (void __user *)arg, sizeof(exp)))
+            return -EFAULT;
+
+        err = ext42_merkel_export(inode, &exp);
+        if (err)
             return err;
+
+        if (copy_to_user((void __user *)arg, &exp, sizeof(exp)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_DIFFTREE: {
+        struct ext42_merkel_diff diff;
+        struct fd other;
+        int err;
+
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+        if (copy_from_user(&diff, (void __user *)arg, sizeof(diff)))
+            return -EFAULT;
+
+        other = fdget(diff.mdf_fd);
+        if (!other.file)
+            return -EBADF;
+        if (!(other.file->f_mode & FMODE_READ)) {
+            fdput(other);
+            return -EBADF;
         }
+
+        err = ext42_merkel_diff(inode, file_inode(other.file), &diff);
+        fdput(other);
+        if (err)
+            return err;
+
+        if (copy_to_user((void __user *)arg, &diff, sizeof(diff)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_GETROOT: {
+        struct ext42_merkel_root mr;
+        int err;
+
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+        err = ext42_merkel_file_root(inode, &mr);
+        if (err)
+            return err;
+
+        if (copy_to_user((void __user *)arg, &mr, sizeof(mr)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_FINDDUPS: {
+        struct ext42_merkel_dups dups;
+        int err;
+
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&dups, (void __user *)arg, sizeof(dups)))
+            return -EFAULT;
+
+        err = ext42_merkel_find_dups(sb, &dups);
+        if (err)
+            return err;
+
+        if (copy_to_user((void __user *)arg, &dups, sizeof(dups)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_GETDIRROOT: {
+        struct ext42_merkel_dirroot dr;
+        int err;
+
+        err = ext42_merkel_dir_root(filp, &dr);
+        if (err)
+            return err;
+
+        if (copy_to_user((void __user *)arg, &dr, sizeof(dr)))
+            return -EFAULT;
+        return 0;
+    }
+    case EXT4_IOC_GETVERIFY: {
+        int on = ext42_merkel_get_verify(inode);
+
+        if (on < 0)
+            return on;
+        return put_user(on, (__u32 __user *) arg);
+    }
+    case EXT4_IOC_SETVERIFY: {
+        __u32 on;
+        int err;
+
+        if (!inode_owner_or_capable(inode))
+            return -EACCES;
+        if (get_user(on, (__u32 __user *) arg))
+            return -EFAULT;
+
+        err = mnt_want_write_file(filp);
+        if (err)
+            return err;
+        err = ext42_merkel_set_verify(inode, on != 0);
+        mnt_drop_write_file(filp);
+        return err;
+    }
     case EXT4_IOC_GETFLAGS:
         ext42_get_inode_flags(ei);
         flags = ei->i_flags & EXT4_FL_USER_VISIBLE;
@@ -822,6 +900,13 @@ long ext42_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
     case EXT4_IOC_SET_ENCRYPTION_POLICY:
     case EXT4_IOC_GET_ENCRYPTION_PWSALT:
     case EXT4_IOC_GET_ENCRYPTION_POLICY:
+    case EXT4_IOC_GETTREE_BULK:
+    case EXT4_IOC_DIFFTREE:
+    case EXT4_IOC_GETDIRROOT:
+    case EXT4_IOC_GETROOT:
+    case EXT4_IOC_FINDDUPS:
+    case EXT4_IOC_GETVERIFY:
+    case EXT4_IOC_SETVERIFY:
         break;
     default:
         return -ENOIOCTLCMD;
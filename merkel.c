@@ -0,0 +1,3913 @@
+/*
+ *  linux/fs/ext42/merkel.c
+ *
+ *  Merkle tree of regular file contents, one leaf per EXT42_MERKEL_BLOCK_SIZE block.
+ *
+ *  The tree hangs off ext42_inode_info and is loaded lazily: from the
+ *  hidden "merkel" xattr when the copy saved at the last close still
+ *  matches the file, otherwise it is rebuilt from the page cache the first
+ *  time somebody asks for it (EXT4_IOC_GETTREE).  Only the leaves are
+ *  saved, in the xattr itself; a file whose leaves do not fit in it is
+ *  not saved and gets its tree rebuilt.
+ *
+ *  Blocks are hashed over their full length with the engine picked by the
+ *  merkel_hash mount option: crc32c through the crypto API (sharing the
+ *  metadata checksum driver when there is one), xxh64 computed here, or
+ *  sha256.  merkel_hash_size truncates the digest.  Holes and unwritten
+ *  extents are not read: they get the precomputed hash of a zero block, and
+ *  full subtrees of those the precomputed hash of their level.
+ *
+ *  Nodes live in one array, level by level starting with the leaves (see
+ *  struct ext42_merkel).  Interior nodes have merkel_fanout children, 2 by
+ *  default; wider nodes make the tree shallower for big files.  Every level
+ *  is sized for mt_capacity leaves, which grows and shrinks geometrically,
+ *  so appending a block is amortized O(1) and recomputing parents is a
+ *  linear sweep over each level.
+ *
+ *  Writers do not hash: they mark their leaves in mt_pending and queue the
+ *  inode's delayed work on s_merkel_wq, so repeated writes to the same
+ *  blocks are hashed once per batch.  Anything reading or saving the tree
+ *  flushes the pending leaves first; readers of a tree with nothing pending
+ *  copy what they need under RCU and do not take the mutex at all.
+ *  Truncate and fallocate do not mark whole ranges either: blocks known to
+ *  read as zeroes get the hash of a zero block and blocks moved by a
+ *  collapse or insert keep theirs, only their ancestors are recomputed.
+ *  Stores through a shared mapping are seen at the write fault only: the
+ *  fault records the leaves, which are then hashed like written ones but
+ *  stay pending until their page is written back and protected again.
+ *
+ *  With the merkel_writeback mount option the work is not queued by writes:
+ *  ext42_bio_write_page() hashes the pending leaves of each page it sends
+ *  to disk, so a block rewritten many times between two writebacks is
+ *  hashed once and the tree follows what is on disk.  When the tree is
+ *  busy the page is hashed aside and folded in under the mutex later,
+ *  unless its leaves were marked again meanwhile.  The work then only
+ *  recomputes the ancestors.
+ *
+ *  Files opted in with EXT4_IOC_SETVERIFY keep their tree in memory and
+ *  have the pages read from disk checked against the leaves before they
+ *  are marked uptodate.  Their tree only comes from the saved copy, never
+ *  from the data it is meant to check.
+ *
+ *  Trees are accounted per filesystem (merkel_kb in sysfs) and given back
+ *  by a shrinker under memory pressure, or by the reclaim work once they
+ *  use more than merkel_max_kb; they are reloaded or rebuilt lazily.
+ *
+ *  Every flush, build and load is traced (ext42_merkel_update_enter/exit)
+ *  and added to the merkel_flushes, merkel_builds and merkel_hashed_*
+ *  counters in sysfs, with the time spent; tree memory allocated and freed
+ *  goes to ext42_merkel_alloc and merkel_alloc_bytes/merkel_freed_bytes.
+ *
+ *  Directories get a root too (EXT4_IOC_GETDIRROOT), kept in memory only
+ *  and updated incrementally by the namespace operations and by the work
+ *  whenever a flush changed the root of a file below.
+ */
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/namei.h>
+#include <linux/cred.h>
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
+#include <crypto/hash.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <asm/unaligned.h>
+#include "ext4.h"
+#include "ext4_jbd2.h"
+#include "xattr.h"
+
+#include <trace/events/ext42.h>
+
+/* bytes per leaf, whatever the filesystem block size */
+#define EXT42_MERKEL_BLOCK_SIZE 4096
+/* trees are never shrunk below this many leaves */
+#define MERKEL_MIN_CAPACITY 64
+/* how long writes are gathered before their leaves are rehashed */
+#define MERKEL_FLUSH_DELAY  msecs_to_jiffies(100)
+/* how long a modified tree must stay quiet before the work saves it */
+#define MERKEL_SAVE_DELAY   msecs_to_jiffies(5000)
+
+static const struct {
+    const char* name;    //merkel_hash= value
+    const char* driver;  //crypto_shash algorithm, NULL when computed here
+    unsigned int size;   //digest size in bytes
+} merkelHashes[] = {
+    [EXT42_MERKEL_HASH_CRC32C] = { "crc32c", "crc32c", 4 },
+    [EXT42_MERKEL_HASH_XXH64]  = { "xxh64",  NULL,     8 },
+    [EXT42_MERKEL_HASH_SHA256] = { "sha256", "sha256", 32 },
+};
+
+#define XXH_PRIME64_1 11400714785074694791ULL
+#define XXH_PRIME64_2 14029467366897019727ULL
+#define XXH_PRIME64_3  1609587929392839161ULL
+#define XXH_PRIME64_4  9650029242287828579ULL
+#define XXH_PRIME64_5  2870177450012600261ULL
+
+static inline u64 xxhRotl(u64 x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 xxhRound(u64 acc, u64 input)
+{
+    acc += input * XXH_PRIME64_2;
+    return xxhRotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline u64 xxhMerge(u64 acc, u64 val)
+{
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64 as specified by the reference implementation, 32 bytes per round */
+static u64 xxh64(const u8* p, size_t len, u64 seed)
+{
+    const u8* end = p + len;
+    u64 h;
+
+    if(len >= 32)
+    {
+        const u8* limit = end - 32;
+        u64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        u64 v2 = seed + XXH_PRIME64_2;
+        u64 v3 = seed;
+        u64 v4 = seed - XXH_PRIME64_1;
+        do
+        {
+            v1 = xxhRound(v1, get_unaligned_le64(p));
+            v2 = xxhRound(v2, get_unaligned_le64(p+8));
+            v3 = xxhRound(v3, get_unaligned_le64(p+16));
+            v4 = xxhRound(v4, get_unaligned_le64(p+24));
+            p += 32;
+        } while(p <= limit);
+        h = xxhRotl(v1, 1) + xxhRotl(v2, 7) + xxhRotl(v3, 12) + xxhRotl(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }
+    else
+        h = seed + XXH_PRIME64_5;
+    h += len;
+
+    for(;p+8 <= end;p += 8)
+    {
+        h ^= xxhRound(0, get_unaligned_le64(p));
+        h  = xxhRotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if(p+4 <= end)
+    {
+        h ^= (u64)get_unaligned_le32(p) * XXH_PRIME64_1;
+        h  = xxhRotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for(;p < end;p++)
+    {
+        h ^= *p * XXH_PRIME64_5;
+        h  = xxhRotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline unsigned int hashSize(struct ext42_sb_info* sbi)
+{
+    if(sbi->s_merkel_hash_size)
+        return sbi->s_merkel_hash_size;
+    return merkelHashes[sbi->s_merkel_alg].size;
+}
+
+static void hashData(struct ext42_sb_info* sbi, const void* data, unsigned int len, u8* out)
+{
+    //every byte counts, the digest is truncated to the tree width
+    u8 digest[EXT42_MERKEL_HASH_MAX_SIZE];
+
+    if(sbi->s_merkel_alg == EXT42_MERKEL_HASH_XXH64)
+        put_unaligned_le64(xxh64(data, len, 0), digest);
+    else
+    {
+        struct crypto_shash* tfm = sbi->s_merkel_tfm ? sbi->s_merkel_tfm : sbi->s_chksum_driver;
+        SHASH_DESC_ON_STACK(desc, tfm);
+        int err;
+
+        desc->tfm   = tfm;
+        desc->flags = 0;
+        err = crypto_shash_digest(desc, data, len, digest);
+        BUG_ON(err);
+    }
+    memcpy(out, digest, hashSize(sbi));
+}
+
+/*
+ * Hash the block in place in the page cache, holes are read back as zeroes.
+ * Returns 1 when the block may still change without a fault telling us:
+ * its page is dirty under a shared writable mapping, or the file is DAX
+ * and mapped that way.  Returns the error when it cannot be read, @out is
+ * then left alone: either way the leaf must stay pending.
+ */
+static int hashBlock(struct inode* inode, int blknb, unsigned int len, u8* out)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    loff_t offset = (loff_t)blknb*EXT42_MERKEL_BLOCK_SIZE;
+    struct page* page;
+    unsigned char* kaddr;
+    int mapped;
+
+    BUILD_BUG_ON(EXT42_MERKEL_BLOCK_SIZE > PAGE_CACHE_SIZE);
+    if(len == 0)
+    {
+        hashData(sbi, NULL, 0, out);
+        return 0;
+    }
+
+    page = read_mapping_page(inode->i_mapping, offset >> PAGE_CACHE_SHIFT, NULL);
+    if(IS_ERR(page))
+    {
+        D(MERKEL, "Reading block %d failed %ld", blknb, PTR_ERR(page));
+        return PTR_ERR(page);
+    }
+    kaddr = kmap(page);
+    hashData(sbi, kaddr + (offset & (PAGE_CACHE_SIZE-1)), len, out);
+    kunmap(page);
+    mapped = mapping_writably_mapped(inode->i_mapping) && (IS_DAX(inode) || PageDirty(page));
+    page_cache_release(page);
+    return mapped;
+}
+
+static unsigned int computeDepth(struct ext42_merkel* tree, unsigned int nbLeaves)
+{
+    unsigned int depth = 0;
+    while(depth*tree->mt_fanout_bits < 32 && (1ULL << depth*tree->mt_fanout_bits) < nbLeaves)
+        depth++;
+    return depth;
+}
+
+static inline unsigned int ancestor(struct ext42_merkel* tree, unsigned int pos, unsigned int level)
+{
+    //index on @level of the node above leaf @pos, shifts may reach 32 bits or more
+    return (u64)pos >> (level*tree->mt_fanout_bits);
+}
+
+static inline unsigned int levelCount(struct ext42_merkel* tree, unsigned int nbLeaves, unsigned int level)
+{
+    //number of nodes on a level, i.e. ceil(nbLeaves / fanout^level)
+    return ancestor(tree, nbLeaves-1, level) + 1;
+}
+
+static inline u8* getNode(struct ext42_merkel* tree, unsigned int level, unsigned int pos)
+{
+    return tree->mt_nodes + (size_t)(tree->mt_level[level] + pos)*tree->mt_hash_size;
+}
+
+static void* allocNodes(size_t size)
+{
+    if(size <= PAGE_SIZE)
+        return kmalloc(size, GFP_NOFS);
+    return __vmalloc(size, GFP_NOFS, PAGE_KERNEL);
+}
+
+static void freeTreeRcu(struct rcu_head* head)
+{
+    struct ext42_merkel* tree = container_of(head, struct ext42_merkel, mt_rcu);
+
+    kvfree(tree->mt_nodes);
+    kvfree(tree->mt_pending);
+    kvfree(tree->mt_parents);
+    kfree(tree);
+}
+
+//a tree that was ever published may still be read locklessly
+static void freeMerkelTree(struct ext42_merkel* tree)
+{
+    call_rcu(&tree->mt_rcu, freeTreeRcu);
+}
+
+/*
+ * Change the number of leaves of @tree.  The node array is reallocated
+ * only when the leaves no longer fit or when less than a quarter of the
+ * room is used; existing nodes keep their value.  A reallocated tree is a
+ * new struct, returned in place of @tree which is left untouched for the
+ * caller to publish the new one and free the old one.  Returns NULL when
+ * memory runs out.
+ */
+static struct ext42_merkel* resizeTree(struct ext42_merkel* tree, unsigned int nbLeaves)
+{
+    unsigned int level[EXT42_MERKEL_MAX_LEVELS];
+    unsigned int capacity = tree->mt_capacity;
+    unsigned int depth, maxDepth, l, offset;
+    unsigned long *pending, *parents;
+    struct ext42_merkel* grown;
+    u8* nodes;
+
+    if(nbLeaves > capacity)
+        capacity = max(nbLeaves, 2*capacity);
+    else if(nbLeaves < capacity/4 && capacity > MERKEL_MIN_CAPACITY)
+        capacity = max(2*nbLeaves, (unsigned int)MERKEL_MIN_CAPACITY);
+
+    if(capacity == tree->mt_capacity)
+    {
+        if(nbLeaves < tree->mt_nr_leaves)
+        {
+            bitmap_clear(tree->mt_pending, nbLeaves, tree->mt_nr_leaves-nbLeaves);
+            bitmap_clear(tree->mt_parents, nbLeaves, tree->mt_nr_leaves-nbLeaves);
+        }
+        tree->mt_nr_leaves = nbLeaves;
+        tree->mt_depth     = computeDepth(tree, nbLeaves);
+        return tree;
+    }
+
+    //lay levels out for the new capacity and move the nodes still in use
+    maxDepth = computeDepth(tree, capacity);
+    for(l = 0, offset = 0;l <= maxDepth;l++)
+    {
+        level[l] = offset;
+        offset  += levelCount(tree, capacity, l);
+    }
+    grown   = kmalloc(sizeof(*grown), GFP_NOFS);
+    nodes   = allocNodes((size_t)tree->mt_hash_size*offset);
+    pending = allocNodes(BITS_TO_LONGS(capacity)*sizeof(long));
+    parents = allocNodes(BITS_TO_LONGS(capacity)*sizeof(long));
+    if(!grown || !nodes || !pending || !parents)
+    {
+        kfree(grown);
+        kvfree(nodes);
+        kvfree(pending);
+        kvfree(parents);
+        return NULL;
+    }
+    bitmap_zero(pending, capacity);
+    bitmap_zero(parents, capacity);
+
+    if(tree->mt_nodes)
+    {
+        depth = min(tree->mt_depth, maxDepth);
+        for(l = 0;l <= depth;l++)
+            memcpy(nodes + (size_t)level[l]*tree->mt_hash_size, getNode(tree, l, 0),
+                   (size_t)tree->mt_hash_size*min(levelCount(tree, tree->mt_nr_leaves, l),
+                                  levelCount(tree, nbLeaves, l)));
+        bitmap_copy(pending, tree->mt_pending, min(tree->mt_nr_leaves, nbLeaves));
+        bitmap_copy(parents, tree->mt_parents, min(tree->mt_nr_leaves, nbLeaves));
+        bitmap_clear(pending, nbLeaves, capacity-nbLeaves);
+        bitmap_clear(parents, nbLeaves, capacity-nbLeaves);
+    }
+
+    *grown = *tree;
+    grown->mt_nodes     = nodes;
+    grown->mt_pending   = pending;
+    grown->mt_parents   = parents;
+    grown->mt_capacity  = capacity;
+    grown->mt_bytes     = sizeof(*grown) + (size_t)grown->mt_hash_size*offset +
+                  2*BITS_TO_LONGS(capacity)*sizeof(long);
+    memcpy(grown->mt_level, level, sizeof(level[0])*(maxDepth+1));
+    grown->mt_nr_leaves = nbLeaves;
+    grown->mt_depth     = computeDepth(grown, nbLeaves);
+    return grown;
+}
+
+static struct ext42_merkel* newTree(struct ext42_sb_info* sbi, unsigned int nbLeaves)
+{
+    //an empty tree, so that the first resize allocates everything
+    struct ext42_merkel empty;
+
+    memset(&empty, 0, sizeof(empty));
+    empty.mt_hash_alg    = sbi->s_merkel_alg;
+    empty.mt_hash_size   = hashSize(sbi);
+    empty.mt_fanout_bits = ilog2(sbi->s_merkel_fanout ? sbi->s_merkel_fanout : 2);
+    return resizeTree(&empty, nbLeaves);
+}
+
+static inline int overLimit(struct ext42_sb_info* sbi)
+{
+    return sbi->s_merkel_max_kb &&
+           percpu_counter_read_positive(&sbi->s_merkel_bytes) > (s64)sbi->s_merkel_max_kb << 10;
+}
+
+static void countAlloc(struct inode* inode, size_t allocated, size_t freed)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+
+    atomic64_add(allocated, &sbi->s_merkel_alloc_bytes);
+    atomic64_add(freed, &sbi->s_merkel_freed_bytes);
+    trace_ext42_merkel_alloc(inode, allocated, freed);
+}
+
+/*
+ * Account the tree of @inode, which was just set, dropped or resized, and
+ * keep the inode on s_merkel_list while it has one.  The caller holds
+ * i_merkel_mutex.
+ */
+static void trackTree(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    size_t bytes = ei->i_merkel_tree ? ei->i_merkel_tree->mt_bytes : 0;
+
+    spin_lock(&sbi->s_merkel_lock);
+    if(bytes && list_empty(&ei->i_merkel_list))
+    {
+        list_add_tail(&ei->i_merkel_list, &sbi->s_merkel_list);
+        sbi->s_merkel_nr_trees++;
+    }
+    else if(!bytes && !list_empty(&ei->i_merkel_list))
+    {
+        list_del_init(&ei->i_merkel_list);
+        sbi->s_merkel_nr_trees--;
+    }
+    spin_unlock(&sbi->s_merkel_lock);
+
+    percpu_counter_add(&sbi->s_merkel_bytes, (s64)bytes - (s64)ei->i_merkel_bytes);
+    ei->i_merkel_bytes   = bytes;
+    ei->i_merkel_touched = 1;
+
+    //past merkel_max_kb the coldest trees are written back and discarded
+    if(bytes && overLimit(sbi))
+        queue_work(sbi->s_merkel_wq, &sbi->s_merkel_reclaim_work);
+}
+
+/* a block hashed by writeback while i_merkel_mutex was busy, on i_merkel_wb */
+struct merkelWbLeaf {
+    struct list_head list;
+    unsigned int     leaf;
+    unsigned int     marks;     //i_merkel_marks before it was hashed
+    u8               hash[EXT42_MERKEL_HASH_MAX_SIZE];
+};
+
+static void takeWriteback(struct ext42_inode_info* ei, struct list_head* leaves)
+{
+    spin_lock(&ei->i_merkel_mmap_lock);
+    list_splice_init(&ei->i_merkel_wb, leaves);
+    spin_unlock(&ei->i_merkel_mmap_lock);
+}
+
+static void dropWriteback(struct ext42_inode_info* ei)
+{
+    struct merkelWbLeaf *wb, *next;
+    LIST_HEAD(leaves);
+
+    takeWriteback(ei, &leaves);
+    list_for_each_entry_safe(wb, next, &leaves, list)
+        kfree(wb);
+}
+
+/*
+ * Make @tree, possibly NULL, the tree of @inode and free the one it
+ * replaces once lockless readers are done with it.  The caller holds
+ * i_merkel_mutex.
+ */
+static void setTree(struct inode* inode, struct ext42_merkel* tree)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* old = ei->i_merkel_tree;
+
+    rcu_assign_pointer(ei->i_merkel_tree, tree);
+    if(old != tree)
+        countAlloc(inode, tree ? tree->mt_bytes : 0, old ? old->mt_bytes : 0);
+    if(old && old != tree)
+        freeMerkelTree(old);
+    if(!tree)
+        dropWriteback(ei);
+    trackTree(inode);
+}
+
+/* Returns 0 when the hash of a subtree of zeroes was copied instead */
+static inline int hashParent(struct ext42_merkel* tree, struct ext42_sb_info* sbi,
+                 unsigned int level, unsigned int pos)
+{
+    //siblings are adjacent in the level, so a parent hashes them in place
+    unsigned int child = pos << tree->mt_fanout_bits;
+    unsigned int nb = min(levelCount(tree, tree->mt_nr_leaves, level-1) - child,
+                  1U << tree->mt_fanout_bits);
+    u8* children = getNode(tree, level-1, child);
+    unsigned int i;
+
+    //full nodes over zeroes have a known hash
+    if(nb == 1U << tree->mt_fanout_bits)
+    {
+        for(i = 0;i < nb;i++)
+            if(memcmp(children + i*tree->mt_hash_size, sbi->s_merkel_zero[level-1], tree->mt_hash_size))
+                break;
+        if(i == nb)
+        {
+            memcpy(getNode(tree, level, pos), sbi->s_merkel_zero[level], tree->mt_hash_size);
+            return 0;
+        }
+    }
+    hashData(sbi, children, nb*tree->mt_hash_size, getNode(tree, level, pos));
+    return 1;
+}
+
+static unsigned int hashLevels(struct ext42_merkel* tree, struct ext42_sb_info* sbi,
+                   unsigned int first, unsigned int last, unsigned int from, unsigned int to)
+{
+    //recompute the ancestors of leaves [first, last] on levels from..to
+    unsigned int l, j, nodes = 0;
+    for(l = from;l <= to;l++)
+        for(j = ancestor(tree, first, l);j <= ancestor(tree, last, l);j++)
+            nodes += hashParent(tree, sbi, l, j);
+    return nodes;
+}
+
+static unsigned int setNewHasheParents(struct ext42_merkel* tree, struct ext42_sb_info* sbi,
+                       unsigned int first, unsigned int last)
+{
+    return hashLevels(tree, sbi, first, last, 1, tree->mt_depth);
+}
+
+/* Work done by one tree update, for the counters and tracepoints */
+struct merkelCount {
+    unsigned int blocks;    /* leaves hashed from file data */
+    u64          bytes;
+    unsigned int nodes;     /* inner nodes hashed */
+};
+
+static void countUpdate(struct inode* inode, int kind, struct merkelCount* count, u64 start)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    u64 ns = ktime_get_ns() - start;
+
+    if(kind == EXT42_MERKEL_UPDATE_FLUSH)
+    {
+        atomic64_inc(&sbi->s_merkel_flushes);
+        atomic64_add(ns, &sbi->s_merkel_flush_ns);
+    }
+    else
+    {
+        atomic64_inc(&sbi->s_merkel_builds);
+        atomic64_add(ns, &sbi->s_merkel_build_ns);
+    }
+    atomic64_add(count->blocks, &sbi->s_merkel_hashed_blocks);
+    atomic64_add(count->bytes, &sbi->s_merkel_hashed_bytes);
+    atomic64_add(count->nodes, &sbi->s_merkel_hashed_nodes);
+    trace_ext42_merkel_update_exit(inode, kind, count->blocks, count->bytes, count->nodes, ns);
+}
+
+/*
+ * Return how many leaves from @first, at most @nb, either all read back as
+ * zeroes without the disk being looked at (*zero set) or may hold data.
+ * Holes and unwritten extents are zeroes unless delayed allocation or a
+ * page in the cache covers them: those are hashed like any other block.
+ */
+static unsigned int leafRun(struct inode* inode, unsigned int first, unsigned int nb, int* zero)
+{
+    unsigned int blkbits = inode->i_blkbits, bits = ilog2(EXT42_MERKEL_BLOCK_SIZE) - blkbits;
+    struct ext42_map_blocks map;
+    struct extent_status es;
+    struct page* page;
+    ext42_lblk_t len;
+    int ret;
+
+    *zero = 0;
+    if(blkbits > ilog2(EXT42_MERKEL_BLOCK_SIZE) || ext42_has_inline_data(inode) ||
+       !ext42_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+       ((u64)first << bits) >= EXT_MAX_BLOCKS)
+        return nb;
+
+    map.m_lblk = first << bits;
+    map.m_len  = min_t(u64, (u64)nb << bits, EXT_MAX_BLOCKS - map.m_lblk);
+    ret = ext42_map_blocks(NULL, inode, &map, 0);
+    if(ret < 0)
+        return 1;
+    if(ret > 0 && !(map.m_flags & EXT4_MAP_UNWRITTEN))
+        return max(map.m_len >> bits, 1U);
+
+    //stop before the first delayed or cached block
+    len = map.m_len;
+    ext42_es_find_delayed_extent_range(inode, map.m_lblk, map.m_lblk + len - 1, &es);
+    if(es.es_len)
+        len = es.es_lblk > map.m_lblk ? min(len, es.es_lblk - map.m_lblk) : 0;
+    if(len && find_get_pages(inode->i_mapping,
+                 ((loff_t)map.m_lblk << blkbits) >> PAGE_CACHE_SHIFT, 1, &page))
+    {
+        u64 blk = ((loff_t)page->index << PAGE_CACHE_SHIFT) >> blkbits;
+        if(blk < map.m_lblk + len)
+            len = blk > map.m_lblk ? blk - map.m_lblk : 0;
+        page_cache_release(page);
+    }
+
+    if(len >> bits == 0)
+        return 1;
+    *zero = 1;
+    return len >> bits;
+}
+
+/*
+ * Hash leaves [first, last] of @tree.  Those whose page may still be
+ * written through a mapping or could not be read are set in @mapped, to be
+ * hashed again; a leaf never takes a hash of data that was not read.  The
+ * blocks read are added to @count.
+ */
+static void getHashes(struct ext42_merkel* tree, struct inode* inode,
+              unsigned int first, unsigned int last, loff_t size, unsigned long* mapped,
+              struct merkelCount* count)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    unsigned int i, run = 0, full = size/EXT42_MERKEL_BLOCK_SIZE;
+    int zero = 0, err;
+
+    //hash straight into the leaves, the last block of the file may be partial
+    for(i = first;i <= last;i++)
+    {
+        loff_t offset = (loff_t)i*EXT42_MERKEL_BLOCK_SIZE;
+        unsigned int len = 0;
+
+        //sparse runs of full blocks are not read at all
+        if(!run && i < full)
+            run = leafRun(inode, i, min(last+1, full) - i, &zero);
+        if(run)
+        {
+            run--;
+            if(zero)
+            {
+                memcpy(getNode(tree, 0, i), sbi->s_merkel_zero[0], tree->mt_hash_size);
+                continue;
+            }
+        }
+
+        if(offset < size)
+            len = min_t(loff_t, EXT42_MERKEL_BLOCK_SIZE, size-offset);
+        err = hashBlock(inode, i, len, getNode(tree, 0, i));
+        if(err)
+            set_bit(i, mapped);
+        if(err < 0)
+            continue;
+        count->blocks++;
+        count->bytes += len;
+    }
+}
+
+/*
+ * Full builds are cut into chunks of aligned leaves, at least
+ * 1 << MERKEL_CHUNK_SHIFT and covering whole nodes of the fanout.  A chunk
+ * owns its leaves and every ancestor up to chunkLevels levels above them,
+ * so chunks are hashed in parallel without locking; the few levels above
+ * are reduced once all chunks are done.  At most one helper per online CPU
+ * is queued on s_merkel_wq, each taking chunks from a shared counter, and
+ * the building thread takes chunks as well.
+ */
+#define MERKEL_CHUNK_SHIFT  8
+
+struct merkelBuild {
+    struct ext42_merkel* tree;
+    struct inode*        inode;
+    loff_t               size;
+    unsigned int         chunkLevels;
+    unsigned int         nbChunks;
+    atomic_t             next;
+    atomic64_t           blocks;
+    atomic64_t           bytes;
+    atomic64_t           nodes;
+};
+
+struct merkelHelper {
+    struct work_struct   work;
+    struct merkelBuild*  build;
+};
+
+static void buildChunks(struct merkelBuild* build)
+{
+    struct ext42_merkel* tree = build->tree;
+    unsigned int shift = build->chunkLevels*tree->mt_fanout_bits;
+    struct merkelCount count = { 0 };
+    unsigned int c, first, last;
+
+    while((c = atomic_inc_return(&build->next) - 1) < build->nbChunks)
+    {
+        first = c << shift;
+        last  = min(first + (1U << shift), tree->mt_nr_leaves) - 1;
+        getHashes(tree, build->inode, first, last, build->size, tree->mt_pending, &count);
+        count.nodes += hashLevels(tree, EXT4_SB(build->inode->i_sb), first, last,
+                      1, min(build->chunkLevels, tree->mt_depth));
+        cond_resched();
+    }
+    atomic64_add(count.blocks, &build->blocks);
+    atomic64_add(count.bytes, &build->bytes);
+    atomic64_add(count.nodes, &build->nodes);
+}
+
+static void buildHelper(struct work_struct* work)
+{
+    buildChunks(container_of(work, struct merkelHelper, work)->build);
+}
+
+static void buildTree(struct ext42_merkel* tree, struct inode* inode, loff_t size,
+              struct merkelCount* count)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct merkelBuild build;
+    struct merkelHelper* helpers = NULL;
+    unsigned int nbHelpers, i;
+
+    build.tree     = tree;
+    build.inode    = inode;
+    build.size     = size;
+    build.chunkLevels = DIV_ROUND_UP(MERKEL_CHUNK_SHIFT, tree->mt_fanout_bits);
+    build.nbChunks = ancestor(tree, tree->mt_nr_leaves-1, build.chunkLevels) + 1;
+    atomic_set(&build.next, 0);
+    atomic64_set(&build.blocks, 0);
+    atomic64_set(&build.bytes, 0);
+    atomic64_set(&build.nodes, 0);
+
+    //one helper less than CPUs, this thread is busy too
+    nbHelpers = min(build.nbChunks, num_online_cpus()) - 1;
+    if(nbHelpers && sbi->s_merkel_wq)
+        helpers = kmalloc_array(nbHelpers, sizeof(*helpers), GFP_NOFS);
+    if(helpers)
+    {
+        for(i = 0;i < nbHelpers;i++)
+        {
+            INIT_WORK(&helpers[i].work, buildHelper);
+            helpers[i].build = &build;
+            queue_work(sbi->s_merkel_wq, &helpers[i].work);
+        }
+    }
+
+    buildChunks(&build);
+    if(helpers)
+    {
+        for(i = 0;i < nbHelpers;i++)
+            flush_work(&helpers[i].work);
+        kfree(helpers);
+    }
+
+    count->blocks = atomic64_read(&build.blocks);
+    count->bytes  = atomic64_read(&build.bytes);
+    count->nodes  = atomic64_read(&build.nodes);
+
+    //reduce the levels above the chunks
+    if(tree->mt_depth > build.chunkLevels)
+        count->nodes += hashLevels(tree, sbi, 0, tree->mt_nr_leaves-1,
+                       build.chunkLevels+1, tree->mt_depth);
+}
+
+static void bumpVersion(struct inode* inode)
+{
+    EXT4_I(inode)->i_merkel_version =
+        atomic64_inc_return(&EXT4_SB(inode->i_sb)->s_merkel_version);
+}
+
+/* iterate over the runs [first, last] of set bits among the first n */
+#define for_each_run(bitmap, n, first, last)                                 \
+    for((first) = find_first_bit((bitmap), (n));                              \
+        (first) < (n) &&                                                      \
+        ((last) = find_next_zero_bit((bitmap), (n), (first)) - 1, 1);         \
+        (first) = find_next_bit((bitmap), (n), (last)+1))
+
+/*
+ * Put the blocks hashed by deferWriteback() in the pending leaves of
+ * @tree, the latest hash of a block winning.  Blocks whose leaves were
+ * marked again since they were hashed are dropped: what went to disk may
+ * predate the change, the next writeback hashes it.  The caller holds
+ * i_merkel_mutex and is inside i_merkel_seq.
+ */
+static void foldWriteback(struct ext42_inode_info* ei, struct ext42_merkel* tree)
+{
+    unsigned int marks = atomic_read(&ei->i_merkel_marks);
+    struct merkelWbLeaf *wb, *next;
+    LIST_HEAD(leaves);
+
+    if(list_empty_careful(&ei->i_merkel_wb))
+        return;
+    takeWriteback(ei, &leaves);
+    list_for_each_entry(wb, &leaves, list)
+    {
+        if(wb->marks != marks || wb->leaf >= tree->mt_nr_leaves ||
+           !test_bit(wb->leaf, tree->mt_pending))
+            continue;
+        memcpy(getNode(tree, 0, wb->leaf), wb->hash, tree->mt_hash_size);
+        set_bit(wb->leaf, tree->mt_parents);
+    }
+    list_for_each_entry_safe(wb, next, &leaves, list)
+    {
+        if(wb->marks == marks && wb->leaf < tree->mt_nr_leaves)
+            clear_bit(wb->leaf, tree->mt_pending);
+        kfree(wb);
+    }
+}
+
+/*
+ * Move the leaves recorded by ext42_merkel_mkwrite() into mt_pending, once
+ * those hashed aside by writeback are in.  The caller holds
+ * i_merkel_mutex and is inside i_merkel_seq.
+ */
+static void absorbSpans(struct ext42_inode_info* ei, struct ext42_merkel* tree)
+{
+    unsigned int i, first, last;
+
+    foldWriteback(ei, tree);
+    if(!READ_ONCE(ei->i_merkel_mmap_nr))
+        return;
+    spin_lock(&ei->i_merkel_mmap_lock);
+    for(i = 0;i < ei->i_merkel_mmap_nr;i++)
+    {
+        first = ei->i_merkel_mmap[i].ms_first;
+        last  = min(ei->i_merkel_mmap[i].ms_last, tree->mt_nr_leaves-1);
+        if(first > last)
+            continue;
+        bitmap_set(tree->mt_pending, first, last-first+1);
+        tree->mt_stale = 1;
+    }
+    ei->i_merkel_mmap_nr = 0;
+    spin_unlock(&ei->i_merkel_mmap_lock);
+}
+
+static void rootChanged(struct inode* inode, const u8* root);
+static inline spinlock_t* dirLock(struct inode* inode);
+static void queueDups(struct inode* inode);
+static void freeDupIndex(struct ext42_merkel_dup_index* index);
+
+/*
+ * The root of @inode changed.  The directories linking it only hear of it
+ * from the work, which takes i_mutex first so that it cannot see a file
+ * in the middle of a rename.  Nothing to do when no directory holds it.
+ */
+static void markRoot(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+
+    if(!READ_ONCE(ei->i_merkel_root_folded))
+        return;
+    if(!atomic_read(&sbi->s_merkel_dirs))
+    {
+        WRITE_ONCE(ei->i_merkel_root_valid, 0);
+        WRITE_ONCE(ei->i_merkel_root_folded, 0);
+        return;
+    }
+    ei->i_merkel_root_dirty = 1;
+    mod_delayed_work(sbi->s_merkel_wq, &ei->i_merkel_work, 0);
+}
+
+/*
+ * Rehash the leaves marked in mt_pending unless @leaves is 0, then the
+ * ancestors of those and of the leaves in mt_parents.  Each level is swept
+ * once over the union of the runs' ancestors, so runs sharing a parent do
+ * not hash it twice.  The caller holds i_merkel_mutex.
+ */
+static void flushTree(struct inode* inode, struct ext42_merkel* tree, int leaves)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    loff_t size = i_size_read(inode);
+    struct merkelCount count = { 0 };
+    unsigned int first, last, l, j, next;
+    u64 start;
+
+    if(!tree->mt_stale && !READ_ONCE(EXT4_I(inode)->i_merkel_mmap_nr))
+        return;
+
+    start = ktime_get_ns();
+    trace_ext42_merkel_update_enter(inode, EXT42_MERKEL_UPDATE_FLUSH, tree->mt_nr_leaves);
+    write_seqcount_begin(&EXT4_I(inode)->i_merkel_seq);
+    absorbSpans(EXT4_I(inode), tree);
+
+    //leaves still writable through a mapping stay pending until written back
+    if(leaves)
+    {
+        for_each_run(tree->mt_pending, tree->mt_nr_leaves, first, last)
+        {
+            bitmap_set(tree->mt_parents, first, last-first+1);
+            bitmap_clear(tree->mt_pending, first, last-first+1);
+            getHashes(tree, inode, first, last, size, tree->mt_pending, &count);
+        }
+    }
+
+    for(l = 1;l <= tree->mt_depth;l++)
+    {
+        next = 0;
+        for_each_run(tree->mt_parents, tree->mt_nr_leaves, first, last)
+        {
+            j = max(ancestor(tree, first, l), next);
+            for(;j <= ancestor(tree, last, l);j++)
+                count.nodes += hashParent(tree, sbi, l, j);
+            next = max(next, ancestor(tree, last, l) + 1);
+        }
+    }
+
+    bitmap_zero(tree->mt_parents, tree->mt_nr_leaves);
+    tree->mt_stale = !bitmap_empty(tree->mt_pending, tree->mt_nr_leaves);
+    EXT4_I(inode)->i_merkel_dirty = 1;
+    bumpVersion(inode);
+    write_seqcount_end(&EXT4_I(inode)->i_merkel_seq);
+    markRoot(inode);
+    countUpdate(inode, EXT42_MERKEL_UPDATE_FLUSH, &count, start);
+}
+
+/*
+ * The file is about to change, or just did: remove the saved copy unless
+ * it is known to be gone already.  Size and mtime alone do not tell it is
+ * stale, a write within the same tick or a utimes() keeps both.  Called
+ * outside any handle, without i_merkel_mutex.
+ */
+static void dropCopy(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    int err;
+
+    if(READ_ONCE(ei->i_merkel_saved) == EXT42_MERKEL_SAVED_NONE)
+        return;
+    mutex_lock(&ei->i_merkel_mutex);
+    //not looked at yet: most files never had a copy, that needs no handle
+    if(ei->i_merkel_saved == EXT42_MERKEL_SAVED_UNKNOWN &&
+       ext42_xattr_get(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME, NULL, 0) == -ENODATA)
+        ei->i_merkel_saved = EXT42_MERKEL_SAVED_NONE;
+    if(ei->i_merkel_saved != EXT42_MERKEL_SAVED_NONE)
+    {
+        err = ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME,
+                      NULL, 0, 0);
+        if(!err || err == -ENODATA)
+            ei->i_merkel_saved = EXT42_MERKEL_SAVED_NONE;
+        else
+            ext42_warning_inode(inode, "couldn't remove stale Merkle tree (err %d)", err);
+    }
+    mutex_unlock(&ei->i_merkel_mutex);
+}
+
+void ext42_merkel_work(struct work_struct* work)
+{
+    struct ext42_inode_info* ei = container_of(to_delayed_work(work),
+                           struct ext42_inode_info, i_merkel_work);
+    int dirty;
+
+    //with merkel_writeback leaves are hashed by writeback, not from the page cache
+    mutex_lock(&ei->i_merkel_mutex);
+    if(ei->i_merkel_tree)
+        flushTree(&ei->vfs_inode, ei->i_merkel_tree,
+              !test_opt(ei->vfs_inode.i_sb, MERKEL_WRITEBACK) ||
+              ext42_should_journal_data(&ei->vfs_inode));
+    dirty = ei->i_merkel_dirty;
+    mutex_unlock(&ei->i_merkel_mutex);
+
+    //every flush pushes the save back, it runs once writes have settled
+    if(dirty)
+        mod_delayed_work(EXT4_SB(ei->vfs_inode.i_sb)->s_merkel_wq, &ei->i_merkel_save_work,
+                 MERKEL_SAVE_DELAY);
+
+    //a fault racing with the last save left a copy that no longer matches
+    if(dirty && READ_ONCE(ei->i_merkel_saved) != EXT42_MERKEL_SAVED_NONE &&
+       !(ei->vfs_inode.i_sb->s_flags & MS_RDONLY))
+    {
+        sb_start_intwrite(ei->vfs_inode.i_sb);
+        dropCopy(&ei->vfs_inode);
+        sb_end_intwrite(ei->vfs_inode.i_sb);
+    }
+
+    //carry a new root up, i_mutex goes before i_merkel_mutex
+    if(!READ_ONCE(ei->i_merkel_root_dirty))
+        return;
+    mutex_lock(&ei->vfs_inode.i_mutex);
+    mutex_lock(&ei->i_merkel_mutex);
+    if(ei->i_merkel_root_dirty)
+    {
+        struct ext42_merkel* tree = ei->i_merkel_tree;
+
+        ei->i_merkel_root_dirty = 0;
+        rootChanged(&ei->vfs_inode, tree ? getNode(tree, tree->mt_depth, 0) : NULL);
+    }
+    mutex_unlock(&ei->i_merkel_mutex);
+    mutex_unlock(&ei->vfs_inode.i_mutex);
+}
+
+/*
+ * Return the hidden xattr of @inode as it is, NULL if there is none.  The
+ * caller frees it.
+ */
+static struct ext42_merkel_disk* getDiskXattr(struct inode* inode, int* size)
+{
+    struct ext42_merkel_disk* disk;
+
+    *size = ext42_xattr_get(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME, NULL, 0);
+    if(*size < (int)sizeof(*disk))
+        return NULL;
+    disk = kmalloc(*size, GFP_NOFS);
+    if(!disk)
+        return NULL;
+    if(ext42_xattr_get(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME,
+               disk, *size) != *size ||
+       le32_to_cpu(disk->md_magic) != EXT42_MERKEL_MAGIC)
+    {
+        kfree(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+/*
+ * Bytes of leaves the xattr can hold: one xattr block, less its header,
+ * the entries of both hidden xattrs and the end marker.  Other xattrs of
+ * the inode may leave less, saveTree() then fails with -ENOSPC.
+ */
+static size_t maxDiskLeaves(struct super_block* sb)
+{
+    return sb->s_blocksize - sizeof(struct ext42_xattr_header) - sizeof(__u32) -
+           EXT4_XATTR_LEN(sizeof(EXT42_MERKEL_XATTR_NAME)-1) -
+           EXT4_XATTR_LEN(sizeof(EXT42_MERKEL_VERIFY_XATTR_NAME)-1) -
+           sizeof(struct ext42_merkel_disk);
+}
+
+static struct ext42_merkel_disk* readDiskTree(struct inode* inode)
+{
+    //the saved copy is only trusted for the exact size and mtime it was computed for,
+    //and with the hash the filesystem is mounted with
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_merkel_disk* disk;
+    int size;
+    size_t bytes;
+
+    disk = getDiskXattr(inode, &size);
+    if(!disk)
+    {
+        //writes skip the lookup until a tree is saved again
+        if(size == -ENODATA)
+            EXT4_I(inode)->i_merkel_saved = EXT42_MERKEL_SAVED_NONE;
+        return NULL;
+    }
+    bytes = (size_t)le32_to_cpu(disk->md_nr_leaves)*disk->md_hash_size;
+    if(disk->md_hash_alg != sbi->s_merkel_alg ||
+       disk->md_hash_size != hashSize(sbi) ||
+       le32_to_cpu(disk->md_nr_leaves) == 0 ||
+       size != sizeof(*disk) + bytes ||
+       le64_to_cpu(disk->md_size) != i_size_read(inode) ||
+       le64_to_cpu(disk->md_mtime) != inode->i_mtime.tv_sec ||
+       le32_to_cpu(disk->md_mtime_nsec) != inode->i_mtime.tv_nsec)
+    {
+        kfree(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+/*
+ * Fill the leaves of @tree from @disk and recompute the levels above.
+ * Fails if they do not lead back to the saved root.
+ */
+static int loadLeaves(struct inode* inode, struct ext42_merkel_disk* disk,
+              struct ext42_merkel* tree, struct merkelCount* count)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    size_t bytes = (size_t)tree->mt_nr_leaves*tree->mt_hash_size;
+
+    memcpy(getNode(tree, 0, 0), disk->md_hashes, bytes);
+    count->nodes = setNewHasheParents(tree, sbi, 0, tree->mt_nr_leaves-1);
+    if(memcmp(getNode(tree, tree->mt_depth, 0), disk->md_root, tree->mt_hash_size))
+    {
+        ext42_warning_inode(inode, "saved Merkle tree does not match its root");
+        return -EIO;
+    }
+    return 0;
+}
+
+static unsigned int verifyMode(struct inode* inode);
+
+/* A verified file lost its saved tree, reads of it fail until resealed */
+static void verifyRefused(struct inode* inode)
+{
+    atomic64_inc(&EXT4_SB(inode->i_sb)->s_merkel_verify_refused);
+    trace_ext42_merkel_verify_refused(inode);
+    ext42_warning_inode(inode, "verified file has no saved Merkle tree");
+}
+
+/* Error for a NULL ext42_merkel_get(), called under i_merkel_mutex */
+static inline int noTree(struct inode* inode)
+{
+    return EXT4_I(inode)->i_merkel_verify == EXT42_MERKEL_VERIFY_ON ? -EIO : -ENOMEM;
+}
+
+/*
+ * Return the tree of @inode, loading it if needed.  The caller must hold
+ * i_merkel_mutex.  Without @rebuild a tree that is neither in memory nor
+ * persisted is left alone and NULL is returned; writes then skip the
+ * maintenance and the tree is rebuilt in one go when it is next needed.
+ * A verified file is never rebuilt, its tree would only vouch for what is
+ * on disk.  NULL is also returned when memory for the tree cannot be
+ * allocated, noTree() tells the two apart.
+ */
+struct ext42_merkel* ext42_merkel_get(struct inode* inode, int rebuild)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_merkel_disk* disk;
+    struct ext42_merkel* tree;
+    struct merkelCount count = { 0 };
+    loff_t size;
+    unsigned int nbLeaves;
+    u64 start;
+
+    if(ei->i_merkel_tree)
+    {
+        ei->i_merkel_touched = 1;
+        return ei->i_merkel_tree;
+    }
+
+    //saved copy
+    disk = readDiskTree(inode);
+    if(disk)
+    {
+        nbLeaves = le32_to_cpu(disk->md_nr_leaves);
+        start = ktime_get_ns();
+        trace_ext42_merkel_update_enter(inode, EXT42_MERKEL_UPDATE_LOAD, nbLeaves);
+        tree = newTree(sbi, nbLeaves);
+        if(tree && loadLeaves(inode, disk, tree, &count))
+        {
+            //a torn or reclaimed copy is as good as none
+            freeMerkelTree(tree);
+            kfree(disk);
+        }
+        else
+        {
+            if(tree)
+                absorbSpans(ei, tree);
+            kfree(disk);
+            write_seqcount_begin(&ei->i_merkel_seq);
+            setTree(inode, tree);
+            bumpVersion(inode);
+            write_seqcount_end(&ei->i_merkel_seq);
+            if(tree)
+            {
+                ei->i_merkel_saved = EXT42_MERKEL_SAVED_VALID;
+                countUpdate(inode, EXT42_MERKEL_UPDATE_LOAD, &count, start);
+            }
+            return tree;
+        }
+    }
+
+    //nothing to read for an empty file, otherwise rebuild only on demand
+    size = i_size_read(inode);
+    if(size != 0 && !rebuild)
+        return NULL;
+    if(size != 0 && verifyMode(inode) == EXT42_MERKEL_VERIFY_ON)
+    {
+        verifyRefused(inode);
+        return NULL;
+    }
+
+    D(MERKEL, "Building tree of inode %lu", inode->i_ino);
+    nbLeaves = (size/EXT42_MERKEL_BLOCK_SIZE)+1;
+    start = ktime_get_ns();
+    trace_ext42_merkel_update_enter(inode, EXT42_MERKEL_UPDATE_BUILD, nbLeaves);
+    tree = newTree(sbi, nbLeaves);
+    if(!tree)
+        return NULL;
+
+    //faults from now on are recorded again, earlier ones left their page dirty
+    spin_lock(&ei->i_merkel_mmap_lock);
+    ei->i_merkel_mmap_nr = 0;
+    spin_unlock(&ei->i_merkel_mmap_lock);
+    buildTree(tree, inode, size, &count);
+    absorbSpans(ei, tree);
+    tree->mt_stale = !bitmap_empty(tree->mt_pending, nbLeaves);
+    write_seqcount_begin(&ei->i_merkel_seq);
+    setTree(inode, tree);
+    ei->i_merkel_dirty = 1;
+    bumpVersion(inode);
+    write_seqcount_end(&ei->i_merkel_seq);
+    countUpdate(inode, EXT42_MERKEL_UPDATE_BUILD, &count, start);
+    return tree;
+}
+
+/*
+ * Called before a write modifies the file: the saved copy of the tree is
+ * loaded while it still matches, then removed.  Once there is a tree, or
+ * no copy to load, this costs no lock and no xattr lookup.
+ */
+void ext42_merkel_load(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+
+    if(READ_ONCE(ei->i_merkel_tree) ||
+       READ_ONCE(ei->i_merkel_saved) == EXT42_MERKEL_SAVED_NONE)
+    {
+        dropCopy(inode);
+        return;
+    }
+    mutex_lock(&ei->i_merkel_mutex);
+    ext42_merkel_get(inode, 0);
+    mutex_unlock(&ei->i_merkel_mutex);
+    dropCopy(inode);
+}
+
+/*
+ * Called by write faults next to file_update_time(), before the page is
+ * locked or a handle started: stores through the mapping change the file
+ * without a write.
+ */
+void ext42_merkel_fault(struct inode* inode)
+{
+    dropCopy(inode);
+}
+
+/*
+ * Write the leaves of @tree to the hidden xattr.  Leaves that do not fit
+ * in it are not saved: the stale copy is removed and -EFBIG returned, the
+ * tree is rebuilt from the file when next needed.  The caller holds
+ * i_merkel_mutex.
+ */
+static int saveTree(struct inode* inode, struct ext42_merkel* tree)
+{
+    struct ext42_merkel_disk* disk;
+    size_t bytes = (size_t)tree->mt_nr_leaves*tree->mt_hash_size;
+    int err;
+
+    if(bytes > maxDiskLeaves(inode->i_sb))
+    {
+        if(ext42_xattr_get(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME, NULL, 0) <= 0 ||
+           !ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME, NULL, 0, 0))
+            EXT4_I(inode)->i_merkel_saved = EXT42_MERKEL_SAVED_NONE;
+        return -EFBIG;
+    }
+    //a store through a mapping since the flush would already make it stale
+    if(READ_ONCE(EXT4_I(inode)->i_merkel_mmap_nr))
+        return -EBUSY;
+
+    disk = kmalloc(sizeof(*disk) + bytes, GFP_NOFS);
+    if(!disk)
+        return -ENOMEM;
+    disk->md_magic      = cpu_to_le32(EXT42_MERKEL_MAGIC);
+    disk->md_nr_leaves  = cpu_to_le32(tree->mt_nr_leaves);
+    disk->md_size       = cpu_to_le64(i_size_read(inode));
+    disk->md_mtime      = cpu_to_le64(inode->i_mtime.tv_sec);
+    disk->md_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
+    disk->md_hash_alg   = tree->mt_hash_alg;
+    disk->md_hash_size  = tree->mt_hash_size;
+    disk->md_reserved   = 0;
+    memset(disk->md_root, 0, sizeof(disk->md_root));
+    memcpy(disk->md_root, getNode(tree, tree->mt_depth, 0), tree->mt_hash_size);
+    memcpy(disk->md_hashes, getNode(tree, 0, 0), bytes);
+
+    err = ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME,
+                  disk, sizeof(*disk) + bytes, 0);
+    //without room for the new copy the old one goes, it no longer matches
+    if(err == -ENOSPC &&
+       !ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL, EXT42_MERKEL_XATTR_NAME, NULL, 0, 0))
+        EXT4_I(inode)->i_merkel_saved = EXT42_MERKEL_SAVED_NONE;
+    if(!err)
+        EXT4_I(inode)->i_merkel_saved = EXT42_MERKEL_SAVED_VALID;
+    kfree(disk);
+    return err;
+}
+
+/*
+ * Save the tree off the write and fsync paths.  -EBUSY only means leaves
+ * are still mapped writable, the next save gets them.
+ */
+void ext42_merkel_save_work(struct work_struct* work)
+{
+    struct ext42_inode_info* ei = container_of(to_delayed_work(work),
+                           struct ext42_inode_info, i_merkel_save_work);
+    struct inode* inode = &ei->vfs_inode;
+    int err;
+
+    if(inode->i_sb->s_flags & MS_RDONLY)
+        return;
+    sb_start_intwrite(inode->i_sb);
+    err = ext42_merkel_save(inode);
+    sb_end_intwrite(inode->i_sb);
+    if(err && err != -EBUSY)
+        ext42_warning_inode(inode, "couldn't save Merkle tree (err %d)", err);
+}
+
+/*
+ * Save the leaves of a modified tree, see saveTree().  Fails with -EBUSY
+ * while leaves are still writable through a mapping; a tree too big for
+ * the xattr has nothing to save.
+ */
+int ext42_merkel_save(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    int err = 0;
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ei->i_merkel_tree;
+    if(!tree)
+        goto out;
+    flushTree(inode, tree, 1);
+    //leaves still writable through a mapping have no final hash yet
+    if(tree->mt_stale)
+    {
+        err = -EBUSY;
+        goto out;
+    }
+    if(!ei->i_merkel_dirty)
+        goto out;
+
+    err = saveTree(inode, tree);
+    if(err == -EFBIG)
+        err = 0;
+    if(!err)
+        ei->i_merkel_dirty = 0;
+out:
+    mutex_unlock(&ei->i_merkel_mutex);
+    if(err)
+        D(MERKEL, "Saving tree of inode %lu failed %d", inode->i_ino, err);
+    return err;
+}
+
+/*
+ * Save the tree of an inode evicted with its links while its pages can
+ * still be hashed: its save work is cancelled with it.  Reclaim on a
+ * frozen filesystem cannot wait, the saved copy is rebuilt then.
+ */
+void ext42_merkel_evict(struct inode* inode)
+{
+    int err;
+
+    if(!READ_ONCE(EXT4_I(inode)->i_merkel_tree) || (inode->i_sb->s_flags & MS_RDONLY))
+        return;
+    if(!__sb_start_write(inode->i_sb, SB_FREEZE_FS, false))
+        return;
+    err = ext42_merkel_save(inode);
+    sb_end_intwrite(inode->i_sb);
+    if(err)
+        ext42_warning_inode(inode, "couldn't save Merkle tree (err %d)", err);
+}
+
+/*
+ * Run the saves still waiting for writes to settle, and with @wait for
+ * them to be done.  The inodes stay around while on s_merkel_list, as
+ * eviction leaves it before cancelling the save work.  A frozen filesystem
+ * has nothing left to save and its saves would wait for the thaw.
+ */
+void ext42_merkel_sync_fs(struct super_block* sb, int wait)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(sb);
+    struct ext42_inode_info* ei;
+
+    if(sb->s_writers.frozen >= SB_FREEZE_FS)
+        return;
+    spin_lock(&sbi->s_merkel_lock);
+    list_for_each_entry(ei, &sbi->s_merkel_list, i_merkel_list)
+        if(READ_ONCE(ei->i_merkel_dirty) || delayed_work_pending(&ei->i_merkel_work))
+            mod_delayed_work(sbi->s_merkel_wq, &ei->i_merkel_save_work, 0);
+    spin_unlock(&sbi->s_merkel_lock);
+    if(wait)
+        flush_workqueue(sbi->s_merkel_wq);
+}
+
+/* The inode is being deleted, its leaves leave the duplicate index */
+void ext42_merkel_delete_inode(struct inode* inode)
+{
+    queueDups(inode);
+}
+
+void ext42_merkel_drop(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+
+    setTree(inode, NULL);
+    ei->i_merkel_dirty = 0;
+
+    //an evicted directory comes back unknown, a file whose new root was
+    //never carried up forgets every directory as in rootChanged()
+    if(!(inode->i_state & I_FREEING))
+        return;
+    spin_lock(dirLock(inode));
+    if(S_ISDIR(inode->i_mode) && ei->i_merkel_root_valid)
+    {
+        ei->i_merkel_root_valid = 0;
+        atomic_dec(&sbi->s_merkel_dirs);
+    }
+    else if(ei->i_merkel_root_dirty && ei->i_merkel_root_folded)
+        atomic_inc(&sbi->s_merkel_dir_epoch);
+    spin_unlock(dirLock(inode));
+}
+
+/*
+ * Lockless readers.  Every change to a tree is made under i_merkel_mutex
+ * inside an i_merkel_seq write section, and trees are freed after an RCU
+ * grace period, so a reader may copy what it needs out of a tree under
+ * rcu_read_lock() and keep the copy if the count did not move meanwhile.
+ * Nothing is read that way while leaves are pending or a writer is at
+ * work: after MERKEL_READ_RETRIES attempts, or straight away then, readers
+ * take the mutex and flush like before.  Writers never wait for readers.
+ */
+#define MERKEL_READ_RETRIES 3
+
+static struct ext42_merkel* beginRead(struct ext42_inode_info* ei, unsigned int* seq)
+{
+    //NULL when the tree cannot be read without the mutex
+    struct ext42_merkel* tree;
+
+    *seq = raw_read_seqcount(&ei->i_merkel_seq);
+    if(*seq & 1)
+        return NULL;
+    tree = rcu_dereference(ei->i_merkel_tree);
+    if(!tree || READ_ONCE(tree->mt_stale) || READ_ONCE(ei->i_merkel_mmap_nr))
+        return NULL;
+    return tree;
+}
+
+static inline int endRead(struct ext42_inode_info* ei, unsigned int seq)
+{
+    if(read_seqcount_retry(&ei->i_merkel_seq, seq))
+        return 0;
+    WRITE_ONCE(ei->i_merkel_touched, 1);
+    return 1;
+}
+
+static int findNode(struct ext42_merkel* tree, merkel_tree* path)
+{
+    unsigned int level, pos = 0;
+
+    //walk down from the root
+    level = tree->mt_depth;
+    while(level != path->depth && path->depth != -1 && level > 0)
+    {
+        int dir = path->block & ((1 << tree->mt_fanout_bits) - 1);
+        if(path->block < 0)
+            break;
+        path->block >>= tree->mt_fanout_bits;
+        pos = (pos << tree->mt_fanout_bits) + dir;
+        level--;
+        if(pos >= levelCount(tree, tree->mt_nr_leaves, level))
+        {
+            D(MERKEL, "Error : trying to retrieve NULL node");
+            return -EINVAL;
+        }
+    }
+
+    path->l     = NULL;
+    path->r     = NULL;
+    memcpy(&path->hash, getNode(tree, level, pos), sizeof(path->hash));
+    path->depth = level;
+    if(level == 0)
+        path->block = pos;
+    else
+        path->block = -(int)min(levelCount(tree, tree->mt_nr_leaves, level-1) -
+                    (pos << tree->mt_fanout_bits), 1U << tree->mt_fanout_bits);
+    return 0;
+}
+
+/*
+ * Look up the node designated by @path->block (log2(fanout) bits per level
+ * from the root, LSB first) at depth @path->depth, -1 meaning the root, and
+ * copy it back into @path.  Interior nodes report minus their number of
+ * children in block, leaves report their index.
+ */
+int ext42_merkel_get_node(struct inode* inode, merkel_tree* path)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    merkel_tree node;
+    unsigned int seq, tries;
+    int err = 0, done = 0;
+
+    if(!S_ISREG(inode->i_mode))
+        return -EINVAL;
+
+    rcu_read_lock();
+    for(tries = 0;!done && tries < MERKEL_READ_RETRIES;tries++)
+    {
+        tree = beginRead(ei, &seq);
+        if(!tree)
+            break;
+        node = *path;
+        err  = findNode(tree, &node);
+        done = endRead(ei, seq);
+    }
+    rcu_read_unlock();
+    if(done)
+    {
+        if(!err)
+            *path = node;
+        return err;
+    }
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ext42_merkel_get(inode, 1);
+    if(!tree)
+        err = noTree(inode);
+    else
+    {
+        flushTree(inode, tree, 1);
+        err = findNode(tree, path);
+    }
+    mutex_unlock(&ei->i_merkel_mutex);
+    return err;
+}
+
+static int exportNodes(struct ext42_inode_info* ei, struct ext42_merkel* tree,
+               struct ext42_merkel_export* exp, u8* buf, unsigned int room)
+{
+    unsigned int mode = exp->me_mode & EXT42_MERKEL_EXPORT_MODE;
+    unsigned int count = 0, total = 0, l, hs = tree->mt_hash_size;
+
+    if(exp->me_level > tree->mt_depth)
+        return -EINVAL;
+
+    if(mode == EXT42_MERKEL_EXPORT_LEVEL)
+    {
+        //nodes [me_index, end of level[, nothing left once past the end
+        unsigned int nb = levelCount(tree, tree->mt_nr_leaves, exp->me_level);
+        if(exp->me_index < nb)
+            total = nb - exp->me_index;
+        count = min(total, room);
+        if(count)
+            memcpy(buf, getNode(tree, exp->me_level, exp->me_index), (size_t)hs*count);
+    }
+    else
+    {
+        //every level of the subtree, from its leaves up to its root
+        if(exp->me_index >= levelCount(tree, tree->mt_nr_leaves, exp->me_level))
+            return -EINVAL;
+        for(l = 0;l <= exp->me_level;l++)
+        {
+            unsigned int shift = (exp->me_level - l)*tree->mt_fanout_bits;
+            u64 lo = (u64)exp->me_index << shift;
+            u64 hi = min_t(u64, (u64)(exp->me_index+1) << shift,
+                       levelCount(tree, tree->mt_nr_leaves, l));
+            unsigned int nb = min_t(u64, hi-lo, room-count);
+            memcpy(buf + (size_t)hs*count, getNode(tree, l, lo), (size_t)hs*nb);
+            count += nb;
+            total += hi-lo;
+        }
+    }
+
+    exp->me_count     = count;
+    exp->me_total     = total;
+    exp->me_nr_leaves = tree->mt_nr_leaves;
+    exp->me_depth     = tree->mt_depth;
+    exp->me_hash_alg  = tree->mt_hash_alg;
+    exp->me_hash_size = tree->mt_hash_size;
+    exp->me_fanout    = 1U << tree->mt_fanout_bits;
+    exp->me_reserved  = 0;
+    exp->me_version   = ei->i_merkel_version;
+    return 0;
+}
+
+/*
+ * Copy a whole level or subtree of hashes to userspace in one go, see
+ * struct ext42_merkel_export.  Hashes are gathered into a kernel buffer,
+ * locklessly or under the mutex, so that faulting in the user buffer never
+ * happens with the tree locked.
+ */
+int ext42_merkel_export(struct inode* inode, struct ext42_merkel_export* exp)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel_export res;
+    struct ext42_merkel* tree;
+    unsigned int mode = exp->me_mode & EXT42_MERKEL_EXPORT_MODE;
+    unsigned int room, hs, seq, tries;
+    u8* buf = NULL;
+    int err = 0, done = 0;
+
+    if(!S_ISREG(inode->i_mode) || mode > EXT42_MERKEL_EXPORT_SUBTREE ||
+       (exp->me_mode & ~(EXT42_MERKEL_EXPORT_MODE | EXT42_MERKEL_EXPORT_NOFLUSH)))
+        return -EINVAL;
+
+    //every tree of the filesystem uses the width it is mounted with
+    hs   = hashSize(EXT4_SB(inode->i_sb));
+    room = min_t(unsigned int, exp->me_count, EXT42_MERKEL_EXPORT_MAX);
+    if(room)
+    {
+        buf = allocNodes((size_t)hs*room);
+        if(!buf)
+            return -ENOMEM;
+    }
+
+    rcu_read_lock();
+    for(tries = 0;!done && tries < MERKEL_READ_RETRIES;tries++)
+    {
+        tree = beginRead(ei, &seq);
+        if(!tree)
+            break;
+        res  = *exp;
+        err  = exportNodes(ei, tree, &res, buf, room);
+        done = endRead(ei, seq);
+    }
+    rcu_read_unlock();
+    if(done)
+    {
+        if(!err)
+            *exp = res;
+        goto copy;
+    }
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ext42_merkel_get(inode, 1);
+    if(!tree)
+        err = noTree(inode);
+    else
+    {
+        if(!(exp->me_mode & EXT42_MERKEL_EXPORT_NOFLUSH))
+            flushTree(inode, tree, 1);
+        else if(tree->mt_stale)
+            exp->me_mode |= EXT42_MERKEL_EXPORT_STALE;
+        err = exportNodes(ei, tree, exp, buf, room);
+    }
+    mutex_unlock(&ei->i_merkel_mutex);
+copy:
+    if(!err && exp->me_count &&
+       copy_to_user((u8 __user *)(unsigned long)exp->me_buf, buf, (size_t)hs*exp->me_count))
+        err = -EFAULT;
+    kvfree(buf);
+    return err;
+}
+
+static void copyRoot(struct inode* inode, struct ext42_merkel* tree, struct ext42_merkel_root* mr)
+{
+    memset(mr, 0, sizeof(*mr));
+    memcpy(mr->mr_root, getNode(tree, tree->mt_depth, 0), tree->mt_hash_size);
+    mr->mr_generation = EXT4_I(inode)->i_merkel_version;
+    mr->mr_i_version  = inode->i_version;
+    mr->mr_size       = i_size_read(inode);
+    mr->mr_nr_leaves  = tree->mt_nr_leaves;
+    mr->mr_hash_alg   = tree->mt_hash_alg;
+    mr->mr_hash_size  = tree->mt_hash_size;
+    mr->mr_fanout     = 1U << tree->mt_fanout_bits;
+}
+
+/*
+ * Root of @inode with what identifies it, see struct ext42_merkel_root.
+ * The tree is only loaded, built or flushed when the lockless read fails.
+ */
+int ext42_merkel_file_root(struct inode* inode, struct ext42_merkel_root* mr)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    unsigned int seq, tries;
+    int done = 0, err = 0;
+
+    if(!S_ISREG(inode->i_mode))
+        return -EINVAL;
+
+    rcu_read_lock();
+    for(tries = 0;!done && tries < MERKEL_READ_RETRIES;tries++)
+    {
+        tree = beginRead(ei, &seq);
+        if(!tree)
+            break;
+        copyRoot(inode, tree, mr);
+        done = endRead(ei, seq);
+    }
+    rcu_read_unlock();
+    if(done)
+        return 0;
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ext42_merkel_get(inode, 1);
+    if(tree)
+    {
+        flushTree(inode, tree, 1);
+        copyRoot(inode, tree, mr);
+    }
+    else
+        err = noTree(inode);
+    mutex_unlock(&ei->i_merkel_mutex);
+    return err;
+}
+
+static inline int sameNode(struct ext42_merkel* a, struct ext42_merkel* b,
+               unsigned int level, unsigned int pos)
+{
+    return !memcmp(getNode(a, level, pos), getNode(b, level, pos), a->mt_hash_size);
+}
+
+/*
+ * Walk both trees from leaf @start, skipping every subtree whose root is
+ * the same in both, and gather the differing leaves as ranges.  A node
+ * only depends on the leaves below it, so node j of level l covers the
+ * same blocks in both trees for every level they have in common.
+ * Returns the leaf to resume from.
+ */
+static unsigned int diffTrees(struct ext42_merkel* a, struct ext42_merkel* b, unsigned int start,
+                  struct ext42_merkel_range* ranges, unsigned int room, unsigned int* count)
+{
+    unsigned int common = min(a->mt_nr_leaves, b->mt_nr_leaves);
+    unsigned int total  = max(a->mt_nr_leaves, b->mt_nr_leaves);
+    unsigned int top    = min(a->mt_depth, b->mt_depth);
+    unsigned int pos = start, l, end;
+
+    *count = 0;
+    while(pos < total)
+    {
+        //the tail only one of the files has is one last range
+        if(pos >= common)
+            end = total;
+        else
+        {
+            //largest aligned node starting at pos, then down while it differs
+            l = pos ? min_t(unsigned int, __ffs(pos)/a->mt_fanout_bits, top) : top;
+            while(l > 0 && !sameNode(a, b, l, ancestor(a, pos, l)))
+                l--;
+            if(sameNode(a, b, l, ancestor(a, pos, l)))
+            {
+                pos = min_t(u64, pos + (1ULL << (l*a->mt_fanout_bits)), common);
+                continue;
+            }
+            end = pos+1;
+        }
+
+        if(*count && ranges[*count-1].mr_start + ranges[*count-1].mr_len == pos)
+            ranges[*count-1].mr_len += end-pos;
+        else if(*count == room)
+            return pos;
+        else
+        {
+            ranges[*count].mr_start = pos;
+            ranges[*count].mr_len   = end-pos;
+            (*count)++;
+        }
+        pos = end;
+    }
+    return total;
+}
+
+static int compareTrees(struct ext42_inode_info* ei, struct ext42_inode_info* eo,
+            struct ext42_merkel* a, struct ext42_merkel* b, struct ext42_merkel_diff* diff,
+            struct ext42_merkel_range* ranges, unsigned int room)
+{
+    unsigned int count;
+
+    if(a->mt_hash_alg != b->mt_hash_alg || a->mt_hash_size != b->mt_hash_size ||
+       a->mt_fanout_bits != b->mt_fanout_bits)
+        return -EINVAL;
+
+    diff->mdf_next          = diffTrees(a, b, diff->mdf_start, ranges, room, &count);
+    diff->mdf_count         = count;
+    diff->mdf_version       = ei->i_merkel_version;
+    diff->mdf_other_version = eo->i_merkel_version;
+    return 0;
+}
+
+/*
+ * Compare the trees of two files of the same filesystem, see struct
+ * ext42_merkel_diff.  Clean trees are compared locklessly, otherwise both
+ * mutexes are taken in address order.  The ranges are gathered into a
+ * kernel buffer copied once nothing is held.
+ */
+int ext42_merkel_diff(struct inode* inode, struct inode* other, struct ext42_merkel_diff* diff)
+{
+    struct ext42_inode_info *ei = EXT4_I(inode), *eo = EXT4_I(other);
+    struct ext42_inode_info *first = ei < eo ? ei : eo, *second = ei < eo ? eo : ei;
+    struct ext42_merkel *a, *b;
+    struct ext42_merkel_range* ranges = NULL;
+    struct ext42_merkel_diff res;
+    unsigned int room, seq, seqOther, tries;
+    int err = 0, done = 0;
+
+    if(!S_ISREG(inode->i_mode) || !S_ISREG(other->i_mode))
+        return -EINVAL;
+    if(inode->i_sb != other->i_sb)
+        return -EXDEV;
+
+    room = min_t(unsigned int, diff->mdf_count, EXT42_MERKEL_DIFF_MAX);
+    if(room)
+    {
+        ranges = allocNodes(sizeof(*ranges)*room);
+        if(!ranges)
+            return -ENOMEM;
+    }
+
+    rcu_read_lock();
+    for(tries = 0;!done && tries < MERKEL_READ_RETRIES;tries++)
+    {
+        a = beginRead(ei, &seq);
+        b = beginRead(eo, &seqOther);
+        if(!a || !b)
+            break;
+        res  = *diff;
+        err  = compareTrees(ei, eo, a, b, &res, ranges, room);
+        done = endRead(ei, seq) && endRead(eo, seqOther);
+    }
+    rcu_read_unlock();
+    if(done)
+    {
+        if(!err)
+            *diff = res;
+        goto copy;
+    }
+
+    mutex_lock(&first->i_merkel_mutex);
+    if(second != first)
+        mutex_lock_nested(&second->i_merkel_mutex, SINGLE_DEPTH_NESTING);
+    a = ext42_merkel_get(inode, 1);
+    b = ext42_merkel_get(other, 1);
+    if(!a || !b)
+        err = noTree(a ? other : inode);
+    else
+    {
+        flushTree(inode, a, 1);
+        if(b != a)
+            flushTree(other, b, 1);
+        err = compareTrees(ei, eo, a, b, diff, ranges, room);
+    }
+    if(second != first)
+        mutex_unlock(&second->i_merkel_mutex);
+    mutex_unlock(&first->i_merkel_mutex);
+copy:
+    if(!err && diff->mdf_count &&
+       copy_to_user((struct ext42_merkel_range __user *)(unsigned long)diff->mdf_ranges,
+            ranges, sizeof(*ranges)*diff->mdf_count))
+        err = -EFAULT;
+    kvfree(ranges);
+    return err;
+}
+
+/*
+ * Give the tree of @inode @nbLeaves leaves, dropping it if memory runs out.
+ * The caller holds i_merkel_mutex and is inside i_merkel_seq.
+ */
+static struct ext42_merkel* sizeTree(struct inode* inode, struct ext42_merkel* tree,
+                     unsigned int nbLeaves)
+{
+    struct ext42_merkel* grown = resizeTree(tree, nbLeaves);
+
+    if(!grown)
+    {
+        ext42_merkel_drop(inode);
+        markRoot(inode);
+        return NULL;
+    }
+    setTree(inode, grown);
+    return grown;
+}
+
+void updateTree(struct inode* inode, loff_t pos, size_t count)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    loff_t size;
+    unsigned int oldNbLeaves, newNbLeaves, first, last;
+
+    D(MERKEL, "Updating tree of inode %lu", inode->i_ino);
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ei->i_merkel_tree;
+    if(!tree)
+    {
+        markRoot(inode);
+        goto out;
+    }
+
+    //get old/new tree info
+    size        = i_size_read(inode);
+    oldNbLeaves = tree->mt_nr_leaves;
+    newNbLeaves = (size/EXT42_MERKEL_BLOCK_SIZE)+1;
+
+    //leaves touched by the write, plus the old and new tail when the file size changed
+    first = pos/EXT42_MERKEL_BLOCK_SIZE;
+    last  = (pos+count-1)/EXT42_MERKEL_BLOCK_SIZE;
+    if(oldNbLeaves != newNbLeaves)
+    {
+        first = min(first, min(oldNbLeaves, newNbLeaves)-1);
+        last  = newNbLeaves-1;
+    }
+    if(last > newNbLeaves-1)
+        last = newNbLeaves-1;
+    if(first > last)
+        goto out;
+
+    //grow or shrink the node array, dropping the tree if that fails
+    write_seqcount_begin(&ei->i_merkel_seq);
+    tree = sizeTree(inode, tree, newNbLeaves);
+    if(tree)
+    {
+        //only remember the affected blocks, the work rehashes them with their ancestors
+        bitmap_set(tree->mt_pending, first, last-first+1);
+        tree->mt_stale = 1;
+        bumpVersion(inode);
+    }
+    write_seqcount_end(&ei->i_merkel_seq);
+
+    //journalled data never goes through ext42_bio_write_page()
+    if(tree && (!test_opt(inode->i_sb, MERKEL_WRITEBACK) || ext42_should_journal_data(inode)))
+        queue_delayed_work(EXT4_SB(inode->i_sb)->s_merkel_wq, &ei->i_merkel_work,
+                   MERKEL_FLUSH_DELAY);
+out:
+    atomic_inc(&ei->i_merkel_marks);
+    mutex_unlock(&ei->i_merkel_mutex);
+    dropCopy(inode);
+    queueDups(inode);
+}
+
+/*
+ * Leaves wholly inside [@start, @end[ and below @size read as zeroes: they
+ * get the hash of a zero block and only their ancestors are recomputed.
+ * The blocks cut by either edge are rehashed.
+ */
+static void zeroLeaves(struct ext42_merkel* tree, struct ext42_sb_info* sbi,
+               loff_t start, loff_t end, loff_t size)
+{
+    unsigned int first, last, i;
+
+    end = min(end, size);
+    if(start >= end)
+        return;
+
+    first = DIV_ROUND_UP(start, EXT42_MERKEL_BLOCK_SIZE);
+    last  = end/EXT42_MERKEL_BLOCK_SIZE;
+    if(first < last)
+    {
+        for(i = first;i < last;i++)
+            memcpy(getNode(tree, 0, i), sbi->s_merkel_zero[0], tree->mt_hash_size);
+        bitmap_clear(tree->mt_pending, first, last-first);
+        bitmap_set(tree->mt_parents, first, last-first);
+    }
+    if(start % EXT42_MERKEL_BLOCK_SIZE)
+        set_bit(start/EXT42_MERKEL_BLOCK_SIZE, tree->mt_pending);
+    if(end % EXT42_MERKEL_BLOCK_SIZE)
+        set_bit(end/EXT42_MERKEL_BLOCK_SIZE, tree->mt_pending);
+}
+
+/*
+ * Move @nb leaves from @from to @to, pending marks included.  Leaves are
+ * moved from the end nearest to @to so that the source is never
+ * overwritten before it is read; the caller marks the parents.
+ */
+static void moveLeaves(struct ext42_merkel* tree, unsigned int from, unsigned int to, unsigned int nb)
+{
+    unsigned int i, end;
+
+    memmove(getNode(tree, 0, to), getNode(tree, 0, from), (size_t)nb*tree->mt_hash_size);
+    if(to < from)
+    {
+        bitmap_clear(tree->mt_pending, to, from-to);
+        i = from;
+        for_each_set_bit_from(i, tree->mt_pending, from+nb)
+        {
+            clear_bit(i, tree->mt_pending);
+            set_bit(i-(from-to), tree->mt_pending);
+        }
+    }
+    else
+    {
+        for(end = from+nb;(i = find_last_bit(tree->mt_pending, end)) < end && i >= from;end = i)
+        {
+            clear_bit(i, tree->mt_pending);
+            set_bit(i+(to-from), tree->mt_pending);
+        }
+    }
+}
+
+static void queueFlush(struct inode* inode)
+{
+    //zeroed and moved leaves leave ancestors to the work even with merkel_writeback
+    queue_delayed_work(EXT4_SB(inode->i_sb)->s_merkel_wq, &EXT4_I(inode)->i_merkel_work,
+               MERKEL_FLUSH_DELAY);
+}
+
+/*
+ * [@offset, @offset+@len[ now reads as zeroes (hole punched or range
+ * zeroed) and the file size went from @oldSize to i_size, any bytes past
+ * @oldSize reading as zeroes too.  Only the blocks at the edges are read
+ * again, the cost is otherwise that of the leaves covered plus their
+ * ancestors.  Called with i_mutex held.
+ */
+void ext42_merkel_zero(struct inode* inode, loff_t oldSize, loff_t offset, loff_t len)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_merkel* tree;
+    loff_t size = i_size_read(inode);
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ei->i_merkel_tree;
+    if(!tree)
+    {
+        markRoot(inode);
+        goto out;
+    }
+
+    write_seqcount_begin(&ei->i_merkel_seq);
+    if(tree->mt_nr_leaves != size/EXT42_MERKEL_BLOCK_SIZE+1)
+    {
+        tree = sizeTree(inode, tree, size/EXT42_MERKEL_BLOCK_SIZE+1);
+        if(!tree)
+            goto end;
+    }
+    if(size != oldSize)
+    {
+        //the block holding the old or the new end changed, whole blocks past the old end are zeroes
+        set_bit(min(oldSize, size)/EXT42_MERKEL_BLOCK_SIZE, tree->mt_pending);
+        zeroLeaves(tree, sbi, oldSize, size, size);
+    }
+    zeroLeaves(tree, sbi, offset, offset+len, size);
+    tree->mt_stale = 1;
+    bumpVersion(inode);
+end:
+    write_seqcount_end(&ei->i_merkel_seq);
+    if(tree)
+        queueFlush(inode);
+out:
+    atomic_inc(&ei->i_merkel_marks);
+    mutex_unlock(&ei->i_merkel_mutex);
+    dropCopy(inode);
+    queueDups(inode);
+}
+
+/*
+ * The size was changed from @oldSize by truncate or by fallocate without a
+ * write: the tail is cut off, or what was added reads as zeroes.
+ */
+void ext42_merkel_truncate(struct inode* inode, loff_t oldSize)
+{
+    if(i_size_read(inode) != oldSize)
+        ext42_merkel_zero(inode, oldSize, 0, 0);
+}
+
+/*
+ * [@offset, @offset+@len[ was removed by a collapse, or inserted as a hole
+ * when @insert is set, moving every later block.  When @offset and @len
+ * are multiples of EXT42_MERKEL_BLOCK_SIZE the leaves move as they are, inserted ones get
+ * the hash of a zero block and only the ancestors from @offset on are
+ * recomputed.  Otherwise every block from @offset on is rehashed.  Called
+ * with i_mutex held, once i_size is final.
+ */
+void ext42_merkel_shift(struct inode* inode, loff_t offset, loff_t len, int insert)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_merkel* tree;
+    unsigned int oldNbLeaves, newNbLeaves, first, nb, i;
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ei->i_merkel_tree;
+    if(!tree)
+    {
+        markRoot(inode);
+        goto out;
+    }
+
+    oldNbLeaves = tree->mt_nr_leaves;
+    newNbLeaves = i_size_read(inode)/EXT42_MERKEL_BLOCK_SIZE+1;
+    first = offset/EXT42_MERKEL_BLOCK_SIZE;
+    nb    = len/EXT42_MERKEL_BLOCK_SIZE;
+
+    write_seqcount_begin(&ei->i_merkel_seq);
+    if(offset % EXT42_MERKEL_BLOCK_SIZE || len % EXT42_MERKEL_BLOCK_SIZE ||
+       (u64)newNbLeaves != (insert ? (u64)oldNbLeaves + nb : (u64)oldNbLeaves - nb))
+    {
+        //blocks do not move as a whole
+        tree = sizeTree(inode, tree, newNbLeaves);
+        if(!tree)
+            goto end;
+        if(first < newNbLeaves)
+            bitmap_set(tree->mt_pending, first, newNbLeaves-first);
+    }
+    else
+    {
+        if(insert)
+        {
+            tree = sizeTree(inode, tree, newNbLeaves);
+            if(!tree)
+                goto end;
+            moveLeaves(tree, first, first+nb, oldNbLeaves-first);
+            for(i = first;i < first+nb;i++)
+                memcpy(getNode(tree, 0, i), sbi->s_merkel_zero[0], tree->mt_hash_size);
+        }
+        else
+        {
+            moveLeaves(tree, first+nb, first, newNbLeaves-first);
+            tree = sizeTree(inode, tree, newNbLeaves);
+            if(!tree)
+                goto end;
+        }
+        bitmap_set(tree->mt_parents, first, newNbLeaves-first);
+    }
+    tree->mt_stale = 1;
+    bumpVersion(inode);
+end:
+    write_seqcount_end(&ei->i_merkel_seq);
+    if(tree)
+        queueFlush(inode);
+out:
+    atomic_inc(&ei->i_merkel_marks);
+    mutex_unlock(&ei->i_merkel_mutex);
+    dropCopy(inode);
+    queueDups(inode);
+}
+
+int ext42_merkel_parse_hash(const char* name)
+{
+    int alg;
+    for(alg = 0;alg < ARRAY_SIZE(merkelHashes);alg++)
+        if(!strcmp(name, merkelHashes[alg].name))
+            return alg;
+    return -1;
+}
+
+const char* ext42_merkel_hash_name(unsigned int alg)
+{
+    return merkelHashes[alg].name;
+}
+
+/*
+ * Set up the block hash once the mount options are known.  crc32c shares
+ * the metadata checksum driver when the filesystem has one; it must not be
+ * allocated into s_chksum_driver otherwise, as that turns metadata_csum on.
+ */
+int ext42_merkel_init_sb(struct super_block* sb)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(sb);
+    const char* driver = merkelHashes[sbi->s_merkel_alg].driver;
+    unsigned int fanout = sbi->s_merkel_fanout ? sbi->s_merkel_fanout : 2, l, i;
+    struct crypto_shash* tfm;
+    u8* zeroes;
+
+    if(sbi->s_merkel_hash_size &&
+       (sbi->s_merkel_hash_size < sizeof(int) ||
+        sbi->s_merkel_hash_size > merkelHashes[sbi->s_merkel_alg].size))
+    {
+        ext42_msg(sb, KERN_ERR, "merkel_hash_size must be between %zu and %u for %s",
+             sizeof(int), merkelHashes[sbi->s_merkel_alg].size,
+             merkelHashes[sbi->s_merkel_alg].name);
+        return -EINVAL;
+    }
+
+    if(sbi->s_merkel_fanout &&
+       (!is_power_of_2(sbi->s_merkel_fanout) || sbi->s_merkel_fanout < 2 ||
+        sbi->s_merkel_fanout > EXT42_MERKEL_MAX_FANOUT))
+    {
+        ext42_msg(sb, KERN_ERR, "merkel_fanout must be a power of 2 between 2 and %u",
+             EXT42_MERKEL_MAX_FANOUT);
+        return -EINVAL;
+    }
+
+    if(driver && !(sbi->s_merkel_alg == EXT42_MERKEL_HASH_CRC32C && sbi->s_chksum_driver))
+    {
+        tfm = crypto_alloc_shash(driver, 0, 0);
+        if(IS_ERR(tfm))
+        {
+            ext42_msg(sb, KERN_ERR, "Cannot load %s driver for merkel_hash", driver);
+            return PTR_ERR(tfm);
+        }
+        sbi->s_merkel_tfm = tfm;
+    }
+
+    //hash of an all zero block, then of full nodes of those, level by level
+    zeroes = kzalloc(max_t(size_t, EXT42_MERKEL_BLOCK_SIZE, (size_t)fanout*EXT42_MERKEL_HASH_MAX_SIZE),
+             GFP_KERNEL);
+    if(!zeroes)
+    {
+        ext42_merkel_release_sb(sb);
+        return -ENOMEM;
+    }
+    hashData(sbi, zeroes, EXT42_MERKEL_BLOCK_SIZE, sbi->s_merkel_zero[0]);
+    for(l = 1;l < EXT42_MERKEL_MAX_LEVELS;l++)
+    {
+        for(i = 0;i < fanout;i++)
+            memcpy(zeroes + i*hashSize(sbi), sbi->s_merkel_zero[l-1], hashSize(sbi));
+        hashData(sbi, zeroes, fanout*hashSize(sbi), sbi->s_merkel_zero[l]);
+    }
+    kfree(zeroes);
+    return 0;
+}
+
+void ext42_merkel_release_sb(struct super_block* sb)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(sb);
+
+    if(sbi->s_merkel_tfm)
+        crypto_free_shash(sbi->s_merkel_tfm);
+    sbi->s_merkel_tfm = NULL;
+
+    //nothing queues changes any more
+    freeDupIndex(rcu_dereference_protected(sbi->s_merkel_dups, 1));
+    RCU_INIT_POINTER(sbi->s_merkel_dups, NULL);
+}
+
+/*
+ * Writeback found i_merkel_mutex busy: hash the blocks of @page onto
+ * i_merkel_wb for foldWriteback().  Which leaves are pending cannot be
+ * known without the mutex, so every block is hashed.  Blocks that cannot
+ * be queued stay pending and are read back when the tree is flushed.
+ */
+static void deferWriteback(struct inode* inode, struct page* page, unsigned int len)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    unsigned int first = page_offset(page)/EXT42_MERKEL_BLOCK_SIZE, off, marks, hashed = 0;
+    struct merkelWbLeaf* wb;
+    unsigned char* kaddr;
+    LIST_HEAD(leaves);
+    u64 bytes = 0;
+
+    if(!READ_ONCE(ei->i_merkel_tree))
+        return;
+
+    //a leaf marked after this read is not taken from these hashes
+    marks = atomic_read(&ei->i_merkel_marks);
+    smp_rmb();
+    kaddr = kmap(page);
+    for(off = 0;off < len;off += EXT42_MERKEL_BLOCK_SIZE)
+    {
+        wb = kmalloc(sizeof(*wb), GFP_NOFS);
+        if(!wb)
+            break;
+        wb->leaf  = first + off/EXT42_MERKEL_BLOCK_SIZE;
+        wb->marks = marks;
+        hashData(sbi, kaddr + off, min_t(unsigned int, EXT42_MERKEL_BLOCK_SIZE, len-off), wb->hash);
+        list_add_tail(&wb->list, &leaves);
+        bytes += min_t(unsigned int, EXT42_MERKEL_BLOCK_SIZE, len-off);
+        hashed++;
+    }
+    kunmap(page);
+    if(!hashed)
+        return;
+    atomic64_add(hashed, &sbi->s_merkel_hashed_blocks);
+    atomic64_add(bytes, &sbi->s_merkel_hashed_bytes);
+
+    spin_lock(&ei->i_merkel_mmap_lock);
+    list_splice_tail(&leaves, &ei->i_merkel_wb);
+    spin_unlock(&ei->i_merkel_mmap_lock);
+    queue_delayed_work(sbi->s_merkel_wq, &ei->i_merkel_work, MERKEL_FLUSH_DELAY);
+}
+
+/*
+ * Hash the pending leaves of @page as it is written back, @len bytes of it
+ * being inside i_size.  Writeback must not wait for a reader flushing the
+ * tree, so when the mutex is busy the page is hashed aside and folded in
+ * by whoever holds the mutex next.
+ */
+void ext42_merkel_writeback(struct page* page, unsigned int len)
+{
+    struct inode* inode = page->mapping->host;
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_merkel* tree;
+    unsigned int first = page_offset(page)/EXT42_MERKEL_BLOCK_SIZE, off, i, hashed = 0;
+    unsigned char* kaddr;
+    u64 bytes = 0;
+
+    if(!mutex_trylock(&ei->i_merkel_mutex))
+    {
+        deferWriteback(inode, page, len);
+        return;
+    }
+    tree = ei->i_merkel_tree;
+    if(!tree || (!tree->mt_stale && !READ_ONCE(ei->i_merkel_mmap_nr)))
+        goto out;
+
+    write_seqcount_begin(&ei->i_merkel_seq);
+    absorbSpans(ei, tree);
+    kaddr = kmap(page);
+    for(off = 0;off < len;off += EXT42_MERKEL_BLOCK_SIZE)
+    {
+        i = first + off/EXT42_MERKEL_BLOCK_SIZE;
+        if(i >= tree->mt_nr_leaves || !test_bit(i, tree->mt_pending))
+            continue;
+        hashData(sbi, kaddr + off, min_t(unsigned int, EXT42_MERKEL_BLOCK_SIZE, len-off),
+             getNode(tree, 0, i));
+        clear_bit(i, tree->mt_pending);
+        set_bit(i, tree->mt_parents);
+        bytes += min_t(unsigned int, EXT42_MERKEL_BLOCK_SIZE, len-off);
+        hashed++;
+    }
+    kunmap(page);
+    write_seqcount_end(&ei->i_merkel_seq);
+    atomic64_add(hashed, &sbi->s_merkel_hashed_blocks);
+    atomic64_add(bytes, &sbi->s_merkel_hashed_bytes);
+
+    //ancestors are done in one batch for the whole writeback
+    if(hashed)
+        queue_delayed_work(sbi->s_merkel_wq, &ei->i_merkel_work, MERKEL_FLUSH_DELAY);
+out:
+    mutex_unlock(&ei->i_merkel_mutex);
+}
+
+/*
+ * A write fault is about to let [@pos, @pos+@len[ be written through a
+ * mapping (page_mkwrite, or DAX).  Only the leaves are recorded, in at
+ * most EXT42_MERKEL_MMAP_SPANS spans under a spinlock so that faults stay
+ * cheap: the nearest span grows once they are all used.  The next flush
+ * or writeback moves them into mt_pending, and leaves whose page is still
+ * writable then stay pending until it is written back.
+ */
+void ext42_merkel_mkwrite(struct inode* inode, loff_t pos, loff_t len)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel_span* span;
+    unsigned int first = pos/EXT42_MERKEL_BLOCK_SIZE, last = (pos+len-1)/EXT42_MERKEL_BLOCK_SIZE;
+    unsigned int i, best = 0;
+    u64 gap, bestGap = U64_MAX;
+
+    spin_lock(&ei->i_merkel_mmap_lock);
+    for(i = 0;i < ei->i_merkel_mmap_nr;i++)
+    {
+        span = &ei->i_merkel_mmap[i];
+        if(first > span->ms_last)
+            gap = first - span->ms_last;
+        else if(last < span->ms_first)
+            gap = span->ms_first - last;
+        else
+            gap = 0;
+        if(gap < bestGap)
+        {
+            bestGap = gap;
+            best    = i;
+        }
+    }
+    if(bestGap > 1 && ei->i_merkel_mmap_nr < EXT42_MERKEL_MMAP_SPANS)
+    {
+        span = &ei->i_merkel_mmap[ei->i_merkel_mmap_nr++];
+        span->ms_first = first;
+        span->ms_last  = last;
+    }
+    else
+    {
+        span = &ei->i_merkel_mmap[best];
+        span->ms_first = min(span->ms_first, first);
+        span->ms_last  = max(span->ms_last, last);
+    }
+    atomic_inc(&ei->i_merkel_marks);
+    spin_unlock(&ei->i_merkel_mmap_lock);
+
+    //without a tree the spans wait for it to be loaded
+    if(READ_ONCE(ei->i_merkel_tree))
+        queue_delayed_work(EXT4_SB(inode->i_sb)->s_merkel_wq, &ei->i_merkel_work,
+                   MERKEL_FLUSH_DELAY);
+    queueDups(inode);
+}
+
+/*
+ * Verified reads.  A file is only opted in with EXT4_IOC_SETVERIFY once
+ * its data was written back and its leaves saved, and from then on its
+ * tree is loaded from that copy when it is opened, never rebuilt: without
+ * a valid copy the open fails with -EIO and merkel_verify_refused counts
+ * it.  The pages ext42_mpage_readpages() reads from disk are checked
+ * against the tree by a work on s_merkel_verify_wq, one per bio.  The
+ * check reads the leaf under RCU and never takes i_merkel_mutex: a flush
+ * holding it may be waiting for one of the pages being checked.  Verified
+ * trees are not reclaimed.
+ */
+static unsigned int verifyMode(struct inode* inode)
+{
+    //the caller holds i_merkel_mutex
+    struct ext42_inode_info* ei = EXT4_I(inode);
+
+    if(ei->i_merkel_verify == EXT42_MERKEL_VERIFY_UNKNOWN)
+        WRITE_ONCE(ei->i_merkel_verify,
+               ext42_xattr_get(inode, EXT4_XATTR_INDEX_MERKEL,
+                       EXT42_MERKEL_VERIFY_XATTR_NAME, NULL, 0) < 0 ?
+               EXT42_MERKEL_VERIFY_OFF : EXT42_MERKEL_VERIFY_ON);
+    return ei->i_merkel_verify;
+}
+
+/* Called when @inode is opened, before any page is read through the file */
+int ext42_merkel_open(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    int err = 0;
+
+    if(!S_ISREG(inode->i_mode) || READ_ONCE(ei->i_merkel_verify) == EXT42_MERKEL_VERIFY_OFF)
+        return 0;
+
+    mutex_lock(&ei->i_merkel_mutex);
+    if(verifyMode(inode) == EXT42_MERKEL_VERIFY_ON)
+    {
+        tree = ext42_merkel_get(inode, 1);
+        if(tree)
+            flushTree(inode, tree, 1);
+        else
+            err = noTree(inode);
+    }
+    mutex_unlock(&ei->i_merkel_mutex);
+    return err;
+}
+
+int ext42_merkel_get_verify(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    unsigned int mode;
+
+    if(!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    mutex_lock(&ei->i_merkel_mutex);
+    mode = verifyMode(inode);
+    mutex_unlock(&ei->i_merkel_mutex);
+    return mode == EXT42_MERKEL_VERIFY_ON;
+}
+
+/*
+ * Turn verified reads of @inode on or off.  The data is written back and
+ * the tree flushed and saved before the mode is set, so that every leaf
+ * can be checked from then on and comes back after the inode is evicted;
+ * -EBUSY while leaves are still writable through a mapping.  Encrypted
+ * files are refused: their leaves hash the plaintext and their bios
+ * complete through decryption instead.
+ */
+int ext42_merkel_set_verify(struct inode* inode, int on)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_merkel* tree;
+    int err;
+
+    if(!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if(ext42_encrypted_inode(inode))
+        return -EOPNOTSUPP;
+    if(on)
+    {
+        err = filemap_write_and_wait(inode->i_mapping);
+        if(err)
+            return err;
+    }
+
+    mutex_lock(&ei->i_merkel_mutex);
+    if(on)
+    {
+        tree = ext42_merkel_get(inode, 1);
+        if(!tree)
+        {
+            err = noTree(inode);
+            goto out;
+        }
+        flushTree(inode, tree, 1);
+        err = tree->mt_stale ? -EBUSY : 0;
+        //a clean tree too big to save was never saved, saveTree() refuses it
+        if(!err && (ei->i_merkel_dirty ||
+                (size_t)tree->mt_nr_leaves*tree->mt_hash_size > maxDiskLeaves(inode->i_sb)))
+            err = saveTree(inode, tree);
+        if(err)
+            goto out;
+        ei->i_merkel_dirty = 0;
+        err = ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL,
+                      EXT42_MERKEL_VERIFY_XATTR_NAME, "", 0, 0);
+    }
+    else
+        err = ext42_xattr_set(inode, EXT4_XATTR_INDEX_MERKEL,
+                      EXT42_MERKEL_VERIFY_XATTR_NAME, NULL, 0, 0);
+    if(!err)
+        WRITE_ONCE(ei->i_merkel_verify, on ? EXT42_MERKEL_VERIFY_ON : EXT42_MERKEL_VERIFY_OFF);
+out:
+    mutex_unlock(&ei->i_merkel_mutex);
+    return err;
+}
+
+/*
+ * Check the blocks of @page, just read from disk, against their leaves.
+ * Returns -EIO on a mismatch.  A leaf that cannot be trusted right now,
+ * being pending, possibly written through a mapping, changed meanwhile or
+ * without a tree, lets its block through: such blocks were written since
+ * the file was sealed and have no hash yet.  They are counted in
+ * merkel_verify_skipped.
+ */
+int ext42_merkel_verify_page(struct page* page)
+{
+    struct inode* inode = page->mapping->host;
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    loff_t size = i_size_read(inode), pos = page_offset(page);
+    u8 hash[EXT42_MERKEL_HASH_MAX_SIZE], leaf[EXT42_MERKEL_HASH_MAX_SIZE];
+    unsigned int off, i, seq, hs = hashSize(sbi);
+    struct ext42_merkel* tree;
+    unsigned char* kaddr;
+    int known, err = 0;
+
+    kaddr = kmap(page);
+    for(off = 0;off < PAGE_CACHE_SIZE && pos+off < size && !err;off += EXT42_MERKEL_BLOCK_SIZE)
+    {
+        i = (pos+off)/EXT42_MERKEL_BLOCK_SIZE;
+        hashData(sbi, kaddr+off, min_t(loff_t, EXT42_MERKEL_BLOCK_SIZE, size-pos-off), hash);
+
+        //unlike beginRead(), leaves pending elsewhere in the file do not matter
+        rcu_read_lock();
+        seq   = raw_read_seqcount(&ei->i_merkel_seq);
+        tree  = rcu_dereference(ei->i_merkel_tree);
+        known = !(seq & 1) && tree && i < tree->mt_nr_leaves &&
+            !test_bit(i, tree->mt_pending) && !READ_ONCE(ei->i_merkel_mmap_nr);
+        if(known)
+            memcpy(leaf, getNode(tree, 0, i), hs);
+        known = known && !read_seqcount_retry(&ei->i_merkel_seq, seq);
+        rcu_read_unlock();
+
+        if(!known)
+            atomic64_inc(&sbi->s_merkel_verify_skipped);
+        else if(memcmp(hash, leaf, hs))
+        {
+            ext42_warning_inode(inode, "block %u does not match its Merkle leaf", i);
+            err = -EIO;
+        }
+    }
+    kunmap(page);
+    return err;
+}
+
+/*
+ * Tree reclaim.  Inodes with a tree sit on s_merkel_list, which is walked
+ * from the head and rotated like the extent status list; a tree used since
+ * the last walk is skipped once.  Clean trees are simply discarded, the
+ * xattr copy or the file itself give them back when needed.  Trees not
+ * saved yet only go when nothing clean is left, except that past
+ * merkel_max_kb the reclaim work first writes them back.
+ */
+/* trees discarded by the reclaim work before checking the limit again */
+#define MERKEL_RECLAIM_BATCH  32
+/* rounds of the reclaim work, writers may keep dirtying trees */
+#define MERKEL_RECLAIM_ROUNDS 64
+
+static int shrinkTrees(struct ext42_sb_info* sbi, int nrToScan, int dirty)
+{
+    struct ext42_inode_info* ei;
+    struct ext42_merkel* tree;
+    unsigned int nrToWalk;
+    int nrShrunk = 0;
+
+    spin_lock(&sbi->s_merkel_lock);
+    nrToWalk = sbi->s_merkel_nr_trees;
+    while(nrToWalk-- > 0 && nrShrunk < nrToScan && !list_empty(&sbi->s_merkel_list))
+    {
+        ei = list_first_entry(&sbi->s_merkel_list, struct ext42_inode_info, i_merkel_list);
+        list_move_tail(&ei->i_merkel_list, &sbi->s_merkel_list);
+
+        if(ei->i_merkel_touched)
+        {
+            ei->i_merkel_touched = 0;
+            continue;
+        }
+        if(READ_ONCE(ei->i_merkel_verify) == EXT42_MERKEL_VERIFY_ON)
+            continue;
+        if(!mutex_trylock(&ei->i_merkel_mutex))
+            continue;
+        tree = ei->i_merkel_tree;
+        if(!dirty && (ei->i_merkel_dirty || tree->mt_stale))
+        {
+            mutex_unlock(&ei->i_merkel_mutex);
+            continue;
+        }
+
+        //pending leaves were never hashed, the root they lead to is lost
+        if(tree->mt_stale)
+            markRoot(&ei->vfs_inode);
+        RCU_INIT_POINTER(ei->i_merkel_tree, NULL);
+        ei->i_merkel_dirty = 0;
+        list_del_init(&ei->i_merkel_list);
+        sbi->s_merkel_nr_trees--;
+        sbi->s_merkel_shrunk++;
+        percpu_counter_sub(&sbi->s_merkel_bytes, ei->i_merkel_bytes);
+        countAlloc(&ei->vfs_inode, 0, tree->mt_bytes);
+        ei->i_merkel_bytes = 0;
+
+        //eviction takes s_merkel_lock after i_merkel_mutex, so the inode
+        //stays around until both are released
+        mutex_unlock(&ei->i_merkel_mutex);
+        spin_unlock(&sbi->s_merkel_lock);
+
+        freeMerkelTree(tree);
+        nrShrunk++;
+        spin_lock(&sbi->s_merkel_lock);
+    }
+    spin_unlock(&sbi->s_merkel_lock);
+    return nrShrunk;
+}
+
+static unsigned long countTrees(struct shrinker* shrink, struct shrink_control* sc)
+{
+    struct ext42_sb_info* sbi = container_of(shrink, struct ext42_sb_info, s_merkel_shrinker);
+    return READ_ONCE(sbi->s_merkel_nr_trees);
+}
+
+static unsigned long scanTrees(struct shrinker* shrink, struct shrink_control* sc)
+{
+    struct ext42_sb_info* sbi = container_of(shrink, struct ext42_sb_info, s_merkel_shrinker);
+    int nrShrunk;
+
+    if(!sc->nr_to_scan)
+        return READ_ONCE(sbi->s_merkel_nr_trees);
+
+    //unsaved trees as a last resort, they are rebuilt from the file
+    nrShrunk = shrinkTrees(sbi, sc->nr_to_scan, 0);
+    if(!nrShrunk)
+        nrShrunk = shrinkTrees(sbi, sc->nr_to_scan, 1);
+    return nrShrunk;
+}
+
+//write back the coldest unsaved tree, so that it can be discarded cheaply
+static int saveColdest(struct ext42_sb_info* sbi)
+{
+    struct ext42_inode_info* ei;
+    struct inode* inode = NULL;
+    int err;
+
+    spin_lock(&sbi->s_merkel_lock);
+    list_for_each_entry(ei, &sbi->s_merkel_list, i_merkel_list)
+    {
+        if(!ei->i_merkel_dirty)
+            continue;
+        inode = igrab(&ei->vfs_inode);
+        if(inode)
+            break;
+    }
+    spin_unlock(&sbi->s_merkel_lock);
+    if(!inode)
+        return -ENOENT;
+
+    err = ext42_merkel_save(inode);
+    iput(inode);
+    return err;
+}
+
+static void reclaimTrees(struct work_struct* work)
+{
+    struct ext42_sb_info* sbi = container_of(work, struct ext42_sb_info, s_merkel_reclaim_work);
+    unsigned int round;
+
+    for(round = 0;round < MERKEL_RECLAIM_ROUNDS && overLimit(sbi);round++)
+    {
+        if(shrinkTrees(sbi, MERKEL_RECLAIM_BATCH, 0))
+            continue;
+        if(!saveColdest(sbi))
+            continue;
+        if(!shrinkTrees(sbi, MERKEL_RECLAIM_BATCH, 1))
+            break;
+    }
+}
+
+int ext42_merkel_register_shrinker(struct ext42_sb_info* sbi)
+{
+    int err;
+
+    INIT_LIST_HEAD(&sbi->s_merkel_list);
+    spin_lock_init(&sbi->s_merkel_lock);
+    INIT_WORK(&sbi->s_merkel_reclaim_work, reclaimTrees);
+    sbi->s_merkel_nr_trees = 0;
+    sbi->s_merkel_shrunk   = 0;
+    err = percpu_counter_init(&sbi->s_merkel_bytes, 0, GFP_KERNEL);
+    if(err)
+        return err;
+
+    sbi->s_merkel_shrinker.scan_objects  = scanTrees;
+    sbi->s_merkel_shrinker.count_objects = countTrees;
+    sbi->s_merkel_shrinker.seeks         = DEFAULT_SEEKS;
+    err = register_shrinker(&sbi->s_merkel_shrinker);
+    if(err)
+        percpu_counter_destroy(&sbi->s_merkel_bytes);
+    return err;
+}
+
+void ext42_merkel_unregister_shrinker(struct ext42_sb_info* sbi)
+{
+    unregister_shrinker(&sbi->s_merkel_shrinker);
+    percpu_counter_destroy(&sbi->s_merkel_bytes);
+}
+
+/*
+ * Duplicate blocks.  The index lives from the first EXT4_IOC_FINDDUPS to
+ * the unmount: every regular file in use is queued then, and from that on
+ * a change to the data of a file only sets its bit in di_queued, without a
+ * lock.  Each call drops the leaves of the queued files from the index,
+ * flushes their trees and merges their full leaves back in, zero blocks
+ * aside, so its cost follows what changed since the previous call rather
+ * than the size of the filesystem.  Leaves are keyed on their whole hash;
+ * those sharing one are read back and only blocks holding the same bytes
+ * are reported together.
+ */
+/* entries copied to userspace at a time */
+#define MERKEL_DUPS_BATCH 64
+/* leaves of a hash group the others are compared to in turn */
+#define MERKEL_DUPS_LEADERS 4
+
+struct merkelDupLeaf {
+    u32 ino;
+    u32 lblk;
+    u8  size;   //of the hash
+    u8  hash[];
+};
+
+struct merkelDupLeaves {
+    u8* data;
+    unsigned int nb;
+    unsigned int capacity;
+    unsigned int stride;    //bytes per leaf
+};
+
+struct ext42_merkel_dup_index {
+    unsigned long* di_queued;       //inodes to index again
+    unsigned long* di_taken;        //those the current call handles
+    unsigned long di_nr_inodes;
+    unsigned int di_hash_size;
+    struct merkelDupLeaves di_leaves;   //sorted on hash, inode, block
+};
+
+/* a block of a leaf, mapped */
+struct merkelDupBlock {
+    struct inode* inode;
+    struct page* page;
+    const u8* data;
+};
+
+/* where the groups found go */
+struct merkelDupReport {
+    struct super_block* sb;
+    struct ext42_merkel_dups* dups;
+    struct ext42_merkel_dup __user* out;
+    struct ext42_merkel_dup* batch;
+    unsigned int nb;
+    unsigned int copied;
+    unsigned int groups;
+};
+
+static inline struct merkelDupLeaf* dupLeaf(struct merkelDupLeaves* leaves, unsigned int i)
+{
+    return (struct merkelDupLeaf*)(leaves->data + (size_t)i*leaves->stride);
+}
+
+static inline int sameHash(struct merkelDupLeaf* a, struct merkelDupLeaf* b)
+{
+    return !memcmp(a->hash, b->hash, a->size);
+}
+
+static int cmpDupLeaf(const void* a, const void* b)
+{
+    const struct merkelDupLeaf* la = a;
+    const struct merkelDupLeaf* lb = b;
+    int c = memcmp(la->hash, lb->hash, la->size);
+
+    if(c)
+        return c;
+    if(la->ino != lb->ino)
+        return la->ino < lb->ino ? -1 : 1;
+    return la->lblk < lb->lblk ? -1 : la->lblk > lb->lblk;
+}
+
+static void swapDupLeaves(struct merkelDupLeaves* leaves, unsigned int a, unsigned int b)
+{
+    u8 tmp[ALIGN(offsetof(struct merkelDupLeaf, hash) + EXT42_MERKEL_HASH_MAX_SIZE, sizeof(u32))];
+
+    if(a == b)
+        return;
+    memcpy(tmp, dupLeaf(leaves, a), leaves->stride);
+    memcpy(dupLeaf(leaves, a), dupLeaf(leaves, b), leaves->stride);
+    memcpy(dupLeaf(leaves, b), tmp, leaves->stride);
+}
+
+static int growDupLeaves(struct merkelDupLeaves* leaves, unsigned int nb)
+{
+    unsigned int capacity;
+    u8* grown;
+
+    if(nb <= leaves->capacity)
+        return 0;
+    if(nb > EXT42_MERKEL_DUPS_MAX_LEAVES)
+        return -E2BIG;
+    capacity = clamp(max(2*leaves->capacity, nb), 4096U, (unsigned int)EXT42_MERKEL_DUPS_MAX_LEAVES);
+    grown = vmalloc((size_t)capacity*leaves->stride);
+    if(!grown)
+        return -ENOMEM;
+    if(leaves->data)
+        memcpy(grown, leaves->data, (size_t)leaves->nb*leaves->stride);
+    vfree(leaves->data);
+    leaves->data     = grown;
+    leaves->capacity = capacity;
+    return 0;
+}
+
+static int addDupLeaf(struct merkelDupLeaves* leaves, const u8* hash, unsigned int hs,
+              u32 ino, u32 lblk)
+{
+    struct merkelDupLeaf* leaf;
+    int err = growDupLeaves(leaves, leaves->nb+1);
+
+    if(err)
+        return err;
+    leaf = dupLeaf(leaves, leaves->nb++);
+    leaf->ino  = ino;
+    leaf->lblk = lblk;
+    leaf->size = hs;
+    memcpy(leaf->hash, hash, hs);
+    return 0;
+}
+
+/* Replace @leaves with their merge with @fresh, both sorted */
+static int mergeDupLeaves(struct merkelDupLeaves* leaves, struct merkelDupLeaves* fresh)
+{
+    struct merkelDupLeaves merged = { NULL, 0, 0, leaves->stride };
+    struct merkelDupLeaf* next;
+    unsigned int i = 0, j = 0;
+    int err;
+
+    if(!fresh->nb)
+        return 0;
+    err = growDupLeaves(&merged, leaves->nb + fresh->nb);
+    if(err)
+        return err;
+    while(i < leaves->nb || j < fresh->nb)
+    {
+        if(j == fresh->nb || (i < leaves->nb && cmpDupLeaf(dupLeaf(leaves, i), dupLeaf(fresh, j)) < 0))
+            next = dupLeaf(leaves, i++);
+        else
+            next = dupLeaf(fresh, j++);
+        memcpy(dupLeaf(&merged, merged.nb++), next, leaves->stride);
+    }
+    vfree(leaves->data);
+    *leaves = merged;
+    return 0;
+}
+
+/*
+ * The data of @inode changed, the next EXT4_IOC_FINDDUPS indexes it again.
+ * Called once the tree knows of the change, cheap enough for write faults.
+ */
+static void queueDups(struct inode* inode)
+{
+    struct ext42_merkel_dup_index* index;
+
+    if(!S_ISREG(inode->i_mode))
+        return;
+    rcu_read_lock();
+    index = rcu_dereference(EXT4_SB(inode->i_sb)->s_merkel_dups);
+    if(index && inode->i_ino < index->di_nr_inodes)
+        set_bit(inode->i_ino, index->di_queued);
+    rcu_read_unlock();
+}
+
+/*
+ * Add the full leaves of @inode to @leaves.  Returns 1 when it is to be
+ * indexed again: it has no tree and @flags forbid building one, or some
+ * leaves are still writable through a mapping.
+ */
+static int indexLeaves(struct inode* inode, unsigned int flags, struct merkelDupLeaves* leaves)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    unsigned int i, full, hs = hashSize(sbi);
+    struct ext42_merkel* tree;
+    const u8* hash;
+    int err = 0, again = 0;
+
+    mutex_lock(&ei->i_merkel_mutex);
+    tree = ext42_merkel_get(inode, !(flags & EXT42_MERKEL_DUPS_NOBUILD));
+    if(!tree)
+    {
+        again = 1;
+        goto out;
+    }
+    flushTree(inode, tree, 1);
+
+    //the last leaf is partial or empty, leaves still mapped have no final hash
+    full = min_t(loff_t, i_size_read(inode)/EXT42_MERKEL_BLOCK_SIZE, tree->mt_nr_leaves);
+    for(i = 0;i < full && !err;i++)
+    {
+        hash = getNode(tree, 0, i);
+        if(test_bit(i, tree->mt_pending))
+            again = 1;
+        else if(memcmp(hash, sbi->s_merkel_zero[0], hs))
+            err = addDupLeaf(leaves, hash, hs, inode->i_ino, i);
+    }
+out:
+    mutex_unlock(&ei->i_merkel_mutex);
+    return err ? err : again;
+}
+
+static int indexInode(struct super_block* sb, unsigned long ino, unsigned int flags,
+              struct merkelDupLeaves* leaves)
+{
+    struct inode* inode;
+    int ret = 0;
+
+    if(ino < EXT4_FIRST_INO(sb))
+        return 0;
+
+    //inodes being freed or otherwise unreadable are skipped
+    inode = ext42_iget(sb, ino);
+    if(IS_ERR(inode))
+        return 0;
+    if(S_ISREG(inode->i_mode))
+        ret = indexLeaves(inode, flags, leaves);
+    iput(inode);
+    return ret;
+}
+
+/* Queue every inode in use, for the first call */
+static void queueInodes(struct super_block* sb, struct ext42_merkel_dup_index* index)
+{
+    unsigned int perGroup = EXT4_INODES_PER_GROUP(sb), bit;
+    struct buffer_head* bitmap;
+    ext42_group_t group;
+    unsigned long ino;
+
+    for(group = 0;group < ext42_get_groups_count(sb);group++)
+    {
+        bitmap = ext42_read_inode_bitmap(sb, group);
+        if(IS_ERR(bitmap))
+            continue;
+        for(bit = ext42_find_next_bit(bitmap->b_data, perGroup, 0);bit < perGroup;
+            bit = ext42_find_next_bit(bitmap->b_data, perGroup, bit+1))
+        {
+            ino = (unsigned long)group*perGroup + bit + 1;
+            if(ino < index->di_nr_inodes)
+                set_bit(ino, index->di_queued);
+        }
+        brelse(bitmap);
+        cond_resched();
+    }
+}
+
+/*
+ * Bring the index up to date with the inodes queued since the last call.
+ * On failure they are all queued again.
+ */
+static int updateDups(struct super_block* sb, struct ext42_merkel_dup_index* index,
+              unsigned int flags)
+{
+    struct merkelDupLeaves* leaves = &index->di_leaves;
+    struct merkelDupLeaves fresh = { NULL, 0, 0, leaves->stride };
+    unsigned long words = BITS_TO_LONGS(index->di_nr_inodes), w, ino;
+    unsigned int i, nb;
+    int ret, err = 0;
+
+    //changes from now on are seen by the next call
+    for(w = 0;w < words;w++)
+        index->di_taken[w] = READ_ONCE(index->di_queued[w]) ? xchg(&index->di_queued[w], 0) : 0;
+
+    for(i = 0, nb = 0;i < leaves->nb;i++)
+    {
+        if(test_bit(dupLeaf(leaves, i)->ino, index->di_taken))
+            continue;
+        if(nb != i)
+            memcpy(dupLeaf(leaves, nb), dupLeaf(leaves, i), leaves->stride);
+        nb++;
+    }
+    leaves->nb = nb;
+
+    for_each_set_bit(ino, index->di_taken, index->di_nr_inodes)
+    {
+        ret = indexInode(sb, ino, flags, &fresh);
+        if(ret > 0)
+            set_bit(ino, index->di_queued);
+        else if(ret < 0)
+            err = ret;
+        else if(fatal_signal_pending(current))
+            err = -EINTR;
+        if(err)
+            break;
+        cond_resched();
+    }
+
+    if(!err)
+    {
+        sort(fresh.data, fresh.nb, fresh.stride, cmpDupLeaf, NULL);
+        err = mergeDupLeaves(leaves, &fresh);
+    }
+    vfree(fresh.data);
+    if(err)
+        for_each_set_bit(ino, index->di_taken, index->di_nr_inodes)
+            set_bit(ino, index->di_queued);
+    return err;
+}
+
+static void freeDupIndex(struct ext42_merkel_dup_index* index)
+{
+    if(!index)
+        return;
+    vfree(index->di_queued);
+    vfree(index->di_taken);
+    vfree(index->di_leaves.data);
+    kfree(index);
+}
+
+/* The caller holds s_merkel_dups_mutex */
+static void forgetDups(struct ext42_sb_info* sbi)
+{
+    struct ext42_merkel_dup_index* index;
+
+    index = rcu_dereference_protected(sbi->s_merkel_dups,
+                      lockdep_is_held(&sbi->s_merkel_dups_mutex));
+    if(!index)
+        return;
+    RCU_INIT_POINTER(sbi->s_merkel_dups, NULL);
+    synchronize_rcu();
+    freeDupIndex(index);
+}
+
+/*
+ * Return the index, made with every inode queued if there is none or it
+ * no longer fits the filesystem: an online resize added inodes, or the
+ * hash changed.  The caller holds s_merkel_dups_mutex.
+ */
+static struct ext42_merkel_dup_index* getDupIndex(struct super_block* sb)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(sb);
+    unsigned long nr = le32_to_cpu(sbi->s_es->s_inodes_count) + 1;
+    struct ext42_merkel_dup_index* index;
+
+    index = rcu_dereference_protected(sbi->s_merkel_dups,
+                      lockdep_is_held(&sbi->s_merkel_dups_mutex));
+    if(index && index->di_nr_inodes == nr && index->di_hash_size == hashSize(sbi))
+        return index;
+    forgetDups(sbi);
+
+    index = kzalloc(sizeof(*index), GFP_KERNEL);
+    if(!index)
+        return NULL;
+    index->di_queued = vzalloc(BITS_TO_LONGS(nr)*sizeof(long));
+    index->di_taken  = vzalloc(BITS_TO_LONGS(nr)*sizeof(long));
+    if(!index->di_queued || !index->di_taken)
+    {
+        freeDupIndex(index);
+        return NULL;
+    }
+    index->di_nr_inodes      = nr;
+    index->di_hash_size      = hashSize(sbi);
+    index->di_leaves.stride  = ALIGN(offsetof(struct merkelDupLeaf, hash) + hashSize(sbi), sizeof(u32));
+
+    //published first, files changed while the bitmaps are read are queued anyway
+    rcu_assign_pointer(sbi->s_merkel_dups, index);
+    queueInodes(sb, index);
+    return index;
+}
+
+/* Map the block of @leaf while it is still inside its file */
+static int getDupBlock(struct super_block* sb, struct merkelDupLeaf* leaf,
+               struct merkelDupBlock* block)
+{
+    loff_t offset = (loff_t)leaf->lblk*EXT42_MERKEL_BLOCK_SIZE;
+
+    block->inode = ext42_iget(sb, leaf->ino);
+    if(IS_ERR(block->inode))
+        return PTR_ERR(block->inode);
+    block->page = ERR_PTR(-ENODATA);
+    if(S_ISREG(block->inode->i_mode) && offset+EXT42_MERKEL_BLOCK_SIZE <= i_size_read(block->inode))
+        block->page = read_mapping_page(block->inode->i_mapping, offset >> PAGE_CACHE_SHIFT, NULL);
+    if(IS_ERR(block->page))
+    {
+        iput(block->inode);
+        return PTR_ERR(block->page);
+    }
+    block->data = (u8*)kmap(block->page) + (offset & (PAGE_CACHE_SIZE-1));
+    return 0;
+}
+
+static void putDupBlock(struct merkelDupBlock* block)
+{
+    kunmap(block->page);
+    page_cache_release(block->page);
+    iput(block->inode);
+}
+
+/* Copy leaves [@first, @last[ as a group, or none of them when they do not fit */
+static int reportGroup(struct merkelDupReport* report, struct merkelDupLeaves* leaves,
+               unsigned int first, unsigned int last, u32 flags)
+{
+    struct ext42_merkel_dup* dup;
+    struct merkelDupLeaf* leaf;
+    unsigned int k;
+
+    if(report->copied + report->nb + (last-first) > report->dups->mds_count)
+    {
+        report->dups->mds_flags |= EXT42_MERKEL_DUPS_TRUNCATED;
+        report->groups++;
+        return 0;
+    }
+    for(k = first;k < last;k++)
+    {
+        leaf = dupLeaf(leaves, k);
+        dup  = &report->batch[report->nb];
+        dup->mdp_ino      = leaf->ino;
+        dup->mdp_lblk     = leaf->lblk;
+        dup->mdp_group    = report->groups;
+        dup->mdp_flags    = flags;
+        dup->mdp_reserved = 0;
+        if(++report->nb < MERKEL_DUPS_BATCH)
+            continue;
+        if(copy_to_user(report->out + report->copied, report->batch, report->nb*sizeof(*dup)))
+            return -EFAULT;
+        report->copied += report->nb;
+        report->nb = 0;
+    }
+    report->groups++;
+    return 0;
+}
+
+/*
+ * Report the leaves [@first, @last[, which share a hash, as groups of
+ * identical blocks.  Up to MERKEL_DUPS_LEADERS of them in turn are
+ * compared to the leaves no group took yet, which are moved next to it
+ * when they match; leaves left over only collide and are not reported.
+ * The range is sorted back afterwards.
+ */
+static int confirmGroups(struct merkelDupReport* report, struct merkelDupLeaves* leaves,
+             unsigned int first, unsigned int last)
+{
+    struct merkelDupBlock leader, block;
+    unsigned int start = first, tries, k, end;
+    int err = 0;
+
+    for(tries = 0;tries < MERKEL_DUPS_LEADERS && last-first >= 2 && !err;tries++)
+    {
+        //a block that cannot be read is left out
+        if(getDupBlock(report->sb, dupLeaf(leaves, first), &leader))
+        {
+            first++;
+            continue;
+        }
+        end = first+1;
+        for(k = first+1;k < last && !err;k++)
+        {
+            if(!getDupBlock(report->sb, dupLeaf(leaves, k), &block))
+            {
+                if(!memcmp(leader.data, block.data, EXT42_MERKEL_BLOCK_SIZE))
+                    swapDupLeaves(leaves, k, end++);
+                putDupBlock(&block);
+            }
+            if(fatal_signal_pending(current))
+                err = -EINTR;
+            cond_resched();
+        }
+        putDupBlock(&leader);
+        if(!err && end-first >= 2)
+            err = reportGroup(report, leaves, first, end, 0);
+        first = end;
+    }
+    sort(dupLeaf(leaves, start), last-start, leaves->stride, cmpDupLeaf, NULL);
+    return err;
+}
+
+/*
+ * Report the blocks of the filesystem holding the same bytes, see struct
+ * ext42_merkel_dups.  Groups are numbered from 0 in hash order; when they
+ * do not all fit, the ones that do are copied whole.
+ */
+int ext42_merkel_find_dups(struct super_block* sb, struct ext42_merkel_dups* dups)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(sb);
+    struct merkelDupReport report = {
+        .sb   = sb,
+        .dups = dups,
+        .out  = (void __user *)(unsigned long)dups->mds_dups,
+    };
+    struct ext42_merkel_dup_index* index;
+    struct merkelDupLeaves* leaves;
+    unsigned int i, j;
+    u32 key;
+    int err;
+
+    if((dups->mds_flags & ~(EXT42_MERKEL_DUPS_NOBUILD | EXT42_MERKEL_DUPS_NOREAD |
+                EXT42_MERKEL_DUPS_FORGET)) ||
+       (dups->mds_parts > 1 && dups->mds_part >= dups->mds_parts))
+        return -EINVAL;
+
+    mutex_lock(&sbi->s_merkel_dups_mutex);
+    if(dups->mds_flags & EXT42_MERKEL_DUPS_FORGET)
+    {
+        forgetDups(sbi);
+        dups->mds_count  = 0;
+        dups->mds_groups = 0;
+        dups->mds_leaves = 0;
+        err = 0;
+        goto out;
+    }
+
+    report.batch = kmalloc_array(MERKEL_DUPS_BATCH, sizeof(*report.batch), GFP_KERNEL);
+    index = getDupIndex(sb);
+    err = -ENOMEM;
+    if(!report.batch || !index)
+        goto out;
+    err = updateDups(sb, index, dups->mds_flags);
+    if(err)
+        goto out;
+
+    leaves = &index->di_leaves;
+    for(i = 0;i < leaves->nb && !err;i = j)
+    {
+        for(j = i+1;j < leaves->nb && sameHash(dupLeaf(leaves, j), dupLeaf(leaves, i));j++);
+        if(j - i < 2)
+            continue;
+        memcpy(&key, dupLeaf(leaves, i)->hash, sizeof(key));
+        if(dups->mds_parts > 1 && key % dups->mds_parts != dups->mds_part)
+            continue;
+        if(dups->mds_flags & EXT42_MERKEL_DUPS_NOREAD)
+            err = reportGroup(&report, leaves, i, j, EXT42_MERKEL_DUP_UNVERIFIED);
+        else
+            err = confirmGroups(&report, leaves, i, j);
+    }
+    if(!err && report.nb &&
+       copy_to_user(report.out + report.copied, report.batch, report.nb*sizeof(*report.batch)))
+        err = -EFAULT;
+    report.copied += report.nb;
+
+    dups->mds_count  = report.copied;
+    dups->mds_groups = report.groups;
+    dups->mds_leaves = leaves->nb;
+out:
+    mutex_unlock(&sbi->s_merkel_dups_mutex);
+    kfree(report.batch);
+    return err;
+}
+
+/*
+ * Directory roots.  A directory's root is the lane-wise sum of the hashes
+ * of its entries' names followed by their roots, so adding, removing or
+ * changing one entry is O(1) and the change is carried up the dentry
+ * parents, each level seeing the old and new root of the one below.
+ * Roots are only known for directories that were scanned (or created)
+ * and stayed in memory since; an entry whose previous root is unknown
+ * can only invalidate the directories above it, which are scanned again
+ * when next asked for.  The root of an inode is protected by its slot of
+ * s_merkel_dir_locks, taken after i_mutex and i_merkel_mutex and never
+ * two at a time, and everything is skipped while no directory root is in
+ * use.  Directories reflect file contents once the work ran; a file
+ * evicted before that bumps s_merkel_dir_epoch, which retires the roots
+ * of every directory.
+ */
+#define MERKEL_DIR_LANES    (EXT42_MERKEL_HASH_MAX_SIZE/sizeof(u64))
+/* entries read from a directory between two lookups */
+#define MERKEL_DIR_BATCH    16
+/* scans restarted because the directory changed meanwhile */
+#define MERKEL_DIR_RETRIES  3
+
+static inline spinlock_t* dirLock(struct inode* inode)
+{
+    return &EXT4_SB(inode->i_sb)->s_merkel_dir_locks[hash_ptr(inode,
+                                  EXT42_MERKEL_DIR_LOCK_BITS)];
+}
+
+static unsigned int rootLength(struct ext42_sb_info* sbi, umode_t mode)
+{
+    if(S_ISREG(mode))
+        return hashSize(sbi);
+    if(S_ISDIR(mode))
+        return EXT42_MERKEL_HASH_MAX_SIZE;
+    return 0;
+}
+
+static void entryHash(struct ext42_sb_info* sbi, const unsigned char* name, unsigned int len,
+              const u8* root, unsigned int rootLen, u8* out)
+{
+    u8 buf[NAME_MAX + EXT42_MERKEL_HASH_MAX_SIZE];
+
+    memcpy(buf, name, len);
+    memcpy(buf + len, root, rootLen);
+    memset(out, 0, EXT42_MERKEL_HASH_MAX_SIZE);
+    hashData(sbi, buf, len + rootLen, out);
+}
+
+static void foldEntry(u8* root, const u8* hash, int add)
+{
+    unsigned int i;
+    for(i = 0;i < MERKEL_DIR_LANES;i++)
+    {
+        u64 lane = get_unaligned_le64(root + 8*i), h = get_unaligned_le64(hash + 8*i);
+        put_unaligned_le64(add ? lane + h : lane - h, root + 8*i);
+    }
+}
+
+//whether the root of a directory is known, those of older epochs are retired
+static int dirKnown(struct ext42_sb_info* sbi, struct ext42_inode_info* ei)
+{
+    if(ei->i_merkel_root_valid &&
+       ei->i_merkel_epoch != (unsigned int)atomic_read(&sbi->s_merkel_dir_epoch))
+    {
+        ei->i_merkel_root_valid = 0;
+        atomic_dec(&sbi->s_merkel_dirs);
+    }
+    return ei->i_merkel_root_valid;
+}
+
+//pin the dentries from the one of @dir up to the root, NULL if it has none
+static unsigned int pinPath(struct inode* dir, struct dentry*** path)
+{
+    struct dentry *dentry = d_find_alias(dir), *parent;
+    struct dentry** p = NULL;
+    unsigned int nb = 0, room = 0;
+
+    while(dentry)
+    {
+        if(nb == room)
+        {
+            room = room ? 2*room : 8;
+            p = krealloc(p, room*sizeof(*p), GFP_NOFS | __GFP_NOFAIL);
+        }
+        p[nb++] = dentry;
+        parent  = dget_parent(dentry);
+        if(parent == dentry)
+        {
+            dput(parent);
+            break;
+        }
+        dentry = parent;
+    }
+    *path = p;
+    return nb;
+}
+
+//a change is on its way up through @inode, scans of it cannot commit
+static void markBusy(struct inode* inode, int busy)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+
+    spin_lock(dirLock(inode));
+    ei->i_merkel_gen++;
+    if(busy)
+        ei->i_merkel_busy++;
+    else
+        ei->i_merkel_busy--;
+    spin_unlock(dirLock(inode));
+}
+
+/*
+ * Apply to @dir the removal of entry hash @sub and the addition of @add,
+ * either being NULL, then go up the parents with the old and new hash of
+ * each directory's own entry.  With both NULL every directory above is
+ * invalidated instead.  Directories are locked one at a time: sums only
+ * add up, so changes climbing the same path may overtake each other, but
+ * none may reach a directory whose scan already saw its effect below.
+ * The whole path is marked busy first, its scans then only commit once
+ * the change went through.
+ */
+static void dirChanged(struct inode* dir, const u8* sub, const u8* add)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+    u8 oldRoot[EXT42_MERKEL_HASH_MAX_SIZE], newRoot[EXT42_MERKEL_HASH_MAX_SIZE];
+    u8 subHash[EXT42_MERKEL_HASH_MAX_SIZE], addHash[EXT42_MERKEL_HASH_MAX_SIZE];
+    unsigned char name[NAME_MAX];
+    struct ext42_inode_info* ei;
+    struct dentry** path;
+    struct inode* inode;
+    int invalidate = !sub && !add, up;
+    unsigned int nb, levels, len, i;
+
+    nb     = pinPath(dir, &path);
+    levels = max(nb, 1U);
+    for(i = 0;i < levels;i++)
+        markBusy(nb ? d_inode(path[i]) : dir, 1);
+
+    for(i = 0;i < levels;i++)
+    {
+        inode = nb ? d_inode(path[i]) : dir;
+        ei    = EXT4_I(inode);
+        up    = i+1 < nb;
+        spin_lock(dirLock(inode));
+        if(dirKnown(sbi, ei) && invalidate)
+        {
+            ei->i_merkel_root_valid = 0;
+            atomic_dec(&sbi->s_merkel_dirs);
+        }
+        else if(ei->i_merkel_root_valid)
+        {
+            memcpy(oldRoot, ei->i_merkel_root, sizeof(oldRoot));
+            if(sub)
+                foldEntry(ei->i_merkel_root, sub, 0);
+            if(add)
+                foldEntry(ei->i_merkel_root, add, 1);
+            memcpy(newRoot, ei->i_merkel_root, sizeof(newRoot));
+        }
+        //everything above was invalidated already
+        else if(!ei->i_merkel_root_folded)
+            up = 0;
+        else
+            invalidate = 1;
+        if(up && invalidate)
+            ei->i_merkel_root_folded = 0;
+        spin_unlock(dirLock(inode));
+        if(!up)
+            break;
+
+        //next level up, the parent of the directory's dentry
+        if(!invalidate)
+        {
+            spin_lock(&path[i]->d_lock);
+            len = path[i]->d_name.len;
+            memcpy(name, path[i]->d_name.name, len);
+            spin_unlock(&path[i]->d_lock);
+            entryHash(sbi, name, len, oldRoot, sizeof(oldRoot), subHash);
+            entryHash(sbi, name, len, newRoot, sizeof(newRoot), addHash);
+            sub = subHash;
+            add = addHash;
+        }
+    }
+
+    for(i = 0;i < levels;i++)
+        markBusy(nb ? d_inode(path[i]) : dir, 0);
+    for(i = 0;i < nb;i++)
+        dput(path[i]);
+    kfree(path);
+}
+
+/*
+ * The root of @inode is now @root, NULL when it is no longer known.  Every
+ * directory linking it gets the difference.  Called with i_mutex and
+ * i_merkel_mutex held for files, which keeps the namespace hooks and the
+ * scans off the root until it is set.
+ */
+static void rootChanged(struct inode* inode, const u8* root)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    unsigned int len = rootLength(sbi, inode->i_mode), nb, i, nameLen, folded;
+    u8 subHash[EXT42_MERKEL_HASH_MAX_SIZE], addHash[EXT42_MERKEL_HASH_MAX_SIZE];
+    u8 oldRoot[EXT42_MERKEL_HASH_MAX_SIZE];
+    unsigned char name[NAME_MAX];
+    struct dentry** aliases = NULL;
+    struct dentry* alias;
+
+    //nothing folds this root, it is set again when a directory is scanned
+    if(!atomic_read(&sbi->s_merkel_dirs))
+    {
+        WRITE_ONCE(ei->i_merkel_root_valid, 0);
+        WRITE_ONCE(ei->i_merkel_root_folded, 0);
+        return;
+    }
+
+    //pin the names of the inode, hard links included
+    for(;;)
+    {
+        nb = 0;
+        spin_lock(&inode->i_lock);
+        hlist_for_each_entry(alias, &inode->i_dentry, d_u.d_alias)
+            nb++;
+        spin_unlock(&inode->i_lock);
+        if(nb)
+            aliases = kmalloc_array(nb, sizeof(*aliases), GFP_NOFS | __GFP_NOFAIL);
+
+        i = 0;
+        spin_lock(&inode->i_lock);
+        hlist_for_each_entry(alias, &inode->i_dentry, d_u.d_alias)
+        {
+            if(i == nb)
+                break;
+            aliases[i++] = dget(alias);
+        }
+        spin_unlock(&inode->i_lock);
+        if(!alias)
+        {
+            nb = i;
+            break;
+        }
+
+        //linked again meanwhile
+        while(i)
+            dput(aliases[--i]);
+        kfree(aliases);
+        aliases = NULL;
+    }
+    spin_lock(dirLock(inode));
+    folded = nb && ei->i_merkel_root_valid && root;
+    memcpy(oldRoot, ei->i_merkel_root, len);
+    spin_unlock(dirLock(inode));
+    for(i = 0;i < nb;i++)
+    {
+        //unlinked names are in no directory any more
+        struct dentry* parent = dget_parent(aliases[i]);
+        if(!d_unhashed(aliases[i]) && parent != aliases[i])
+        {
+            if(folded)
+            {
+                spin_lock(&aliases[i]->d_lock);
+                nameLen = aliases[i]->d_name.len;
+                memcpy(name, aliases[i]->d_name.name, nameLen);
+                spin_unlock(&aliases[i]->d_lock);
+                entryHash(sbi, name, nameLen, oldRoot, len, subHash);
+                entryHash(sbi, name, nameLen, root, len, addHash);
+                dirChanged(d_inode(parent), subHash, addHash);
+            }
+            else
+                dirChanged(d_inode(parent), NULL, NULL);
+        }
+        dput(parent);
+        dput(aliases[i]);
+    }
+    //without a name the directories holding it cannot be found, any known
+    //one may hold the old root: rare enough to just forget them all
+    spin_lock(dirLock(inode));
+    if(!nb && ei->i_merkel_root_folded)
+        atomic_inc(&sbi->s_merkel_dir_epoch);
+    if(root)
+        memcpy(ei->i_merkel_root, root, len);
+    ei->i_merkel_root_valid  = !!root;
+    ei->i_merkel_root_folded = folded;
+    spin_unlock(dirLock(inode));
+    kfree(aliases);
+}
+
+//forget the root of an inode no directory holds any more, under its lock
+static void forgetRoot(struct inode* inode)
+{
+    struct ext42_inode_info* ei = EXT4_I(inode);
+
+    if(S_ISDIR(inode->i_mode) && ei->i_merkel_root_valid)
+        atomic_dec(&EXT4_SB(inode->i_sb)->s_merkel_dirs);
+    ei->i_merkel_root_valid  = 0;
+    ei->i_merkel_root_folded = 0;
+}
+
+/*
+ * Fold the entry @name of @inode into @dir, or take it out and, with
+ * @forget, forget the root of @inode in the same step.  An entry whose
+ * root is unknown invalidates @dir.
+ */
+static void dirEntry(struct inode* dir, const struct qstr* name, struct inode* inode, int add,
+             int forget)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    unsigned int len = rootLength(sbi, inode->i_mode);
+    u8 root[EXT42_MERKEL_HASH_MAX_SIZE], hash[EXT42_MERKEL_HASH_MAX_SIZE];
+    int known;
+
+    spin_lock(dirLock(inode));
+    known = S_ISDIR(inode->i_mode) ? dirKnown(sbi, ei) : ei->i_merkel_root_valid;
+    memcpy(root, ei->i_merkel_root, sizeof(root));
+    if(forget)
+        forgetRoot(inode);
+    else if(add && (!len || known))
+        ei->i_merkel_root_folded = 1;
+    spin_unlock(dirLock(inode));
+
+    if(len && !known)
+    {
+        dirChanged(dir, NULL, NULL);
+        return;
+    }
+    entryHash(sbi, name->name, name->len, root, len, hash);
+    dirChanged(dir, add ? NULL : hash, add ? hash : NULL);
+}
+
+void ext42_merkel_dir_link(struct inode* dir, const struct qstr* name, struct inode* inode,
+               int created)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+    struct ext42_inode_info* ei = EXT4_I(inode);
+    u8 root[EXT42_MERKEL_HASH_MAX_SIZE];
+
+    if(!atomic_read(&sbi->s_merkel_dirs))
+        return;
+
+    //empty files and directories are known without reading them
+    if(created && S_ISREG(inode->i_mode))
+    {
+        hashData(sbi, NULL, 0, root);
+        spin_lock(dirLock(inode));
+        memcpy(ei->i_merkel_root, root, hashSize(sbi));
+        ei->i_merkel_root_valid = 1;
+        spin_unlock(dirLock(inode));
+    }
+    else if(created && S_ISDIR(inode->i_mode))
+    {
+        spin_lock(dirLock(inode));
+        memset(ei->i_merkel_root, 0, EXT42_MERKEL_HASH_MAX_SIZE);
+        ei->i_merkel_root_valid = 1;
+        ei->i_merkel_epoch      = atomic_read(&sbi->s_merkel_dir_epoch);
+        atomic_inc(&sbi->s_merkel_dirs);
+        spin_unlock(dirLock(inode));
+    }
+    dirEntry(dir, name, inode, 1, 0);
+}
+
+void ext42_merkel_dir_unlink(struct inode* dir, const struct qstr* name, struct inode* inode)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+
+    if(!atomic_read(&sbi->s_merkel_dirs))
+        return;
+
+    //the dentry is only unhashed once we return and a flush meanwhile would
+    //still fold into @dir: its last name goes with the root of @inode, with
+    //other names left @dir is scanned again
+    if(inode->i_nlink)
+        dirChanged(dir, NULL, NULL);
+    else
+        dirEntry(dir, name, inode, 0, 1);
+}
+
+void ext42_merkel_dir_rename(struct inode* oldDir, const struct qstr* oldName,
+                 struct inode* newDir, const struct qstr* newName, struct inode* inode)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(oldDir->i_sb);
+
+    if(!atomic_read(&sbi->s_merkel_dirs))
+        return;
+
+    //the VFS holds the i_mutex of a renamed file until d_move() and flushed
+    //roots are carried up under it, a directory is not locked so its new
+    //parents are invalidated rather than see a change through the old ones
+    dirEntry(oldDir, oldName, inode, 0, S_ISDIR(inode->i_mode));
+    dirEntry(newDir, newName, inode, 1, 0);
+}
+
+struct merkelDirEntry
+{
+    unsigned int len;
+    char name[NAME_MAX];
+};
+
+struct merkelDirBatch
+{
+    struct dir_context ctx;
+    unsigned int nb;
+    struct merkelDirEntry* ent;
+};
+
+static int collectEntry(struct dir_context* ctx, const char* name, int len,
+            loff_t pos, u64 ino, unsigned int type)
+{
+    struct merkelDirBatch* batch = container_of(ctx, struct merkelDirBatch, ctx);
+
+    if(batch->nb == MERKEL_DIR_BATCH)
+        return -ENOSPC;
+    if((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.'))
+        return 0;
+    batch->ent[batch->nb].len = len;
+    memcpy(batch->ent[batch->nb].name, name, len);
+    batch->nb++;
+    return 0;
+}
+
+/*
+ * A directory being scanned.  The scan keeps one per level on a stack in
+ * memory, nesting costs no kernel stack; the entry of the level above
+ * being computed is the last one it handed out.
+ */
+struct merkelDirFrame
+{
+    struct list_head list;
+    struct file* file;
+    struct merkelDirEntry* ent;
+    unsigned int nb, next;      /* entries read in @ent, next one to hash */
+    int eof;                    /* @ent holds the last entries */
+    unsigned int gen, epoch, tries;
+    u8 sum[EXT42_MERKEL_HASH_MAX_SIZE];
+};
+
+//copy the root of directory @inode if it is known
+static int knownRoot(struct inode* inode, u8* root)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(inode->i_sb);
+    int known;
+
+    spin_lock(dirLock(inode));
+    known = dirKnown(sbi, EXT4_I(inode));
+    if(known)
+        memcpy(root, EXT4_I(inode)->i_merkel_root, EXT42_MERKEL_HASH_MAX_SIZE);
+    spin_unlock(dirLock(inode));
+    return known;
+}
+
+/*
+ * Hash of one entry of the directory open as @file, -ENOENT once it is
+ * gone.  A directory whose root is not known is opened as *@sub instead
+ * and 1 returned.  The caller must be allowed to read the files and to
+ * list the directories it gets the hash of, -EACCES otherwise; this is
+ * checked along the path descended, before a known root is used, so the
+ * roots stay the same for every caller and are shared.
+ */
+static int entryRoot(struct file* file, const struct merkelDirEntry* ent,
+             u8* hash, struct file** sub)
+{
+    struct dentry* parent = file->f_path.dentry;
+    struct ext42_sb_info* sbi = EXT4_SB(parent->d_sb);
+    u8 root[EXT42_MERKEL_HASH_MAX_SIZE];
+    struct ext42_inode_info* ei;
+    struct ext42_merkel* tree;
+    struct dentry* dentry;
+    struct inode* inode;
+    struct path path;
+    int err = 0;
+
+    mutex_lock(&d_inode(parent)->i_mutex);
+    dentry = lookup_one_len(ent->name, parent, ent->len);
+    mutex_unlock(&d_inode(parent)->i_mutex);
+    if(IS_ERR(dentry))
+        return PTR_ERR(dentry);
+    if(d_really_is_negative(dentry))
+    {
+        dput(dentry);
+        return -ENOENT;
+    }
+
+    inode = d_inode(dentry);
+    ei    = EXT4_I(inode);
+    if(S_ISDIR(inode->i_mode))
+        err = inode_permission(inode, MAY_READ | MAY_EXEC);
+    else if(S_ISREG(inode->i_mode))
+        err = inode_permission(inode, MAY_READ);
+    if(!err && S_ISREG(inode->i_mode))
+    {
+        //flushed here, so nothing is left for the work to carry up
+        mutex_lock(&ei->i_merkel_mutex);
+        tree = ext42_merkel_get(inode, 1);
+        if(tree)
+        {
+            flushTree(inode, tree, 1);
+            memcpy(root, getNode(tree, tree->mt_depth, 0), hashSize(sbi));
+            spin_lock(dirLock(inode));
+            memcpy(ei->i_merkel_root, root, hashSize(sbi));
+            ei->i_merkel_root_valid  = 1;
+            ei->i_merkel_root_folded = 1;
+            ei->i_merkel_root_dirty  = 0;
+            spin_unlock(dirLock(inode));
+        }
+        else
+            err = noTree(inode);
+        mutex_unlock(&ei->i_merkel_mutex);
+    }
+    else if(!err && S_ISDIR(inode->i_mode) && !knownRoot(inode, root))
+    {
+        path.mnt    = file->f_path.mnt;
+        path.dentry = dentry;
+        *sub = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+        err  = IS_ERR(*sub) ? PTR_ERR(*sub) : 1;
+    }
+
+    if(!err)
+        entryHash(sbi, (const unsigned char*)ent->name, ent->len, root,
+              rootLength(sbi, inode->i_mode), hash);
+    dput(dentry);
+    return err;
+}
+
+//read the directory of @f from its start, at the generation it is read at
+static int rewindDir(struct merkelDirFrame* f)
+{
+    struct inode* dir = file_inode(f->file);
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+    loff_t pos;
+
+    spin_lock(dirLock(dir));
+    f->gen   = EXT4_I(dir)->i_merkel_gen;
+    f->epoch = atomic_read(&sbi->s_merkel_dir_epoch);
+    spin_unlock(dirLock(dir));
+    memset(f->sum, 0, sizeof(f->sum));
+    f->nb   = 0;
+    f->next = 0;
+    f->eof  = 0;
+    pos = vfs_llseek(f->file, 0, SEEK_SET);
+    return pos < 0 ? pos : 0;
+}
+
+static void freeDir(struct merkelDirFrame* f)
+{
+    list_del(&f->list);
+    fput(f->file);
+    kfree(f->ent);
+    kfree(f);
+}
+
+//push the directory open as @file, which the stack owns from then on
+static int pushDir(struct list_head* stack, struct file* file)
+{
+    struct merkelDirFrame* f = kmalloc(sizeof(*f), GFP_KERNEL);
+
+    if(!f)
+    {
+        fput(file);
+        return -ENOMEM;
+    }
+    f->file = file;
+    list_add(&f->list, stack);
+    f->ent = kmalloc_array(MERKEL_DIR_BATCH, sizeof(*f->ent), GFP_KERNEL);
+    if(!f->ent)
+        return -ENOMEM;
+    return rewindDir(f);
+}
+
+//next entry of the directory of @f, NULL once all were read or on error
+static struct merkelDirEntry* nextEntry(struct merkelDirFrame* f, struct merkelDirBatch* batch,
+                    int* err)
+{
+    //a batch at a time, lookups cannot be done from the actor
+    if(f->next == f->nb)
+    {
+        if(f->eof)
+            return NULL;
+        batch->nb  = 0;
+        batch->ent = f->ent;
+        *err    = iterate_dir(f->file, &batch->ctx);
+        f->nb   = batch->nb;
+        f->next = 0;
+        f->eof  = f->nb < MERKEL_DIR_BATCH;
+        if(*err || !f->nb)
+            return NULL;
+    }
+    return &f->ent[f->next++];
+}
+
+/*
+ * Commit the root of the directory of @f into @root unless an entry
+ * changed under the scan or a change is still on its way up through it,
+ * 1 if it has to be read again.
+ */
+static int commitDir(struct merkelDirFrame* f, u8* root)
+{
+    struct inode* dir = file_inode(f->file);
+    struct ext42_inode_info* ei = EXT4_I(dir);
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+
+    spin_lock(dirLock(dir));
+    if(ei->i_merkel_gen != f->gen || ei->i_merkel_busy ||
+       (unsigned int)atomic_read(&sbi->s_merkel_dir_epoch) != f->epoch)
+    {
+        spin_unlock(dirLock(dir));
+        return ++f->tries > MERKEL_DIR_RETRIES ? -EAGAIN : 1;
+    }
+    if(!dirKnown(sbi, ei))
+    {
+        memcpy(ei->i_merkel_root, f->sum, sizeof(f->sum));
+        ei->i_merkel_root_valid  = 1;
+        ei->i_merkel_root_folded = 1;
+        ei->i_merkel_epoch       = f->epoch;
+        atomic_inc(&sbi->s_merkel_dirs);
+    }
+    memcpy(root, ei->i_merkel_root, EXT42_MERKEL_HASH_MAX_SIZE);
+    spin_unlock(dirLock(dir));
+    return 0;
+}
+
+/*
+ * Root of the directory open as @file, read again unless it is still
+ * known.  Unknown directories below are read depth first from a stack
+ * in memory, so their nesting is not bounded; each one is committed once
+ * read, then folded into the one above.
+ */
+static int scanTree(struct file* file, u8* root)
+{
+    struct ext42_sb_info* sbi = EXT4_SB(file_inode(file)->i_sb);
+    struct merkelDirBatch batch = { .ctx.actor = collectEntry };
+    u8 hash[EXT42_MERKEL_HASH_MAX_SIZE];
+    struct merkelDirFrame* f;
+    struct merkelDirEntry* ent;
+    struct file* sub;
+    LIST_HEAD(stack);
+    int err;
+
+    if(knownRoot(file_inode(file), root))
+        return 0;
+
+    err = pushDir(&stack, get_file(file));
+    while(!err && !list_empty(&stack))
+    {
+        f = list_first_entry(&stack, struct merkelDirFrame, list);
+        if(fatal_signal_pending(current))
+        {
+            err = -EINTR;
+            break;
+        }
+
+        ent = nextEntry(f, &batch, &err);
+        if(ent)
+        {
+            err = entryRoot(f->file, ent, hash, &sub);
+            if(err == 1)
+                err = pushDir(&stack, sub);
+            else if(!err)
+                foldEntry(f->sum, hash, 1);
+            //removed since it was read, the generation tells
+            else if(err == -ENOENT)
+                err = 0;
+            continue;
+        }
+        if(err)
+            break;
+
+        err = commitDir(f, root);
+        if(err == 1)
+            err = rewindDir(f);
+        if(err)
+            continue;
+        freeDir(f);
+        if(list_empty(&stack))
+            break;
+        f   = list_first_entry(&stack, struct merkelDirFrame, list);
+        ent = &f->ent[f->next - 1];
+        entryHash(sbi, (const unsigned char*)ent->name, ent->len, root,
+              EXT42_MERKEL_HASH_MAX_SIZE, hash);
+        foldEntry(f->sum, hash, 1);
+    }
+
+    while(!list_empty(&stack))
+        freeDir(list_first_entry(&stack, struct merkelDirFrame, list));
+    return err;
+}
+
+int ext42_merkel_dir_root(struct file* filp, struct ext42_merkel_dirroot* dr)
+{
+    struct inode* dir = file_inode(filp);
+    struct ext42_sb_info* sbi = EXT4_SB(dir->i_sb);
+    struct file* file;
+    int err;
+
+    if(!S_ISDIR(dir->i_mode))
+        return -ENOTDIR;
+    err = inode_permission(dir, MAY_READ | MAY_EXEC);
+    if(err)
+        return err;
+
+    //own file, the position of the caller's is left alone
+    file = dentry_open(&filp->f_path, O_RDONLY | O_DIRECTORY, current_cred());
+    if(IS_ERR(file))
+        return PTR_ERR(file);
+
+    //the namespace hooks run while anything is being scanned
+    memset(dr, 0, sizeof(*dr));
+    atomic_inc(&sbi->s_merkel_dirs);
+    err = scanTree(file, dr->mdr_root);
+    atomic_dec(&sbi->s_merkel_dirs);
+    fput(file);
+
+    dr->mdr_hash_alg  = sbi->s_merkel_alg;
+    dr->mdr_hash_size = hashSize(sbi);
+    return err;
+}
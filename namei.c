@@ -2433,6 +2433,8 @@ static int ext42_add_nondir(handle_t *handle,
     if (!err) {
         ext42_mark_inode_dirty(handle, inode);
         d_instantiate_new(dentry, inode);
+        ext42_merkel_dir_link(d_inode(dentry->d_parent), &dentry->d_name,
+                      inode, 1);
         return 0;
     }
     drop_nlink(inode);
@@ -2456,7 +2458,7 @@ static int ext42_create(struct inode *dir, struct dentry *dentry, umode_t mode,
     struct inode *inode;
     int err, credits, retries = 0;
 
-    D("create a node for %s", dentry->d_name.name);
+    D(NAMEI, "create a node for %s", dentry->d_name.name);
 
     err = dquot_initialize(dir);
     if (err)
@@ -2467,21 +2469,6 @@ static int ext42_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 retry:
     inode = ext42_new_inode_start_handle(dir, mode, &dentry->d_name, 0,
                         NULL, EXT4_HT_DIR, credits);
-    //get raw inode
-    struct ext42_iloc iloc;
-    struct ext42_inode *raw_inode;
-    iloc.bh = NULL;
-    ext42_get_inode_loc(inode, &iloc);
-    raw_inode = ext42_raw_inode(&iloc);
-
-    //init tree
-    raw_inode->tree = kmalloc(sizeof(merkel_tree),GFP_KERNEL | __GFP_HIGH | __GFP_NOFAIL );
-    raw_inode->tree->hash = 0;
-    raw_inode->tree->r = NULL;
-    raw_inode->tree->l = NULL;
-    raw_inode->tree->block = 0;
-    raw_inode->tree->depth = 0;
-
     handle = ext42_journal_current_handle();
     err = PTR_ERR(inode);
     if (!IS_ERR(inode)) {
@@ -2649,7 +2636,7 @@ static int ext42_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
     struct inode *inode;
     int err, credits, retries = 0;
 
-    D("mkdir %s", dentry->d_name.name);
+    D(NAMEI, "mkdir %s", dentry->d_name.name);
 
     if (EXT4_DIR_LINK_MAX(dir))
         return -EMLINK;
@@ -2691,6 +2678,7 @@ out_clear_inode:
     if (err)
         goto out_clear_inode;
     d_instantiate_new(dentry, inode);
+    ext42_merkel_dir_link(dir, &dentry->d_name, inode, 1);
     if (IS_DIRSYNC(dir))
         ext42_handle_sync(handle);
 
@@ -2951,7 +2939,7 @@ static int ext42_rmdir(struct inode *dir, struct dentry *dentry)
     struct ext42_dir_entry_2 *de;
     handle_t *handle = NULL;
 
-    D("rmdir %s", dentry->d_name.name);
+    D(NAMEI, "rmdir %s", dentry->d_name.name);
 
     /* Initialize quotas before so that eventual writes go in
      * separate transaction */
@@ -3010,6 +2998,7 @@ static int ext42_rmdir(struct inode *dir, struct dentry *dentry)
     ext42_dec_count(handle, dir);
     ext42_update_dx_flag(dir);
     ext42_mark_inode_dirty(handle, dir);
+    ext42_merkel_dir_unlink(dir, &dentry->d_name, inode);
 
 end_rmdir:
     brelse(bh);
@@ -3026,7 +3015,7 @@ static int ext42_unlink(struct inode *dir, struct dentry *dentry)
     struct ext42_dir_entry_2 *de;
     handle_t *handle = NULL;
 
-    D("unlink a node for %s", dentry->d_name.name);
+    D(NAMEI, "unlink a node for %s", dentry->d_name.name);
 
     trace_ext42_unlink_enter(dir, dentry);
     /* Initialize quotas before so that eventual writes go
@@ -3078,6 +3067,7 @@ static int ext42_unlink(struct inode *dir, struct dentry *dentry)
         ext42_orphan_add(handle, inode);
     inode->i_ctime = ext42_current_time(inode);
     ext42_mark_inode_dirty(handle, inode);
+    ext42_merkel_dir_unlink(dir, &dentry->d_name, inode);
 
 end_unlink:
     brelse(bh);
@@ -3282,6 +3272,7 @@ retry:
         if (inode->i_nlink == 1)
             ext42_orphan_del(handle, inode);
         d_instantiate(dentry, inode);
+        ext42_merkel_dir_link(dir, &dentry->d_name, inode, 0);
     } else {
         drop_nlink(inode);
         iput(inode);
@@ -3706,7 +3697,14 @@ static int ext42_rename(struct inode *old_dir, struct dentry *old_dentry,
         ext42_mark_inode_dirty(handle, new.inode);
         if (!new.inode->i_nlink)
             ext42_orphan_add(handle, new.inode);
-    }
+        ext42_merkel_dir_unlink(new.dir, &new.dentry->d_name,
+                    new.inode);
+    }
+    ext42_merkel_dir_rename(old.dir, &old.dentry->d_name,
+                new.dir, &new.dentry->d_name, old.inode);
+    if (whiteout)
+        ext42_merkel_dir_link(old.dir, &old.dentry->d_name,
+                      whiteout, 1);
     retval = 0;
 
 end_rename:
@@ -3857,6 +3855,10 @@ static int ext42_cross_rename(struct inode *old_dir, struct dentry *old_dentry,
     }
     ext42_update_dir_count(handle, &old);
     ext42_update_dir_count(handle, &new);
+    ext42_merkel_dir_rename(old.dir, &old.dentry->d_name,
+                new.dir, &new.dentry->d_name, old.inode);
+    ext42_merkel_dir_rename(new.dir, &new.dentry->d_name,
+                old.dir, &old.dentry->d_name, new.inode);
     retval = 0;
 
 end_rename:
@@ -484,6 +484,11 @@ int ext42_bio_write_page(struct ext42_io_submit *io,
 
 	bh = head = page_buffers(page);
 
+	/* Hash what goes to disk, before it gets encrypted */
+	if (test_opt(inode->i_sb, MERKEL_WRITEBACK) && S_ISREG(inode->i_mode) &&
+	    nr_to_submit)
+		ext42_merkel_writeback(page, len);
+
 	if (ext42_encrypted_inode(inode) && S_ISREG(inode->i_mode) &&
 	    nr_to_submit) {
 		gfp_t gfp_flags = GFP_NOFS;
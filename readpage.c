@@ -43,6 +43,7 @@
 #include <linux/backing-dev.h>
 #include <linux/pagevec.h>
 #include <linux/cleancache.h>
+#include <linux/slab.h>
 
 #include "ext4.h"
 
@@ -130,6 +131,115 @@ static void mpage_end_io(struct bio *bio)
 	bio_put(bio);
 }
 
+/*
+ * Verified reads are batched per BIO: the completion hands the whole BIO
+ * to s_merkel_verify_wq, and the pages are only marked uptodate once they
+ * matched their leaves in the Merkle tree.  Pages that fall back to buffer
+ * heads are checked by verify_read_full_page(), and cleancache is skipped.
+ * Inline data lives in the inode and is not verified.
+ */
+struct ext42_verify_ctx {
+	struct work_struct	work;
+	struct workqueue_struct	*wq;
+	struct bio		*bio;
+};
+
+static void verify_pages(struct work_struct *work)
+{
+	struct ext42_verify_ctx *ctx =
+		container_of(work, struct ext42_verify_ctx, work);
+	struct bio	*bio	= ctx->bio;
+	struct bio_vec	*bv;
+	int		i;
+
+	bio_for_each_segment_all(bv, bio, i) {
+		struct page *page = bv->bv_page;
+
+		if (ext42_merkel_verify_page(page)) {
+			ClearPageUptodate(page);
+			SetPageError(page);
+		} else
+			SetPageUptodate(page);
+		unlock_page(page);
+	}
+	kfree(ctx);
+	bio_put(bio);
+}
+
+static void mpage_verify_end_io(struct bio *bio)
+{
+	struct ext42_verify_ctx *ctx = bio->bi_private;
+
+	bio->bi_private = NULL;
+	if (bio->bi_error) {
+		kfree(ctx);
+		mpage_end_io(bio);
+		return;
+	}
+	INIT_WORK(&ctx->work, verify_pages);
+	ctx->bio = bio;
+	queue_work(ctx->wq, &ctx->work);
+}
+
+/*
+ * The buffer_head fallback for verified files.  block_read_full_page()
+ * marks the page uptodate from the completion of its last buffer, before
+ * anything could check it, so the buffers are read synchronously here and
+ * the page is only marked uptodate once it matched its leaves.
+ */
+static void verify_read_full_page(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	const unsigned blkbits = inode->i_blkbits;
+	const unsigned blocksize = 1 << blkbits;
+	struct buffer_head *bh, *head, *arr[MAX_BUF_PER_PAGE];
+	sector_t iblock, lblock;
+	int nr = 0, i = 0, err = 0;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, blocksize, 0);
+	head = page_buffers(page);
+	iblock = (sector_t)page->index << (PAGE_CACHE_SHIFT - blkbits);
+	lblock = (i_size_read(inode) + blocksize - 1) >> blkbits;
+	bh = head;
+	do {
+		if (buffer_uptodate(bh))
+			continue;
+		if (!buffer_mapped(bh)) {
+			if (iblock < lblock &&
+			    ext42_get_block(inode, iblock, bh, 0)) {
+				err = -EIO;
+				break;
+			}
+			if (!buffer_mapped(bh)) {
+				zero_user(page, i * blocksize, blocksize);
+				set_buffer_uptodate(bh);
+				continue;
+			}
+			if (buffer_uptodate(bh))
+				continue;
+		}
+		arr[nr++] = bh;
+	} while (i++, iblock++, (bh = bh->b_this_page) != head);
+
+	if (!err && nr) {
+		ll_rw_block(READ, nr, arr);
+		for (i = 0; i < nr; i++) {
+			wait_on_buffer(arr[i]);
+			if (!buffer_uptodate(arr[i]))
+				err = -EIO;
+		}
+	}
+	if (!err)
+		err = ext42_merkel_verify_page(page);
+	if (err) {
+		ClearPageUptodate(page);
+		SetPageError(page);
+	} else
+		SetPageUptodate(page);
+	unlock_page(page);
+}
+
 int ext42_mpage_readpages(struct address_space *mapping,
 			 struct list_head *pages, struct page *page,
 			 unsigned nr_pages)
@@ -142,6 +252,8 @@ int ext42_mpage_readpages(struct address_space *mapping,
 	const unsigned blkbits = inode->i_blkbits;
 	const unsigned blocks_per_page = PAGE_CACHE_SIZE >> blkbits;
 	const unsigned blocksize = 1 << blkbits;
+	const bool verify = READ_ONCE(EXT4_I(inode)->i_merkel_verify) ==
+			    EXT42_MERKEL_VERIFY_ON;
 	sector_t block_in_file;
 	sector_t last_block;
 	sector_t last_block_in_file;
@@ -252,14 +364,18 @@ int ext42_mpage_readpages(struct address_space *mapping,
 			zero_user_segment(page, first_hole << blkbits,
 					  PAGE_CACHE_SIZE);
 			if (first_hole == 0) {
-				SetPageUptodate(page);
+				/* a hole the leaves do not expect reads as -EIO */
+				if (verify && ext42_merkel_verify_page(page))
+					SetPageError(page);
+				else
+					SetPageUptodate(page);
 				unlock_page(page);
 				goto next_page;
 			}
 		} else if (fully_mapped) {
 			SetPageMappedToDisk(page);
 		}
-		if (fully_mapped && blocks_per_page == 1 &&
+		if (fully_mapped && blocks_per_page == 1 && !verify &&
 		    !PageUptodate(page) && cleancache_get_page(page) == 0) {
 			SetPageUptodate(page);
 			goto confused;
@@ -276,24 +392,36 @@ int ext42_mpage_readpages(struct address_space *mapping,
 		}
 		if (bio == NULL) {
 			struct ext42_crypto_ctx *ctx = NULL;
+			struct ext42_verify_ctx *vctx = NULL;
 
 			if (ext42_encrypted_inode(inode) &&
 			    S_ISREG(inode->i_mode)) {
 				ctx = ext42_get_crypto_ctx(inode, GFP_NOFS);
 				if (IS_ERR(ctx))
 					goto set_error_page;
+			} else if (verify) {
+				vctx = kmalloc(sizeof(*vctx), GFP_NOFS);
+				if (!vctx)
+					goto set_error_page;
+				vctx->wq = EXT4_SB(inode->i_sb)->s_merkel_verify_wq;
 			}
 			bio = bio_alloc(GFP_KERNEL,
 				min_t(int, nr_pages, BIO_MAX_PAGES));
 			if (!bio) {
 				if (ctx)
 					ext42_release_crypto_ctx(ctx);
+				kfree(vctx);
 				goto set_error_page;
 			}
 			bio->bi_bdev = bdev;
 			bio->bi_iter.bi_sector = blocks[0] << (blkbits - 9);
-			bio->bi_end_io = mpage_end_io;
-			bio->bi_private = ctx;
+			if (vctx) {
+				bio->bi_end_io = mpage_verify_end_io;
+				bio->bi_private = vctx;
+			} else {
+				bio->bi_end_io = mpage_end_io;
+				bio->bi_private = ctx;
+			}
 		}
 
 		length = first_hole << blkbits;
@@ -313,7 +441,9 @@ int ext42_mpage_readpages(struct address_space *mapping,
 			submit_bio(READ, bio);
 			bio = NULL;
 		}
-		if (!PageUptodate(page))
+		if (!PageUptodate(page) && verify)
+			verify_read_full_page(page);
+		else if (!PageUptodate(page))
 			block_read_full_page(page, ext42_get_block);
 		else
 			unlock_page(page);
@@ -806,6 +806,8 @@ static void ext42_put_super(struct super_block *sb)
 
 	flush_workqueue(sbi->rsv_conversion_wq);
 	destroy_workqueue(sbi->rsv_conversion_wq);
+	destroy_workqueue(sbi->s_merkel_wq);
+	destroy_workqueue(sbi->s_merkel_verify_wq);
 
 	if (sbi->s_journal) {
 		aborted = is_journal_aborted(sbi->s_journal);
@@ -816,6 +818,7 @@ static void ext42_put_super(struct super_block *sb)
 	}
 
 	ext42_unregister_sysfs(sb);
+	ext42_merkel_unregister_shrinker(sbi);
 	ext42_es_unregister_shrinker(sbi);
 	del_timer_sync(&sbi->s_err_report);
 	ext42_release_system_zone(sb);
@@ -876,6 +879,7 @@ static void ext42_put_super(struct super_block *sb)
 	 */
 	kobject_put(&sbi->s_kobj);
 	wait_for_completion(&sbi->s_kobj_unregister);
+	ext42_merkel_release_sb(sb);
 	if (sbi->s_chksum_driver)
 		crypto_free_shash(sbi->s_chksum_driver);
 	kfree(sbi->s_blockgroup_lock);
@@ -926,6 +930,25 @@ static struct inode *ext42_alloc_inode(struct super_block *sb)
 #ifdef CONFIG_EXT4_FS_ENCRYPTION
 	ei->i_crypt_info = NULL;
 #endif
+	ei->i_merkel_tree = NULL;
+	ei->i_merkel_dirty = 0;
+	ei->i_merkel_version = 0;
+	INIT_DELAYED_WORK(&ei->i_merkel_work, ext42_merkel_work);
+	INIT_DELAYED_WORK(&ei->i_merkel_save_work, ext42_merkel_save_work);
+	INIT_LIST_HEAD(&ei->i_merkel_list);
+	ei->i_merkel_bytes = 0;
+	ei->i_merkel_touched = 0;
+	ei->i_merkel_mmap_nr = 0;
+	INIT_LIST_HEAD(&ei->i_merkel_wb);
+	atomic_set(&ei->i_merkel_marks, 0);
+	ei->i_merkel_verify = EXT42_MERKEL_VERIFY_UNKNOWN;
+	ei->i_merkel_saved = EXT42_MERKEL_SAVED_UNKNOWN;
+	ei->i_merkel_root_valid = 0;
+	ei->i_merkel_gen = 0;
+	ei->i_merkel_busy = 0;
+	ei->i_merkel_root_dirty = 0;
+	ei->i_merkel_root_folded = 1;
+	ei->i_merkel_epoch = 0;
 	return &ei->vfs_inode;
 }
 
@@ -965,6 +988,9 @@ static void init_once(void *foo)
 	init_rwsem(&ei->xattr_sem);
 	init_rwsem(&ei->i_data_sem);
 	init_rwsem(&ei->i_mmap_sem);
+	mutex_init(&ei->i_merkel_mutex);
+	seqcount_init(&ei->i_merkel_seq);
+	spin_lock_init(&ei->i_merkel_mmap_lock);
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -1007,6 +1033,13 @@ void ext42_clear_inode(struct inode *inode)
 	if (EXT4_I(inode)->i_crypt_info)
 		ext42_free_encryption_info(inode, EXT4_I(inode)->i_crypt_info);
 #endif
+	cancel_delayed_work_sync(&EXT4_I(inode)->i_merkel_work);
+	/* Taken so that the Merkle shrinker is done with the inode */
+	mutex_lock(&EXT4_I(inode)->i_merkel_mutex);
+	ext42_merkel_drop(inode);
+	mutex_unlock(&EXT4_I(inode)->i_merkel_mutex);
+	/* Off s_merkel_list, ext42_merkel_sync_fs() can no longer queue it */
+	cancel_delayed_work_sync(&EXT4_I(inode)->i_merkel_save_work);
 }
 
 static struct inode *ext42_nfs_get_inode(struct super_block *sb,
@@ -1169,6 +1202,8 @@ enum {
 	Opt_dioread_nolock, Opt_dioread_lock,
 	Opt_discard, Opt_nodiscard, Opt_init_itable, Opt_noinit_itable,
 	Opt_max_dir_size_kb, Opt_nojournal_checksum,
+	Opt_merkel_hash, Opt_merkel_hash_size, Opt_merkel_fanout,
+	Opt_merkel_writeback, Opt_nomerkel_writeback,
 };
 
 static const match_table_t tokens = {
@@ -1248,6 +1283,11 @@ static const match_table_t tokens = {
 	{Opt_init_itable, "init_itable"},
 	{Opt_noinit_itable, "noinit_itable"},
 	{Opt_max_dir_size_kb, "max_dir_size_kb=%u"},
+	{Opt_merkel_hash, "merkel_hash=%s"},
+	{Opt_merkel_hash_size, "merkel_hash_size=%u"},
+	{Opt_merkel_fanout, "merkel_fanout=%u"},
+	{Opt_merkel_writeback, "merkel_writeback"},
+	{Opt_nomerkel_writeback, "nomerkel_writeback"},
 	{Opt_test_dummy_encryption, "test_dummy_encryption"},
 	{Opt_removed, "check=none"},	/* mount option from ext2/3 */
 	{Opt_removed, "nocheck"},	/* mount option from ext2/3 */
@@ -1450,6 +1490,11 @@ static const struct mount_opts {
 	{Opt_jqfmt_vfsv0, QFMT_VFS_V0, MOPT_QFMT},
 	{Opt_jqfmt_vfsv1, QFMT_VFS_V1, MOPT_QFMT},
 	{Opt_max_dir_size_kb, 0, MOPT_GTE0},
+	{Opt_merkel_hash, 0, MOPT_STRING},
+	{Opt_merkel_hash_size, 0, MOPT_GTE0},
+	{Opt_merkel_fanout, 0, MOPT_GTE0},
+	{Opt_merkel_writeback, EXT4_MOUNT_MERKEL_WRITEBACK, MOPT_SET},
+	{Opt_nomerkel_writeback, EXT4_MOUNT_MERKEL_WRITEBACK, MOPT_CLEAR},
 	{Opt_test_dummy_encryption, 0, MOPT_GTE0},
 	{Opt_err, 0, 0}
 };
@@ -1571,6 +1616,40 @@ static int handle_mount_opt(struct super_block *sb, char *opt, int token,
 		sbi->s_li_wait_mult = arg;
 	} else if (token == Opt_max_dir_size_kb) {
 		sbi->s_max_dir_size_kb = arg;
+	} else if (token == Opt_merkel_hash) {
+		char *name;
+		int alg;
+
+		name = match_strdup(&args[0]);
+		if (!name)
+			return -1;
+		alg = ext42_merkel_parse_hash(name);
+		if (alg < 0) {
+			ext42_msg(sb, KERN_ERR, "Unknown merkel_hash %s", name);
+			kfree(name);
+			return -1;
+		}
+		kfree(name);
+		if (is_remount && alg != sbi->s_merkel_alg) {
+			ext42_msg(sb, KERN_ERR,
+				 "Cannot change merkel_hash on remount");
+			return -1;
+		}
+		sbi->s_merkel_alg = alg;
+	} else if (token == Opt_merkel_hash_size) {
+		if (is_remount && arg != sbi->s_merkel_hash_size) {
+			ext42_msg(sb, KERN_ERR,
+				 "Cannot change merkel_hash_size on remount");
+			return -1;
+		}
+		sbi->s_merkel_hash_size = arg;
+	} else if (token == Opt_merkel_fanout) {
+		if (is_remount && arg != sbi->s_merkel_fanout) {
+			ext42_msg(sb, KERN_ERR,
+				 "Cannot change merkel_fanout on remount");
+			return -1;
+		}
+		sbi->s_merkel_fanout = arg;
 	} else if (token == Opt_stripe) {
 		sbi->s_stripe = arg;
 	} else if (token == Opt_resuid) {
@@ -1909,6 +1988,13 @@ static int _ext42_show_options(struct seq_file *seq, struct super_block *sb,
 		SEQ_OPTS_PRINT("init_itable=%u", sbi->s_li_wait_mult);
 	if (nodefs || sbi->s_max_dir_size_kb)
 		SEQ_OPTS_PRINT("max_dir_size_kb=%u", sbi->s_max_dir_size_kb);
+	if (nodefs || sbi->s_merkel_alg != EXT42_MERKEL_HASH_CRC32C)
+		SEQ_OPTS_PRINT("merkel_hash=%s",
+			       ext42_merkel_hash_name(sbi->s_merkel_alg));
+	if (nodefs || sbi->s_merkel_hash_size)
+		SEQ_OPTS_PRINT("merkel_hash_size=%u", sbi->s_merkel_hash_size);
+	if (nodefs || sbi->s_merkel_fanout)
+		SEQ_OPTS_PRINT("merkel_fanout=%u", sbi->s_merkel_fanout);
 
 	ext42_show_quota_options(seq, sb);
 	return 0;
@@ -3417,6 +3503,9 @@ static int ext42_fill_super(struct super_block *sb, void *data, int silent)
 			   &journal_ioprio, 0))
 		goto failed_mount;
 
+	if (ext42_merkel_init_sb(sb))
+		goto failed_mount;
+
 	if (test_opt(sb, DATA_FLAGS) == EXT4_MOUNT_JOURNAL_DATA) {
 		printk_once(KERN_WARNING "EXT4-fs: Warning: mounting "
 			    "with data=journal disables delayed "
@@ -3813,6 +3902,12 @@ static int ext42_fill_super(struct super_block *sb, void *data, int silent)
 
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
+	atomic64_set(&sbi->s_merkel_version, ktime_get_real_ns());
+	for (i = 0; i < ARRAY_SIZE(sbi->s_merkel_dir_locks); i++)
+		spin_lock_init(&sbi->s_merkel_dir_locks[i]);
+	atomic_set(&sbi->s_merkel_dirs, 0);
+	atomic_set(&sbi->s_merkel_dir_epoch, 0);
+	mutex_init(&sbi->s_merkel_dups_mutex);
 
 	setup_timer(&sbi->s_err_report, print_daily_error_info,
 		(unsigned long) sb);
@@ -3821,6 +3916,10 @@ static int ext42_fill_super(struct super_block *sb, void *data, int silent)
 	if (ext42_es_register_shrinker(sbi))
 		goto failed_mount3;
 
+	/* And the one discarding cold Merkle trees */
+	if (ext42_merkel_register_shrinker(sbi))
+		goto failed_mount3b;
+
 	sbi->s_stripe = ext42_get_stripe_size(sbi);
 	sbi->s_extent_max_zeroout_kb = 32;
 
@@ -3984,6 +4083,24 @@ no_journal:
 		goto failed_mount4;
 	}
 
+	/* Merkle tree rehashing, deferred so that writes to a block coalesce */
+	EXT4_SB(sb)->s_merkel_wq =
+		alloc_workqueue("ext42-merkel", WQ_UNBOUND, 0);
+	if (!EXT4_SB(sb)->s_merkel_wq) {
+		printk(KERN_ERR "EXT4-fs: failed to create workqueue\n");
+		ret = -ENOMEM;
+		goto failed_mount4;
+	}
+
+	/* Pages read from files with verified reads on, see merkel.c */
+	EXT4_SB(sb)->s_merkel_verify_wq =
+		alloc_workqueue("ext42-merkel-verify", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!EXT4_SB(sb)->s_merkel_verify_wq) {
+		printk(KERN_ERR "EXT4-fs: failed to create workqueue\n");
+		ret = -ENOMEM;
+		goto failed_mount4;
+	}
+
 	/*
 	 * The jbd2_journal_load will have done any necessary log recovery,
 	 * so we can safely mount the rest of the filesystem now.
@@ -4173,6 +4290,10 @@ failed_mount4:
 	ext42_msg(sb, KERN_ERR, "mount failed");
 	if (EXT4_SB(sb)->rsv_conversion_wq)
 		destroy_workqueue(EXT4_SB(sb)->rsv_conversion_wq);
+	if (EXT4_SB(sb)->s_merkel_wq)
+		destroy_workqueue(EXT4_SB(sb)->s_merkel_wq);
+	if (EXT4_SB(sb)->s_merkel_verify_wq)
+		destroy_workqueue(EXT4_SB(sb)->s_merkel_verify_wq);
 failed_mount_wq:
 	if (sbi->s_mb_cache) {
 		ext42_xattr_destroy_cache(sbi->s_mb_cache);
@@ -4183,6 +4304,8 @@ failed_mount_wq:
 		sbi->s_journal = NULL;
 	}
 failed_mount3a:
+	ext42_merkel_unregister_shrinker(sbi);
+failed_mount3b:
 	ext42_es_unregister_shrinker(sbi);
 failed_mount3:
 	del_timer_sync(&sbi->s_err_report);
@@ -4193,6 +4316,7 @@ failed_mount2:
 		brelse(sbi->s_group_desc[i]);
 	kvfree(sbi->s_group_desc);
 failed_mount:
+	ext42_merkel_release_sb(sb);
 	if (sbi->s_chksum_driver)
 		crypto_free_shash(sbi->s_chksum_driver);
 #ifdef CONFIG_QUOTA
@@ -4635,6 +4759,7 @@ static int ext42_sync_fs(struct super_block *sb, int wait)
 
 	trace_ext42_sync_fs(sb, wait);
 	flush_workqueue(sbi->rsv_conversion_wq);
+	ext42_merkel_sync_fs(sb, wait);
 	/*
 	 * Writeback quota in non-journalled quota case - journalled quota has
 	 * no dirty dquots
@@ -5486,10 +5611,14 @@ static int __init ext42_init_fs(void)
 	if (err)
 		goto out4;
 
-	err = ext42_init_sysfs();
+	err = ext42_init_debug();
 	if (err)
 		goto out3;
 
+	err = ext42_init_sysfs();
+	if (err)
+		goto out_debug;
+
 	err = ext42_init_mballoc();
 	if (err)
 		goto out2;
@@ -5511,6 +5640,8 @@ out1:
 	ext42_exit_mballoc();
 out2:
 	ext42_exit_sysfs();
+out_debug:
+	ext42_exit_debug();
 out3:
 	ext42_exit_system_zone();
 out4:
@@ -5531,6 +5662,7 @@ static void __exit ext42_exit_fs(void)
 	destroy_inodecache();
 	ext42_exit_mballoc();
 	ext42_exit_sysfs();
+	ext42_exit_debug();
 	ext42_exit_system_zone();
 	ext42_exit_pageio();
 	ext42_exit_es();
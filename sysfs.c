@@ -26,6 +26,9 @@ typedef enum {
 	attr_feature,
 	attr_pointer_ui,
 	attr_pointer_atomic,
+	attr_pointer_atomic64,
+	attr_merkel_kb,
+	attr_debug,
 } attr_id_t;
 
 typedef enum {
@@ -187,6 +190,21 @@ EXT4_RW_ATTR_SBI_UI(msg_ratelimit_burst, s_msg_ratelimit_state.burst);
 EXT4_RO_ATTR_ES_UI(errors_count, s_error_count);
 EXT4_RO_ATTR_ES_UI(first_error_time, s_first_error_time);
 EXT4_RO_ATTR_ES_UI(last_error_time, s_last_error_time);
+EXT4_ATTR_FUNC(merkel_kb, 0444);
+EXT4_RW_ATTR_SBI_UI(merkel_max_kb, s_merkel_max_kb);
+EXT4_ATTR_OFFSET(merkel_trees, 0444, pointer_ui, ext42_sb_info, s_merkel_nr_trees);
+EXT4_ATTR_OFFSET(merkel_shrunk, 0444, pointer_ui, ext42_sb_info, s_merkel_shrunk);
+EXT4_ATTR_OFFSET(merkel_flushes, 0444, pointer_atomic64, ext42_sb_info, s_merkel_flushes);
+EXT4_ATTR_OFFSET(merkel_flush_ns, 0444, pointer_atomic64, ext42_sb_info, s_merkel_flush_ns);
+EXT4_ATTR_OFFSET(merkel_builds, 0444, pointer_atomic64, ext42_sb_info, s_merkel_builds);
+EXT4_ATTR_OFFSET(merkel_build_ns, 0444, pointer_atomic64, ext42_sb_info, s_merkel_build_ns);
+EXT4_ATTR_OFFSET(merkel_hashed_blocks, 0444, pointer_atomic64, ext42_sb_info, s_merkel_hashed_blocks);
+EXT4_ATTR_OFFSET(merkel_hashed_bytes, 0444, pointer_atomic64, ext42_sb_info, s_merkel_hashed_bytes);
+EXT4_ATTR_OFFSET(merkel_hashed_nodes, 0444, pointer_atomic64, ext42_sb_info, s_merkel_hashed_nodes);
+EXT4_ATTR_OFFSET(merkel_alloc_bytes, 0444, pointer_atomic64, ext42_sb_info, s_merkel_alloc_bytes);
+EXT4_ATTR_OFFSET(merkel_freed_bytes, 0444, pointer_atomic64, ext42_sb_info, s_merkel_freed_bytes);
+EXT4_ATTR_OFFSET(merkel_verify_refused, 0444, pointer_atomic64, ext42_sb_info, s_merkel_verify_refused);
+EXT4_ATTR_OFFSET(merkel_verify_skipped, 0444, pointer_atomic64, ext42_sb_info, s_merkel_verify_skipped);
 
 static unsigned int old_bump_val = 128;
 EXT4_ATTR_PTR(max_writeback_mb_bump, 0444, pointer_ui, &old_bump_val);
@@ -216,6 +234,33 @@ static struct attribute *ext42_attrs[] = {
 	ATTR_LIST(errors_count),
 	ATTR_LIST(first_error_time),
 	ATTR_LIST(last_error_time),
+	ATTR_LIST(merkel_kb),
+	ATTR_LIST(merkel_max_kb),
+	ATTR_LIST(merkel_trees),
+	ATTR_LIST(merkel_shrunk),
+	ATTR_LIST(merkel_flushes),
+	ATTR_LIST(merkel_flush_ns),
+	ATTR_LIST(merkel_builds),
+	ATTR_LIST(merkel_build_ns),
+	ATTR_LIST(merkel_hashed_blocks),
+	ATTR_LIST(merkel_hashed_bytes),
+	ATTR_LIST(merkel_hashed_nodes),
+	ATTR_LIST(merkel_alloc_bytes),
+	ATTR_LIST(merkel_freed_bytes),
+	ATTR_LIST(merkel_verify_refused),
+	ATTR_LIST(merkel_verify_skipped),
+	NULL,
+};
+
+/* Debug messages by subsystem, see D() */
+EXT4_ATTR_PTR(file, 0644, debug, &ext42_dbg_keys[EXT42_DBG_FILE]);
+EXT4_ATTR_PTR(namei, 0644, debug, &ext42_dbg_keys[EXT42_DBG_NAMEI]);
+EXT4_ATTR_PTR(merkel, 0644, debug, &ext42_dbg_keys[EXT42_DBG_MERKEL]);
+
+static struct attribute *ext42_debug_attrs[] = {
+	ATTR_LIST(file),
+	ATTR_LIST(namei),
+	ATTR_LIST(merkel),
 	NULL,
 };
 
@@ -273,6 +318,9 @@ static ssize_t ext42_attr_show(struct kobject *kobj,
 		return snprintf(buf, PAGE_SIZE, "%llu\n",
 				(unsigned long long)
 				atomic64_read(&sbi->s_resv_clusters));
+	case attr_merkel_kb:
+		return snprintf(buf, PAGE_SIZE, "%lld\n",
+		       percpu_counter_sum_positive(&sbi->s_merkel_bytes) >> 10);
 	case attr_inode_readahead:
 	case attr_pointer_ui:
 		if (!ptr)
@@ -288,8 +336,16 @@ static ssize_t ext42_attr_show(struct kobject *kobj,
 			return 0;
 		return snprintf(buf, PAGE_SIZE, "%d\n",
 				atomic_read((atomic_t *) ptr));
+	case attr_pointer_atomic64:
+		if (!ptr)
+			return 0;
+		return snprintf(buf, PAGE_SIZE, "%lld\n",
+				(long long) atomic64_read((atomic64_t *) ptr));
 	case attr_feature:
 		return snprintf(buf, PAGE_SIZE, "supported\n");
+	case attr_debug:
+		return snprintf(buf, PAGE_SIZE, "%d\n",
+				static_key_enabled((struct static_key_false *) ptr));
 	}
 
 	return 0;
@@ -324,6 +380,15 @@ static ssize_t ext42_attr_store(struct kobject *kobj,
 		return inode_readahead_blks_store(a, sbi, buf, len);
 	case attr_trigger_test_error:
 		return trigger_test_error(a, sbi, buf, len);
+	case attr_debug:
+		ret = kstrtoul(skip_spaces(buf), 0, &t);
+		if (ret)
+			return ret;
+		if (t)
+			static_branch_enable((struct static_key_false *) ptr);
+		else
+			static_branch_disable((struct static_key_false *) ptr);
+		return len;
 	}
 	return 0;
 }
@@ -363,6 +428,15 @@ static struct kobject ext42_feat = {
 	.kset	= &ext42_kset,
 };
 
+static struct kobj_type ext42_debug_ktype = {
+	.default_attrs	= ext42_debug_attrs,
+	.sysfs_ops	= &ext42_attr_ops,
+};
+
+static struct kobject ext42_debug = {
+	.kset	= &ext42_kset,
+};
+
 #define PROC_FILE_SHOW_DEFN(name) \
 static int name##_open(struct inode *inode, struct file *file) \
 { \
@@ -443,16 +517,34 @@ int __init ext42_init_sysfs(void)
 	ret = kobject_init_and_add(&ext42_feat, &ext42_feat_ktype,
 				   NULL, "features");
 	if (ret)
-		kset_unregister(&ext42_kset);
-	else
-		ext42_proc_root = proc_mkdir(proc_dirname, NULL);
+		goto out_kset;
+
+	ret = kobject_init_and_add(&ext42_debug, &ext42_debug_ktype,
+				   NULL, "debug");
+	if (ret)
+		goto out_feat;
+
+	ext42_proc_root = proc_mkdir(proc_dirname, NULL);
+	if (ext42_proc_root)
+		proc_create("debug_log", S_IRUSR, ext42_proc_root,
+			    &ext42_seq_debug_log_fops);
+	return 0;
+
+out_feat:
+	kobject_put(&ext42_debug);
+	kobject_put(&ext42_feat);
+out_kset:
+	kset_unregister(&ext42_kset);
 	return ret;
 }
 
 void ext42_exit_sysfs(void)
 {
+	kobject_put(&ext42_debug);
 	kobject_put(&ext42_feat);
 	kset_unregister(&ext42_kset);
+	if (ext42_proc_root)
+		remove_proc_entry("debug_log", ext42_proc_root);
 	remove_proc_entry(proc_dirname, NULL);
 	ext42_proc_root = NULL;
 }
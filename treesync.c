@@ -0,0 +1,1132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BLOCKSIZE 4096
+#define HASH_CRC32C 0
+#define DIGEST_SIZE 32
+
+typedef struct ext42_merkel_export{
+    unsigned int mode;
+    unsigned int level;
+    unsigned int index;
+    unsigned int count;
+    unsigned int total;
+    unsigned int nbLeaves;
+    unsigned int depth;
+    unsigned short hashAlg;
+    unsigned short hashSize;
+    unsigned int fanout;
+    unsigned int reserved;
+    unsigned long long version;
+    unsigned long long buf;
+}ext42_merkel_export;
+#define EXT4_IOC_GETTREE_BULK _IOWR('f',23, struct ext42_merkel_export)
+#define EXPORT_LEVEL 0
+#define EXPORT_MAX (1 << 20)
+
+typedef struct ext42_merkel_root{
+    unsigned char root[32];
+    unsigned long long generation;
+    unsigned long long iVersion;
+    unsigned long long size;
+    unsigned int nbLeaves;
+    unsigned short hashAlg;
+    unsigned short hashSize;
+    unsigned int fanout;
+    unsigned int reserved;
+}ext42_merkel_root;
+#define EXT4_IOC_GETROOT _IOR('f',27, struct ext42_merkel_root)
+
+//a file's tree once exported : this header, then every level from the
+//leaves up, in host byte order
+#define TREE_MAGIC "EXT42TRE"
+typedef struct treeHeader{
+    char magic[8];
+    unsigned short hashAlg;
+    unsigned short hashSize;
+    unsigned int fanout;
+    unsigned int depth;
+    unsigned int nbLeaves;
+    unsigned long long size;
+    unsigned long long version;
+}treeHeader;
+
+typedef struct tree{
+    treeHeader hdr;
+    unsigned int counts[33];
+    unsigned char* levels[33];
+}tree;
+
+//a delta : this header, then runs of blocks each followed by their data,
+//every block followed by its SHA-256, the last block of the file being
+//short, and an end run once complete.  It only applies to a file still
+//matching the peer tree it was computed against, and the root of the
+//result is checked against the source's.  Trees hashed with crc32c or
+//less than 8 bytes may take differing blocks for equal ones, the delta
+//then carries the SHA-256 of the whole source, checked once applied
+#define DELTA_MAGIC "EXT42DL2"
+#define DELTA_END UINT64_MAX
+#define DELTA_ROOT 0x1
+#define DELTA_DIGEST 0x2
+typedef struct deltaHeader{
+    char magic[8];
+    unsigned long long size;
+    unsigned int blockSize;
+    unsigned int flags;                 //DELTA_ROOT if root is comparable
+    unsigned short hashAlg;             //kind of the peer tree
+    unsigned short hashSize;
+    unsigned int reserved;
+    unsigned long long peerVersion;     //me_version the peer tree was exported at
+    unsigned long long peerSize;
+    unsigned char peerRoot[32];
+    unsigned char root[32];             //root of the source file
+    unsigned char digest[DIGEST_SIZE];  //SHA-256 of the source if DELTA_DIGEST
+}deltaHeader;
+
+typedef struct deltaRun{
+    unsigned long long block;
+    unsigned int count;
+    unsigned int reserved;
+}deltaRun;
+
+//content defined chunks, for files shifted by an insertion or a deletion :
+//boundaries depend on the bytes around them, not on their offset, so an
+//edit only changes the chunks it touches.  Cut as cmp -c does
+#define CHUNK_MIN 2048
+#define CHUNK_AVG 8192
+#define CHUNK_MAX 65536
+#define CHUNK_MASK_SMALL 0x0000d9f003530000ULL
+#define CHUNK_MASK_LARGE 0x0000d90003530000ULL
+
+//a signature : this header, then the length and SHA-256 of every chunk of
+//the file in order
+#define SIG_MAGIC "EXT42SIG"
+typedef struct sigHeader{
+    char magic[8];
+    unsigned long long size;
+    unsigned long long count;
+}sigHeader;
+
+typedef struct sigChunk{
+    unsigned int len;
+    unsigned int reserved;
+    unsigned char digest[DIGEST_SIZE];
+}sigChunk;
+
+//a chunked delta : this header, then ops rebuilding the source from chunks
+//of the peer's file and literal data, up to an end op.  Every op carries
+//the SHA-256 of the chunk it produces, so a copy is checked against what
+//the peer's file holds before being used
+#define CDELTA_MAGIC "EXT42CDL"
+#define CHUNK_END  0
+#define CHUNK_COPY 1
+#define CHUNK_DATA 2
+typedef struct chunkDeltaHeader{
+    char magic[8];
+    unsigned long long size;
+    unsigned long long peerSize;
+    unsigned char digest[DIGEST_SIZE];  //SHA-256 of the source
+}chunkDeltaHeader;
+
+typedef struct chunkOp{
+    unsigned int type;
+    unsigned int len;
+    unsigned long long off;             //in the peer's file, for CHUNK_COPY
+    unsigned char digest[DIGEST_SIZE];
+}chunkOp;
+
+//the chunks of a signature, found by digest through open addressing
+typedef struct peerChunks{
+    sigChunk* items;
+    unsigned long long* offs;
+    size_t count;
+    long long* slots;
+    size_t nbSlots;
+}peerChunks;
+
+uint64_t gear[256];
+
+//growable array of runs, appends are amortized O(1)
+typedef struct runs{
+    deltaRun* items;
+    size_t count;
+    size_t capacity;
+}runs;
+
+//------------------------------------
+//------------------------------------
+//        Utils
+//------------------------------------
+//------------------------------------
+
+FILE* openStream(char* name, const char* mode)
+{
+    //"-" is stdin or stdout, so that the tree and delta can go through pipes
+    if(!strcmp(name, "-"))
+        return mode[0] == 'r' ? stdin : stdout;
+    FILE* f = fopen(name, mode);
+    if(!f)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+void closeStream(FILE* f)
+{
+    if(f != stdin && f != stdout)
+        fclose(f);
+    else if(f == stdout && fflush(f))
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void readAll(FILE* f, void* buf, size_t len)
+{
+    if(len && fread(buf, 1, len, f) != len)
+    {
+        fprintf(stderr,"error : truncated input\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void writeAll(FILE* f, const void* buf, size_t len)
+{
+    if(len && fwrite(buf, 1, len, f) != len)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void freeTree(tree* t)
+{
+    for(unsigned int l = 0;l <= t->hdr.depth;l++)
+        free(t->levels[l]);
+}
+
+void getCounts(tree* t)
+{
+    //number of nodes per level, i.e. ceil(nbLeaves / fanout^level)
+    for(unsigned int l = 0;l <= t->hdr.depth;l++)
+    {
+        t->counts[l] = t->hdr.nbLeaves;
+        for(unsigned int k = 0;k < l;k++)
+            t->counts[l] = (t->counts[l]+t->hdr.fanout-1)/t->hdr.fanout;
+    }
+}
+
+//------------------------------------
+//------------------------------------
+//        SHA-256
+//------------------------------------
+//------------------------------------
+
+//what the tree hashes are too weak to vouch for is checked with SHA-256
+typedef struct sha256{
+    uint32_t state[8];
+    unsigned char block[64];
+    uint64_t length;
+    size_t used;
+}sha256;
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+void sha256Block(sha256* c, const unsigned char* p)
+{
+    uint32_t w[64], v[8];
+    for(int i = 0;i < 16;i++)
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for(int i = 16;i < 64;i++)
+        w[i] = w[i-16]+w[i-7]+(ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3))+
+               (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+    //v[0..7] are a..h, shifted down one place per round
+    memcpy(v, c->state, sizeof(v));
+    for(int i = 0;i < 64;i++)
+    {
+        uint32_t t1 = v[7]+(ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25))+
+                      ((v[4] & v[5]) ^ (~v[4] & v[6]))+sha256K[i]+w[i];
+        uint32_t t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22))+
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v+1, v, 7*sizeof(uint32_t));
+        v[4] += t1;
+        v[0]  = t1+t2;
+    }
+    for(int i = 0;i < 8;i++)
+        c->state[i] += v[i];
+}
+
+void sha256Init(sha256* c)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->state, iv, sizeof(iv));
+    c->length = 0;
+    c->used   = 0;
+}
+
+void sha256Update(sha256* c, const void* data, size_t len)
+{
+    const unsigned char* p = data;
+    c->length += len;
+    while(len)
+    {
+        size_t n = 64-c->used < len ? 64-c->used : len;
+        memcpy(c->block+c->used, p, n);
+        c->used += n;
+        p       += n;
+        len     -= n;
+        if(c->used == 64)
+        {
+            sha256Block(c, c->block);
+            c->used = 0;
+        }
+    }
+}
+
+void sha256Final(sha256* c, unsigned char* out)
+{
+    //0x80, zeroes up to 56 bytes mod 64, then the length in bits big endian
+    uint64_t bits = c->length*8;
+    unsigned char pad = 0x80, zero = 0, len[8];
+    sha256Update(c, &pad, 1);
+    while(c->used != 56)
+        sha256Update(c, &zero, 1);
+    for(int i = 0;i < 8;i++)
+        len[i] = bits >> (56-8*i);
+    sha256Update(c, len, 8);
+    for(int i = 0;i < DIGEST_SIZE;i++)
+        out[i] = c->state[i/4] >> (24-8*(i%4));
+}
+
+void sha256Data(const void* data, size_t len, unsigned char* out)
+{
+    sha256 c;
+    sha256Init(&c);
+    sha256Update(&c, data, len);
+    sha256Final(&c, out);
+}
+
+void sha256File(int fd, char* filename, unsigned long long size, unsigned char* out)
+{
+    unsigned char* buf = malloc(BLOCKSIZE);
+    sha256 c;
+    sha256Init(&c);
+    for(unsigned long long off = 0;off < size;off += BLOCKSIZE)
+    {
+        size_t len = size-off < BLOCKSIZE ? size-off : BLOCKSIZE;
+        if(pread(fd, buf, len, off) != (ssize_t)len)
+        {
+            perror(filename);
+            exit(EXIT_FAILURE);
+        }
+        sha256Update(&c, buf, len);
+    }
+    sha256Final(&c, out);
+    free(buf);
+}
+
+//------------------------------------
+//------------------------------------
+//          GETTING TREES
+//------------------------------------
+//------------------------------------
+
+void exportLevel(int fd, ext42_merkel_export* exp, unsigned int level, unsigned int index, unsigned char* buf, unsigned int count)
+{
+    exp->mode  = EXPORT_LEVEL;
+    exp->level = level;
+    exp->index = index;
+    exp->count = count;
+    exp->buf   = (unsigned long long)(unsigned long)buf;
+
+    if (ioctl(fd, EXT4_IOC_GETTREE_BULK, exp))
+    {
+        perror("ioctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int getLevels(int fd, tree* t)
+{
+    //get tree size
+    ext42_merkel_export exp;
+    struct stat st;
+    exportLevel(fd, &exp, 0, 0, NULL, 0);
+    if(fstat(fd, &st))
+    {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(t->hdr.magic, TREE_MAGIC, 8);
+    t->hdr.hashAlg  = exp.hashAlg;
+    t->hdr.hashSize = exp.hashSize;
+    t->hdr.fanout   = exp.fanout;
+    t->hdr.depth    = exp.depth;
+    t->hdr.nbLeaves = exp.nbLeaves;
+    t->hdr.size     = st.st_size;
+    t->hdr.version  = exp.version;
+    getCounts(t);
+
+    //get each level, up to EXPORT_MAX hashes per call
+    for(unsigned int l = 0;l <= t->hdr.depth;l++)
+    {
+        t->levels[l] = malloc((size_t)t->hdr.hashSize*t->counts[l]);
+        for(unsigned int i = 0;i < t->counts[l];i += exp.count)
+        {
+            exportLevel(fd, &exp, l, i, t->levels[l]+(size_t)i*t->hdr.hashSize, t->counts[l]-i < EXPORT_MAX ? t->counts[l]-i : EXPORT_MAX);
+            if(exp.version != t->hdr.version || exp.count == 0)
+                break;
+        }
+
+        //tree modified between two calls : start over
+        if(exp.version != t->hdr.version || exp.count == 0)
+        {
+            t->hdr.depth = l;
+            freeTree(t);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+unsigned long long getVersion(int fd)
+{
+    ext42_merkel_export exp;
+    exportLevel(fd, &exp, 0, 0, NULL, 0);
+    return exp.version;
+}
+
+void getRoot(int fd, char* filename, ext42_merkel_root* r)
+{
+    if(ioctl(fd, EXT4_IOC_GETROOT, r))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void readTree(FILE* f, tree* t)
+{
+    readAll(f, &t->hdr, sizeof(t->hdr));
+    if(memcmp(t->hdr.magic, TREE_MAGIC, 8) || t->hdr.depth > 32 || t->hdr.fanout < 2 ||
+       t->hdr.hashSize == 0 || t->hdr.hashSize > 32)
+    {
+        fprintf(stderr,"error : not an exported tree\n");
+        exit(EXIT_FAILURE);
+    }
+    getCounts(t);
+    for(unsigned int l = 0;l <= t->hdr.depth;l++)
+    {
+        t->levels[l] = malloc((size_t)t->hdr.hashSize*t->counts[l]);
+        readAll(f, t->levels[l], (size_t)t->hdr.hashSize*t->counts[l]);
+    }
+}
+
+void writeTree(FILE* f, tree* t)
+{
+    writeAll(f, &t->hdr, sizeof(t->hdr));
+    for(unsigned int l = 0;l <= t->hdr.depth;l++)
+        writeAll(f, t->levels[l], (size_t)t->hdr.hashSize*t->counts[l]);
+}
+
+//----------------------------------------
+//----------------------------------------
+//          comparison operations
+//----------------------------------------
+//----------------------------------------
+
+void runs_append(runs* r, unsigned long long block, unsigned int count)
+{
+    //blocks come in order, extend the last run when contiguous
+    if(r->count && r->items[r->count-1].block+r->items[r->count-1].count == block)
+    {
+        r->items[r->count-1].count += count;
+        return;
+    }
+    if(r->count == r->capacity)
+    {
+        r->capacity = r->capacity ? 2*r->capacity : 1024;
+        r->items = realloc(r->items, sizeof(deltaRun)*r->capacity);
+        if(!r->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    deltaRun* d = &r->items[r->count++];
+    d->block    = block;
+    d->count    = count;
+    d->reserved = 0;
+}
+
+void diffNode(tree* local, tree* peer, unsigned int level, unsigned int pos, runs* r)
+{
+    //same subtree on both sides, nothing to send
+    size_t hs = local->hdr.hashSize;
+    if(pos < peer->counts[level] && !memcmp(local->levels[level]+pos*hs, peer->levels[level]+pos*hs, hs))
+        return;
+
+    if(level == 0)
+    {
+        runs_append(r, pos, 1);
+        return;
+    }
+
+    //only the blocks the local file has, the peer truncates the others
+    unsigned int first = pos*local->hdr.fanout;
+    unsigned int last  = first+local->hdr.fanout < local->counts[level-1] ? first+local->hdr.fanout : local->counts[level-1];
+    for(unsigned int i = first;i < last;i++)
+        diffNode(local, peer, level-1, i, r);
+}
+
+int weakTree(tree* t)
+{
+    //32-bit hashes collide too often to tell blocks apart on their own
+    return t->hdr.hashAlg == HASH_CRC32C || t->hdr.hashSize < 8;
+}
+
+void getRuns(tree* local, tree* peer, runs* r)
+{
+    //hashes are only comparable between trees of the same kind
+    if(local->hdr.hashAlg != peer->hdr.hashAlg || local->hdr.hashSize != peer->hdr.hashSize ||
+       local->hdr.fanout != peer->hdr.fanout)
+    {
+        fprintf(stderr,"warning : trees of different kinds, sending the whole file\n");
+        runs_append(r, 0, local->hdr.nbLeaves);
+        return;
+    }
+
+    //node j of a level covers the same blocks in both trees, start from
+    //the highest level they have in common
+    unsigned int top = local->hdr.depth < peer->hdr.depth ? local->hdr.depth : peer->hdr.depth;
+    for(unsigned int j = 0;j < local->counts[top];j++)
+        diffNode(local, peer, top, j, r);
+}
+
+//----------------------------------------
+//----------------------------------------
+//          content defined chunking
+//----------------------------------------
+//----------------------------------------
+
+void initGear(void)
+{
+    //fixed seed, both sides must cut with the same table
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for(int i = 0;i < 256;i++)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cutPoint(const unsigned char* data, size_t len)
+{
+    //gear rolling hash, a stricter mask before CHUNK_AVG and a looser one
+    //after keeps chunk sizes close to the average
+    if(len <= CHUNK_MIN)
+        return len;
+    if(len > CHUNK_MAX)
+        len = CHUNK_MAX;
+    size_t avg = len < CHUNK_AVG ? len : CHUNK_AVG;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+    for(;i < avg;i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if(!(h & CHUNK_MASK_SMALL))
+            return i+1;
+    }
+    for(;i < len;i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if(!(h & CHUNK_MASK_LARGE))
+            return i+1;
+    }
+    return len;
+}
+
+unsigned char* mapFile(int fd, char* filename, unsigned long long size)
+{
+    if(!size)
+        return NULL;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+size_t digestSlot(peerChunks* p, const unsigned char* digest)
+{
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key & (p->nbSlots-1);
+}
+
+void readSignature(FILE* f, sigHeader* hdr, peerChunks* p)
+{
+    readAll(f, hdr, sizeof(*hdr));
+    if(memcmp(hdr->magic, SIG_MAGIC, 8) || hdr->count > hdr->size)
+    {
+        fprintf(stderr,"error : not a signature\n");
+        exit(EXIT_FAILURE);
+    }
+    p->count = hdr->count;
+    p->items = malloc(sizeof(sigChunk)*(p->count ? p->count : 1));
+    p->offs  = malloc(sizeof(unsigned long long)*(p->count ? p->count : 1));
+    readAll(f, p->items, sizeof(sigChunk)*p->count);
+
+    unsigned long long off = 0;
+    for(size_t i = 0;i < p->count;i++)
+    {
+        p->offs[i] = off;
+        off += p->items[i].len;
+    }
+    if(off != hdr->size)
+    {
+        fprintf(stderr,"error : signature does not cover its file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //the first of identical chunks is enough to copy from
+    p->nbSlots = 1;
+    while(p->nbSlots < 2*p->count)
+        p->nbSlots <<= 1;
+    p->slots = malloc(sizeof(long long)*p->nbSlots);
+    for(size_t s = 0;s < p->nbSlots;s++)
+        p->slots[s] = -1;
+    for(size_t i = 0;i < p->count;i++)
+    {
+        size_t s = digestSlot(p, p->items[i].digest);
+        for(;p->slots[s] >= 0;s = (s+1) & (p->nbSlots-1))
+            if(!memcmp(p->items[p->slots[s]].digest, p->items[i].digest, DIGEST_SIZE))
+                break;
+        if(p->slots[s] < 0)
+            p->slots[s] = i;
+    }
+}
+
+long long findChunk(peerChunks* p, const unsigned char* digest, unsigned int len)
+{
+    size_t s = digestSlot(p, digest);
+    for(;p->slots[s] >= 0;s = (s+1) & (p->nbSlots-1))
+    {
+        sigChunk* c = &p->items[p->slots[s]];
+        if(c->len == len && !memcmp(c->digest, digest, DIGEST_SIZE))
+            return p->slots[s];
+    }
+    return -1;
+}
+
+//--------------------
+//--------------------
+//        commands
+//--------------------
+//--------------------
+
+int doExport(char* filename, char* out)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    //retry if the file changes meanwhile
+    tree t;
+    while(getLevels(fd, &t));
+    close(fd);
+
+    FILE* f = openStream(out, "w");
+    writeTree(f, &t);
+    closeStream(f);
+    freeTree(&t);
+    return 0;
+}
+
+int doDelta(char* filename, char* peerTree, char* out, int weak)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    //read the peer's tree first, it may come from the same pipe as the output goes to
+    tree peer, local;
+    FILE* in = openStream(peerTree, "r");
+    readTree(in, &peer);
+    closeStream(in);
+    while(getLevels(fd, &local));
+
+    //a differing block whose hash collides would silently stay behind
+    if((weakTree(&local) || weakTree(&peer)) && !weak)
+    {
+        fprintf(stderr,"error : trees of %u-byte hashes cannot vouch for the blocks they skip, "
+                       "use -w to check the whole file once applied\n",
+                local.hdr.hashSize < peer.hdr.hashSize ? local.hdr.hashSize : peer.hdr.hashSize);
+        exit(EXIT_FAILURE);
+    }
+
+    runs r = { NULL, 0, 0 };
+    getRuns(&local, &peer, &r);
+
+    deltaHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DELTA_MAGIC, 8);
+    hdr.size        = local.hdr.size;
+    hdr.blockSize   = BLOCKSIZE;
+    hdr.hashAlg     = peer.hdr.hashAlg;
+    hdr.hashSize    = peer.hdr.hashSize;
+    hdr.peerVersion = peer.hdr.version;
+    hdr.peerSize    = peer.hdr.size;
+    memcpy(hdr.peerRoot, peer.levels[peer.hdr.depth], peer.hdr.hashSize);
+    //the result can only be checked against a root of the same kind
+    if(local.hdr.hashAlg == peer.hdr.hashAlg && local.hdr.hashSize == peer.hdr.hashSize &&
+       local.hdr.fanout == peer.hdr.fanout)
+    {
+        hdr.flags |= DELTA_ROOT;
+        memcpy(hdr.root, local.levels[local.hdr.depth], local.hdr.hashSize);
+    }
+    if(weakTree(&local) || weakTree(&peer))
+    {
+        fprintf(stderr,"warning : weak tree hashes, %s is read whole for its SHA-256\n", filename);
+        hdr.flags |= DELTA_DIGEST;
+        sha256File(fd, filename, hdr.size, hdr.digest);
+    }
+    FILE* f = openStream(out, "w");
+    writeAll(f, &hdr, sizeof(hdr));
+
+    //send each run with its data, clipped to the end of the file
+    unsigned char* buf = malloc(BLOCKSIZE);
+    unsigned char digest[DIGEST_SIZE];
+    for(size_t i = 0;i < r.count;i++)
+    {
+        unsigned long long off = r.items[i].block*BLOCKSIZE;
+        unsigned long long end = off+(unsigned long long)r.items[i].count*BLOCKSIZE;
+        if(off >= hdr.size)
+            continue;
+        if(end > hdr.size)
+            end = hdr.size;
+        r.items[i].count = (end-off+BLOCKSIZE-1)/BLOCKSIZE;
+        writeAll(f, &r.items[i], sizeof(deltaRun));
+        for(;off < end;off += BLOCKSIZE)
+        {
+            size_t len = end-off < BLOCKSIZE ? end-off : BLOCKSIZE;
+            if(pread(fd, buf, len, off) != (ssize_t)len)
+            {
+                perror("pread");
+                exit(EXIT_FAILURE);
+            }
+            writeAll(f, buf, len);
+            sha256Data(buf, len, digest);
+            writeAll(f, digest, DIGEST_SIZE);
+        }
+    }
+    free(buf);
+
+    //no end run if the file changed meanwhile, the delta is then refused
+    if(getVersion(fd) != local.hdr.version)
+    {
+        fprintf(stderr,"error : %s changed during the transfer\n",filename);
+        exit(EXIT_FAILURE);
+    }
+    deltaRun endRun = { DELTA_END, 0, 0 };
+    writeAll(f, &endRun, sizeof(endRun));
+    closeStream(f);
+
+    close(fd);
+    free(r.items);
+    freeTree(&local);
+    freeTree(&peer);
+    return 0;
+}
+
+int sameRoot(ext42_merkel_root* r, unsigned short hashAlg, unsigned short hashSize,
+             unsigned long long size, unsigned char* root)
+{
+    return r->hashAlg == hashAlg && r->hashSize == hashSize && hashSize <= sizeof(r->root) &&
+           r->size == size && !memcmp(r->root, root, hashSize);
+}
+
+int doApply(char* filename, char* delta)
+{
+    int fd = open(filename, O_RDWR);
+    if (fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* in = openStream(delta, "r");
+    deltaHeader hdr;
+    readAll(in, &hdr, sizeof(hdr));
+    if(memcmp(hdr.magic, DELTA_MAGIC, 8) || hdr.blockSize != BLOCKSIZE)
+    {
+        fprintf(stderr,"error : not a delta\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //the runs only turn the tree the delta was computed against into the
+    //source, any other content would be left half updated
+    ext42_merkel_root r;
+    getRoot(fd, filename, &r);
+    if(!sameRoot(&r, hdr.hashAlg, hdr.hashSize, hdr.peerSize, hdr.peerRoot))
+    {
+        fprintf(stderr,"error : %s no longer matches the tree the delta was computed against (version %llu, now %llu)\n",
+                filename, hdr.peerVersion, r.generation);
+        exit(EXIT_FAILURE);
+    }
+
+    //write each block in place once its digest matched, the rest of the
+    //file is kept
+    unsigned char* buf = malloc(BLOCKSIZE);
+    unsigned char digest[DIGEST_SIZE], check[DIGEST_SIZE];
+    deltaRun run;
+    for(readAll(in, &run, sizeof(run));run.block != DELTA_END;readAll(in, &run, sizeof(run)))
+    {
+        unsigned long long off = run.block*BLOCKSIZE;
+        unsigned long long end = off+(unsigned long long)run.count*BLOCKSIZE;
+        if(end > hdr.size)
+            end = hdr.size;
+        for(;off < end;off += BLOCKSIZE)
+        {
+            size_t len = end-off < BLOCKSIZE ? end-off : BLOCKSIZE;
+            readAll(in, buf, len);
+            readAll(in, digest, DIGEST_SIZE);
+            sha256Data(buf, len, check);
+            if(memcmp(digest, check, DIGEST_SIZE))
+            {
+                fprintf(stderr,"error : corrupted delta, block %llu\n", off/BLOCKSIZE);
+                exit(EXIT_FAILURE);
+            }
+            if(pwrite(fd, buf, len, off) != (ssize_t)len)
+            {
+                perror("pwrite");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    free(buf);
+    closeStream(in);
+
+    if(ftruncate(fd, hdr.size) || fsync(fd))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    //the file must now be the source, a concurrent writer would show here
+    getRoot(fd, filename, &r);
+    if((hdr.flags & DELTA_ROOT) && !sameRoot(&r, hdr.hashAlg, hdr.hashSize, hdr.size, hdr.root))
+    {
+        fprintf(stderr,"error : %s does not match the source after applying the delta\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if(hdr.flags & DELTA_DIGEST)
+    {
+        sha256File(fd, filename, hdr.size, check);
+        if(memcmp(check, hdr.digest, DIGEST_SIZE))
+        {
+            fprintf(stderr,"error : %s does not match the source's SHA-256 after applying the delta\n", filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int doSignature(char* filename, char* out)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char* data = mapFile(fd, filename, st.st_size);
+
+    //count the chunks first, the header goes before them
+    sigHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SIG_MAGIC, 8);
+    hdr.size = st.st_size;
+    initGear();
+    for(unsigned long long off = 0;off < hdr.size;hdr.count++)
+        off += cutPoint(data+off, hdr.size-off);
+
+    FILE* f = openStream(out, "w");
+    writeAll(f, &hdr, sizeof(hdr));
+    for(unsigned long long off = 0;off < hdr.size;)
+    {
+        sigChunk c;
+        memset(&c, 0, sizeof(c));
+        c.len = cutPoint(data+off, hdr.size-off);
+        sha256Data(data+off, c.len, c.digest);
+        writeAll(f, &c, sizeof(c));
+        off += c.len;
+    }
+    closeStream(f);
+
+    if(data)
+        munmap(data, hdr.size);
+    close(fd);
+    return 0;
+}
+
+int doChunkDelta(char* filename, char* peerSig, char* out)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st, after;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    //every chunk of the peer is looked up, index them first
+    sigHeader sig;
+    peerChunks peer;
+    FILE* in = openStream(peerSig, "r");
+    readSignature(in, &sig, &peer);
+    closeStream(in);
+
+    unsigned char* data = mapFile(fd, filename, st.st_size);
+    chunkDeltaHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CDELTA_MAGIC, 8);
+    hdr.size     = st.st_size;
+    hdr.peerSize = sig.size;
+    sha256Data(data, hdr.size, hdr.digest);
+    FILE* f = openStream(out, "w");
+    writeAll(f, &hdr, sizeof(hdr));
+
+    //chunks the peer holds anywhere are copied, the others sent
+    initGear();
+    for(unsigned long long off = 0;off < hdr.size;)
+    {
+        chunkOp op;
+        memset(&op, 0, sizeof(op));
+        op.len = cutPoint(data+off, hdr.size-off);
+        sha256Data(data+off, op.len, op.digest);
+        long long m = findChunk(&peer, op.digest, op.len);
+        op.type = m >= 0 ? CHUNK_COPY : CHUNK_DATA;
+        op.off  = m >= 0 ? peer.offs[m] : 0;
+        writeAll(f, &op, sizeof(op));
+        if(m < 0)
+            writeAll(f, data+off, op.len);
+        off += op.len;
+    }
+
+    //no end op if the file changed meanwhile, the delta is then refused
+    if(fstat(fd, &after) || after.st_size != st.st_size ||
+       after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)
+    {
+        fprintf(stderr,"error : %s changed during the transfer\n",filename);
+        exit(EXIT_FAILURE);
+    }
+    chunkOp endOp;
+    memset(&endOp, 0, sizeof(endOp));
+    endOp.type = CHUNK_END;
+    writeAll(f, &endOp, sizeof(endOp));
+    closeStream(f);
+
+    if(data)
+        munmap(data, hdr.size);
+    close(fd);
+    free(peer.items);
+    free(peer.offs);
+    free(peer.slots);
+    return 0;
+}
+
+int doChunkApply(char* filename, char* delta)
+{
+    int fd = open(filename, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* in = openStream(delta, "r");
+    chunkDeltaHeader hdr;
+    readAll(in, &hdr, sizeof(hdr));
+    if(memcmp(hdr.magic, CDELTA_MAGIC, 8))
+    {
+        fprintf(stderr,"error : not a chunked delta\n");
+        exit(EXIT_FAILURE);
+    }
+    if((unsigned long long)st.st_size != hdr.peerSize)
+    {
+        fprintf(stderr,"error : %s no longer matches the signature the delta was computed against\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    //copies may come from anywhere in the file, so the result is staged in
+    //an unlinked file and only written over the target once it checked out.
+    //The target keeps its inode: owner, xattrs, links and its tree
+    size_t tmpSize = strlen(filename)+sizeof(".treesync.XXXXXX");
+    char* tmp = malloc(tmpSize);
+    snprintf(tmp, tmpSize, "%s.treesync.XXXXXX", filename);
+    int out = mkstemp(tmp);
+    if(out < 0 || unlink(tmp))
+    {
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char* buf = malloc(CHUNK_MAX);
+    unsigned char check[DIGEST_SIZE];
+    unsigned long long total = 0;
+    sha256 whole;
+    sha256Init(&whole);
+    chunkOp op;
+    for(readAll(in, &op, sizeof(op));op.type != CHUNK_END;readAll(in, &op, sizeof(op)))
+    {
+        if(op.len > CHUNK_MAX || (op.type != CHUNK_COPY && op.type != CHUNK_DATA))
+        {
+            fprintf(stderr,"error : corrupted delta\n");
+            exit(EXIT_FAILURE);
+        }
+        if(op.type == CHUNK_DATA)
+            readAll(in, buf, op.len);
+        else if(op.off > hdr.peerSize || pread(fd, buf, op.len, op.off) != (ssize_t)op.len)
+        {
+            fprintf(stderr,"error : %s no longer holds the chunk at %llu\n", filename, op.off);
+            exit(EXIT_FAILURE);
+        }
+
+        sha256Data(buf, op.len, check);
+        if(memcmp(check, op.digest, DIGEST_SIZE))
+        {
+            if(op.type == CHUNK_DATA)
+                fprintf(stderr,"error : corrupted delta, chunk at %llu\n", total);
+            else
+                fprintf(stderr,"error : %s changed since its signature, chunk at %llu\n", filename, op.off);
+            exit(EXIT_FAILURE);
+        }
+        if(pwrite(out, buf, op.len, total) != (ssize_t)op.len)
+        {
+            perror(tmp);
+            exit(EXIT_FAILURE);
+        }
+        sha256Update(&whole, buf, op.len);
+        total += op.len;
+    }
+    closeStream(in);
+
+    sha256Final(&whole, check);
+    if(total != hdr.size || memcmp(check, hdr.digest, DIGEST_SIZE))
+    {
+        fprintf(stderr,"error : the rebuilt file does not match the source\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //only the blocks that differ are written, so only their leaves change.
+    //Interrupted from here on, the target is left part updated: take a new
+    //signature of it and compute the delta again
+    unsigned char* old = malloc(CHUNK_MAX);
+    for(unsigned long long off = 0;off < total;)
+    {
+        size_t len = total-off < CHUNK_MAX ? total-off : CHUNK_MAX;
+        ssize_t got = pread(fd, old, len, off);
+        if(pread(out, buf, len, off) != (ssize_t)len || got < 0)
+        {
+            perror(tmp);
+            exit(EXIT_FAILURE);
+        }
+        for(size_t b = 0;b < len;b += BLOCKSIZE)
+        {
+            size_t n = len-b < BLOCKSIZE ? len-b : BLOCKSIZE;
+            if((ssize_t)(b+n) <= got && !memcmp(old+b, buf+b, n))
+                continue;
+            if(pwrite(fd, buf+b, n, off+b) != (ssize_t)n)
+            {
+                perror(filename);
+                exit(EXIT_FAILURE);
+            }
+        }
+        off += len;
+    }
+    if(ftruncate(fd, total) || fsync(fd))
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    free(old);
+    free(buf);
+    close(out);
+    close(fd);
+    free(tmp);
+    return 0;
+}
+
+//--------------------
+//--------------------
+//        main
+//--------------------
+//--------------------
+
+int main (int argc, char *argv[])
+{
+    //check arguments, "-" is stdin or stdout
+    if(argc == 4 && !strcmp(argv[1],"export"))
+        return doExport(argv[2], argv[3]);
+    if(argc == 5 && !strcmp(argv[1],"delta"))
+        return doDelta(argv[2], argv[3], argv[4], 0);
+    if(argc == 6 && !strcmp(argv[1],"delta") && !strcmp(argv[2],"-w"))
+        return doDelta(argv[3], argv[4], argv[5], 1);
+    if(argc == 4 && !strcmp(argv[1],"apply"))
+        return doApply(argv[2], argv[3]);
+    if(argc == 4 && !strcmp(argv[1],"signature"))
+        return doSignature(argv[2], argv[3]);
+    if(argc == 5 && !strcmp(argv[1],"cdelta"))
+        return doChunkDelta(argv[2], argv[3], argv[4]);
+    if(argc == 4 && !strcmp(argv[1],"capply"))
+        return doChunkApply(argv[2], argv[3]);
+
+    printf("Missing arguments expected\n"
+           "  treesync export <file> <tree>\n"
+           "  treesync delta [-w] <file> <peer tree> <delta>\n"
+           "  treesync apply <file> <delta>\n"
+           "  treesync signature <file> <sig>\n"
+           "  treesync cdelta <file> <peer sig> <delta>\n"
+           "  treesync capply <file> <delta>\n");
+    return -1;
+}